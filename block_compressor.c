@@ -34,8 +34,12 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include <string.h>
 #include <strings.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 #include <time.h>
+#include <pthread.h>
 #include <lzo/lzo1x.h>
 #include "csnappy.h"
 #include <zlib.h>
@@ -84,6 +88,7 @@ static int lzo_decompress(
 	uint32_t ilen,
 	char *dst,
 	uint32_t *dst_len,
+	int full,
 	void *opaque)
 {
 	lzo_uint olen = *dst_len;
@@ -118,9 +123,10 @@ static void snappy_compress(
 	void *opaque)
 {
 	char *end;
-	end = csnappy_compress_fragment(src, ilen, dst,
-		opaque, WMSIZE_ORDER);
-	*dst_len = end - dst;
+	/* Only worth storing compressed if it is smaller than the input. */
+	end = csnappy_compress_fragment_bounded(src, ilen, dst,
+		opaque, WMSIZE_ORDER, ilen - 1);
+	*dst_len = end ? end - dst : ilen;
 }
 
 static int snappy_decompress(
@@ -128,12 +134,48 @@ static int snappy_decompress(
 	uint32_t ilen,
 	char *dst,
 	uint32_t *dst_len,
+	int full,
 	void *opaque)
 {
 	return csnappy_decompress_noheader(src, ilen, dst, dst_len);
 }
 
 
+/*
+ * Same format as snappy, using the fixed size page kernels. Pages of any
+ * other size (and a short last page) go through the generic functions.
+ * The working memory from snappy_compress_init is large enough for both.
+ * As with snappy, compression gives up as soon as a page will not shrink.
+ */
+static void snappy4k_compress(
+	const char *src,
+	uint32_t ilen,
+	char *dst,
+	uint32_t *dst_len,
+	void *opaque)
+{
+	char *end;
+	if (ilen == CSNAPPY_PAGE4K_BYTES)
+		end = csnappy_compress_page4k(src, dst, opaque, ilen - 1);
+	else
+		end = csnappy_compress_fragment_bounded(src, ilen, dst,
+			opaque, WMSIZE_ORDER, ilen - 1);
+	*dst_len = end ? end - dst : ilen;
+}
+
+static int snappy4k_decompress(
+	const char *src,
+	uint32_t ilen,
+	char *dst,
+	uint32_t *dst_len,
+	int full,
+	void *opaque)
+{
+	if (full && *dst_len == CSNAPPY_PAGE4K_BYTES)
+		return csnappy_decompress_page4k(src, ilen, dst);
+	return csnappy_decompress_noheader(src, ilen, dst, dst_len);
+}
+
 static void* zlib_compress_init(void)
 {
 	z_stream *zs;
@@ -200,6 +242,7 @@ static int zlib_decompress(
 	uint32_t ilen,
 	char *dst,
 	uint32_t *dst_len,
+	int full,
 	void *opaque)
 {
 	z_stream *zs = opaque;
@@ -220,15 +263,22 @@ enum {
 	LZO = 0,
 	SNAPPY = 1,
 	ZLIB = 2,
+	SNAPPY4K = 3,
 };
 
-static const char* const COMPRESSORS[] = { "LZO", "SNAPPY", "ZLIB" };
+static const char* const COMPRESSORS[] = {
+	"LZO", "SNAPPY", "ZLIB", "SNAPPY4K"
+};
 
 typedef void (*compress_fn)(const char *src, uint32_t ilen, char *dst,
 				uint32_t *dst_len, void *opaque);
 
+/*
+ * "full" is set for every page but the last, which must decompress to
+ * exactly *dst_len bytes; the last page of a file may be shorter.
+ */
 typedef int (*decompress_fn)(const char *src, uint32_t ilen, char *dst,
-				uint32_t *dst_len, void *opaque);
+				uint32_t *dst_len, int full, void *opaque);
 
 struct compressor_funcs {
 	void* (*compress_init)(void);
@@ -246,6 +296,8 @@ static const struct compressor_funcs compressors[] = {
 		noop, noop_p, snappy_decompress},
 	{zlib_compress_init, zlib_compress_free, zlib_compress,
 		zlib_decompress_init, zlib_decompress_free, zlib_decompress},
+	{snappy_compress_init, snappy_compress_free, snappy4k_compress,
+		noop, noop_p, snappy4k_decompress},
 };
 
 #define ONE_BILLION 1000000000
@@ -272,14 +324,190 @@ union intbytes {
 	char c[4];
 };
 
+/*
+ * Pages of a single repeated word (e.g. zero pages) are not compressed;
+ * their length entry has this bit set and the data is the 8 byte word.
+ */
+#define SAME_FILLED	0x80000000U
+
+/* Length entries read back from a file are checked before they are used. */
+static int bad_entry(uint32_t entry)
+{
+	uint32_t len = entry & ~SAME_FILLED;
+	if (entry & SAME_FILLED)
+		return len != sizeof(uint64_t);
+	return len > PAGE_SIZE;
+}
+
+/*
+ * Per-page latencies go into a log-bucket histogram in the style of
+ * HdrHistogram: each power of two of nanoseconds is split into 16 linear
+ * sub-buckets, so a percentile is off by at most 1/16 of its value.
+ */
+#define SUB_BUCKET_BITS	4
+#define SUB_BUCKETS	(1 << SUB_BUCKET_BITS)
+#define NR_BUCKETS	((64 - SUB_BUCKET_BITS + 1) * SUB_BUCKETS)
+
+struct page_stats {
+	uint32_t counts[4];	/* <= 50%, > 50%, > 100% (stored), filled */
+	uint32_t ratio[10];	/* compressed pages, by size in 10% steps */
+	uint64_t latency[NR_BUCKETS];
+	uint64_t nr_pages, total_ns, max_ns;
+};
+
+static int latency_bucket(uint64_t ns)
+{
+	if (ns < SUB_BUCKETS)
+		return ns;
+	int e = 63 - __builtin_clzll(ns);
+	return (e - SUB_BUCKET_BITS + 1) * SUB_BUCKETS +
+		((ns >> (e - SUB_BUCKET_BITS)) & (SUB_BUCKETS - 1));
+}
+
+/* The largest value that falls in bucket "i". */
+static uint64_t bucket_limit(int i)
+{
+	if (i < SUB_BUCKETS)
+		return i;
+	int e = i / SUB_BUCKETS + SUB_BUCKET_BITS - 1;
+	uint64_t sub = SUB_BUCKETS + i % SUB_BUCKETS;
+	return ((sub + 1) << (e - SUB_BUCKET_BITS)) - 1;
+}
+
+static void record_latency(struct page_stats *stats,
+			   struct timespec *t1, struct timespec *t2)
+{
+	uint64_t ns = (t2->tv_sec - t1->tv_sec) * (uint64_t)ONE_BILLION +
+		t2->tv_nsec - t1->tv_nsec;
+	stats->latency[latency_bucket(ns)]++;
+	stats->nr_pages++;
+	stats->total_ns += ns;
+	if (ns > stats->max_ns)
+		stats->max_ns = ns;
+}
+
+static void merge_stats(struct page_stats *to, const struct page_stats *from)
+{
+	for (int i = 0; i < 4; i++)
+		to->counts[i] += from->counts[i];
+	for (int i = 0; i < 10; i++)
+		to->ratio[i] += from->ratio[i];
+	for (int i = 0; i < NR_BUCKETS; i++)
+		to->latency[i] += from->latency[i];
+	to->nr_pages += from->nr_pages;
+	to->total_ns += from->total_ns;
+	if (from->max_ns > to->max_ns)
+		to->max_ns = from->max_ns;
+}
+
+static uint64_t percentile(const struct page_stats *stats, double p)
+{
+	uint64_t rank = (uint64_t)(p * stats->nr_pages + 0.999999), seen = 0;
+	for (int i = 0; i < NR_BUCKETS; i++) {
+		seen += stats->latency[i];
+		if (seen >= rank && seen)
+			return bucket_limit(i) < stats->max_ns ?
+				bucket_limit(i) : stats->max_ns;
+	}
+	return 0;
+}
+
+static void print_stats(int method, int decompress,
+			const struct page_stats *stats)
+{
+	if (!decompress) {
+		printf("> 100%%\t:%u\n> 50%%\t:%u\n<= 50%%\t:%u\nfilled\t:%u\n",
+			stats->counts[2], stats->counts[1],
+			stats->counts[0], stats->counts[3]);
+		printf("compressed pages by size:\n");
+		for (int i = 0; i < 10; i++)
+			printf("%d-%d%%\t:%u\n", i * 10, i * 10 + 10,
+			       stats->ratio[i]);
+	}
+	printf("%s %s ns/page: p50 %llu p90 %llu p99 %llu p99.9 %llu "
+		"max %llu\n", COMPRESSORS[method],
+		decompress ? "decompress" : "compress",
+		(unsigned long long)percentile(stats, 0.5),
+		(unsigned long long)percentile(stats, 0.9),
+		(unsigned long long)percentile(stats, 0.99),
+		(unsigned long long)percentile(stats, 0.999),
+		(unsigned long long)stats->max_ns);
+}
+
+/*
+ * Compresses one page into "obuf" and returns its length entry. "*wbuf"
+ * is set to what should be stored: the compressed data, or the page
+ * itself if compression did not make it smaller.
+ */
+static uint32_t compress_page(compress_fn compress, void *opaque,
+			      char *ibuf, uint32_t ilen, char *obuf,
+			      char **wbuf, struct page_stats *stats)
+{
+	uint32_t *counts = stats->counts, olen = 2 * PAGE_SIZE;
+	struct timespec t1, t2;
+	uint64_t fill;
+	int filled;
+	*wbuf = obuf;
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	filled = ilen == PAGE_SIZE && csnappy_is_same_filled(ibuf, ilen, &fill);
+	if (!filled)
+		compress(ibuf, ilen, obuf, &olen, opaque);
+	clock_gettime(CLOCK_MONOTONIC, &t2);
+	record_latency(stats, &t1, &t2);
+	if (filled) {
+		memcpy(obuf, &fill, sizeof(fill));
+		counts[3]++;
+		return sizeof(fill) | SAME_FILLED;
+	}
+	if (olen < ilen)
+		stats->ratio[(uint64_t)olen * 10 / ilen]++;
+	if (olen >= ilen) {
+		olen = ilen;
+		*wbuf = ibuf;
+		counts[2]++;
+	} else if (olen > (PAGE_SIZE / 2)) {
+		counts[1]++;
+	} else {
+		counts[0]++;
+	}
+	return olen;
+}
+
+/*
+ * Restores one page from its length entry and stored data, into "obuf"
+ * unless it was stored as is. Sets "*wbuf" to the page, returns its length.
+ * "full" is clear only for the last page, which may be short.
+ */
+static uint32_t decompress_page(decompress_fn decompress, void *opaque,
+				char *ibuf, uint32_t entry, int full,
+				char *obuf, char **wbuf,
+				struct page_stats *stats)
+{
+	uint32_t ilen = entry & ~SAME_FILLED, olen = PAGE_SIZE;
+	struct timespec t1, t2;
+	*wbuf = obuf;
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	if (entry & SAME_FILLED) {
+		for (olen = 0; olen < PAGE_SIZE; olen += ilen)
+			memcpy(obuf + olen, ibuf, ilen);
+	} else if (ilen == PAGE_SIZE) {
+		*wbuf = ibuf;
+	} else {
+		if (decompress(ibuf, ilen, obuf, &olen, full, opaque))
+			handle_error("decompress");
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t2);
+	record_latency(stats, &t1, &t2);
+	return olen;
+}
+
 static int do_compress(int method, FILE *ifile, FILE *ofile)
 {
 	union intbytes intbuf;
 	char *ibuf, *obuf, *opaque;
 	compress_fn compress = compressors[method].compress;
-	uint32_t counts[3] = { 0 };
-	struct timespec t1, t2, elapsed;
-	memset(&elapsed, 0, sizeof(elapsed));
+	struct page_stats stats;
+	memset(&stats, 0, sizeof(stats));
 	if (!(ibuf = malloc(PAGE_SIZE)))
 		handle_error("malloc");
 	if (!(obuf = malloc(2 * PAGE_SIZE)))
@@ -308,40 +536,28 @@ static int do_compress(int method, FILE *ifile, FILE *ofile)
 		uint32_t ilen = fread(ibuf, 1, PAGE_SIZE, ifile);
 		if (ilen < PAGE_SIZE && !feof(ifile))
 			handle_error("fread");
-		uint32_t olen = 2 * PAGE_SIZE;
-		clock_gettime(CLOCK_MONOTONIC, &t1);
-		compress(ibuf, ilen, obuf, &olen, opaque);
-		clock_gettime(CLOCK_MONOTONIC, &t2);
-		char *wbuf = obuf;
-		if (olen >= ilen) {
-			olen = ilen;
-			wbuf = ibuf;
-			counts[2]++;
-		} else if (olen > (PAGE_SIZE / 2)) {
-			counts[1]++;
-		} else {
-			counts[0]++;
-		}
+		char *wbuf;
+		uint32_t entry = compress_page(compress, opaque, ibuf, ilen,
+					       obuf, &wbuf, &stats);
+		uint32_t olen = entry & ~SAME_FILLED;
 		if (fseek(ofile, (i + 1) * sizeof(uint32_t), SEEK_SET) == -1)
 			handle_error("fseek");
-		intbuf.i = olen;
+		intbuf.i = entry;
 		if (fwrite(&intbuf.c, 1, 4, ofile) < 4)
 			handle_error("fwrite");
 		if (fseek(ofile, 0, SEEK_END) == -1)
 			handle_error("fseek");
 		if (fwrite(wbuf, 1, olen, ofile) < olen)
 			handle_error("fwrite");
-		add_time_diff(&elapsed, &t1, &t2);
 	}
 	fclose(ofile);
 	fclose(ifile);
 	free(obuf);
 	free(ibuf);
 	compressors[method].compress_free(opaque);
-	printf("> 100%%\t:%u\n> 50%%\t:%u\n<= 50%%\t:%u\n"
-		"%d.%09ld seconds\n",
-		counts[2],counts[1],counts[0],
-		(int)elapsed.tv_sec, elapsed.tv_nsec);
+	print_stats(method, 0, &stats);
+	printf("%d.%09ld seconds\n", (int)(stats.total_ns / ONE_BILLION),
+		(long)(stats.total_ns % ONE_BILLION));
 	return 0;
 }
 
@@ -350,8 +566,10 @@ static int do_decompress(int method, FILE *ifile, FILE *ofile)
 	union intbytes intbuf;
 	char *ibuf, *obuf, *opaque;
 	decompress_fn decompress = compressors[method].decompress;
+	struct page_stats stats;
 	uint64_t ipos;
 	uint32_t nr_pages;
+	memset(&stats, 0, sizeof(stats));
 	if (!(ibuf = malloc(2 * PAGE_SIZE)))
 		handle_error("malloc");
 	if (!(obuf = malloc(PAGE_SIZE)))
@@ -367,20 +585,18 @@ static int do_decompress(int method, FILE *ifile, FILE *ofile)
 			handle_error("fseek");
 		if (fread(&intbuf.c, 1, 4, ifile) < 4)
 			handle_error("fread");
-		uint32_t ilen = intbuf.i;
+		if (bad_entry(intbuf.i))
+			handle_error("bad page length");
+		uint32_t ilen = intbuf.i & ~SAME_FILLED;
 		if (fseek(ifile, ipos, SEEK_SET) == -1)
 			handle_error("fseek");
 		if (fread(ibuf, 1, ilen, ifile) < ilen)
 			handle_error("fread");
 		ipos += ilen;
-		uint32_t olen = PAGE_SIZE;
-		char *wbuf = obuf;
-		if (ilen == PAGE_SIZE) {
-			wbuf = ibuf;
-		} else {
-			if (decompress(ibuf, ilen, obuf, &olen, opaque))
-				handle_error("decompress");
-		}
+		char *wbuf;
+		uint32_t olen = decompress_page(decompress, opaque, ibuf,
+						intbuf.i, i + 1 < nr_pages,
+						obuf, &wbuf, &stats);
 		if (fwrite(wbuf, 1, olen, ofile) < olen)
 			handle_error("fwrite");
 		printf("%d -> %d\n", ilen, olen);
@@ -390,16 +606,397 @@ static int do_decompress(int method, FILE *ifile, FILE *ofile)
 	free(obuf);
 	free(ibuf);
 	compressors[method].decompress_free(opaque);
+	print_stats(method, 1, &stats);
+	return 0;
+}
+
+
+/*
+ * Pipelined -j mode: the main thread reads batches of pages into a ring
+ * of slots, a pool of workers (each with its own compressor state)
+ * compresses or decompresses whole batches, and a writer thread stores
+ * them in order. The length table is kept in memory: the compressor
+ * writes it once at the end, the decompressor reads it once at the start,
+ * so neither seeks per page. Output is the same as in the one page at a
+ * time mode.
+ */
+#define BATCH_PAGES 64
+
+enum { SLOT_FREE, SLOT_READ, SLOT_DONE };
+
+struct batch {
+	char *ibuf, *obuf;
+	char *wbuf[BATCH_PAGES];
+	uint32_t ilen[BATCH_PAGES];	/* page bytes or length entry */
+	uint32_t olen[BATCH_PAGES];	/* length entry or page bytes */
+	uint32_t first_page, nr_pages;
+	int state;
+};
+
+struct pipeline {
+	int method, decompress, nr_slots;
+	FILE *ifile, *ofile;
+	struct batch *slots;
+	uint32_t *table;
+	uint32_t nr_pages, nr_batches;
+	uint32_t next_read, next_work;
+	struct page_stats stats;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+};
+
+static void wait_slot(struct pipeline *p, struct batch *b, int state)
+{
+	pthread_mutex_lock(&p->lock);
+	while (b->state != state)
+		pthread_cond_wait(&p->cond, &p->lock);
+	pthread_mutex_unlock(&p->lock);
+}
+
+static void set_slot(struct pipeline *p, struct batch *b, int state)
+{
+	pthread_mutex_lock(&p->lock);
+	b->state = state;
+	pthread_cond_broadcast(&p->cond);
+	pthread_mutex_unlock(&p->lock);
+}
+
+static void *pipeline_worker(void *opaque)
+{
+	struct pipeline *p = opaque;
+	const struct compressor_funcs *f = &compressors[p->method];
+	void *state = p->decompress ? f->decompress_init() : f->compress_init();
+	struct page_stats *stats = calloc(1, sizeof(*stats));
+	if (!stats)
+		handle_error("calloc");
+	for (;;) {
+		pthread_mutex_lock(&p->lock);
+		while (p->next_work == p->next_read &&
+		       p->next_work < p->nr_batches)
+			pthread_cond_wait(&p->cond, &p->lock);
+		uint32_t n = p->next_work;
+		if (n < p->nr_batches)
+			p->next_work++;
+		pthread_mutex_unlock(&p->lock);
+		if (n == p->nr_batches)
+			break;
+		struct batch *b = &p->slots[n % p->nr_slots];
+		char *ip = b->ibuf;
+		for (uint32_t i = 0; i < b->nr_pages; i++) {
+			char *op = b->obuf + i * 2 * PAGE_SIZE;
+			if (p->decompress) {
+				b->olen[i] = decompress_page(f->decompress,
+					state, ip, b->ilen[i],
+					b->first_page + i + 1 < p->nr_pages,
+					op, &b->wbuf[i], stats);
+				ip += b->ilen[i] & ~SAME_FILLED;
+			} else {
+				b->olen[i] = compress_page(f->compress, state,
+					ip, b->ilen[i], op, &b->wbuf[i],
+					stats);
+				ip += PAGE_SIZE;
+			}
+		}
+		set_slot(p, b, SLOT_DONE);
+	}
+	pthread_mutex_lock(&p->lock);
+	merge_stats(&p->stats, stats);
+	pthread_mutex_unlock(&p->lock);
+	free(stats);
+	if (p->decompress)
+		f->decompress_free(state);
+	else
+		f->compress_free(state);
+	return NULL;
+}
+
+static void *pipeline_writer(void *opaque)
+{
+	struct pipeline *p = opaque;
+	for (uint32_t n = 0; n < p->nr_batches; n++) {
+		struct batch *b = &p->slots[n % p->nr_slots];
+		wait_slot(p, b, SLOT_DONE);
+		for (uint32_t i = 0; i < b->nr_pages; i++) {
+			uint32_t len = p->decompress ? b->olen[i] :
+				b->olen[i] & ~SAME_FILLED;
+			if (fwrite(b->wbuf[i], 1, len, p->ofile) < len)
+				handle_error("fwrite");
+			if (p->decompress)
+				printf("%d -> %d\n",
+				       b->ilen[i] & ~SAME_FILLED, len);
+			else
+				p->table[b->first_page + i] = b->olen[i];
+		}
+		set_slot(p, b, SLOT_FREE);
+	}
+	return NULL;
+}
+
+/* Fills a free slot with the next batch; the main thread's part. */
+static void pipeline_read(struct pipeline *p, struct batch *b, uint32_t n)
+{
+	b->first_page = n * BATCH_PAGES;
+	b->nr_pages = p->nr_pages - b->first_page;
+	if (b->nr_pages > BATCH_PAGES)
+		b->nr_pages = BATCH_PAGES;
+	if (p->decompress) {
+		size_t len = 0;
+		for (uint32_t i = 0; i < b->nr_pages; i++) {
+			b->ilen[i] = p->table[b->first_page + i];
+			if (bad_entry(b->ilen[i]))
+				handle_error("bad page length");
+			len += b->ilen[i] & ~SAME_FILLED;
+		}
+		if (fread(b->ibuf, 1, len, p->ifile) < len)
+			handle_error("fread");
+		return;
+	}
+	size_t len = fread(b->ibuf, 1, (size_t)b->nr_pages * PAGE_SIZE,
+			   p->ifile);
+	if (len < (size_t)b->nr_pages * PAGE_SIZE && !feof(p->ifile))
+		handle_error("fread");
+	for (uint32_t i = 0; i < b->nr_pages; i++)
+		b->ilen[i] = len - (size_t)i * PAGE_SIZE < (size_t)PAGE_SIZE ?
+			len - (size_t)i * PAGE_SIZE : PAGE_SIZE;
+}
+
+static int do_pipelined(int method, int decompress, FILE *ifile, FILE *ofile,
+			int nr_threads)
+{
+	struct pipeline p;
+	union intbytes intbuf;
+	pthread_t writer, *workers;
+	struct timespec t1, t2, elapsed;
+	memset(&p, 0, sizeof(p));
+	memset(&elapsed, 0, sizeof(elapsed));
+	p.method = method;
+	p.decompress = decompress;
+	p.ifile = ifile;
+	p.ofile = ofile;
+	p.nr_slots = 2 * nr_threads + 2;
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	if (decompress) {
+		if (fread(&intbuf.c, 1, 4, ifile) < 4)
+			handle_error("fread");
+		p.nr_pages = intbuf.i;
+		printf("nr_pages: %u\n", p.nr_pages);
+	} else {
+		if (fseek(ifile, 0, SEEK_END) == -1)
+			handle_error("fseek");
+		long input_length = ftell(ifile);
+		if (fseek(ifile, 0, SEEK_SET) == -1)
+			handle_error("fseek");
+		long nr_pages = DIV_ROUND_UP(input_length, PAGE_SIZE);
+		if (nr_pages > UINT32_MAX)
+			handle_error("inut file too big");
+		p.nr_pages = nr_pages;
+		printf("compressor: %s\n", COMPRESSORS[method]);
+		printf("#pages: %u\n", p.nr_pages);
+	}
+	if (!(p.table = malloc(((size_t)p.nr_pages + 1) * sizeof(uint32_t))))
+		handle_error("malloc");
+	if (decompress) {
+		if (fread(p.table, sizeof(uint32_t), p.nr_pages, ifile) <
+		    p.nr_pages)
+			handle_error("fread");
+	} else if (fseek(ofile, ((off_t)p.nr_pages + 1) * sizeof(uint32_t),
+			 SEEK_SET) == -1) {
+		handle_error("fseek");
+	}
+	p.nr_batches = DIV_ROUND_UP(p.nr_pages, BATCH_PAGES);
+	if (!(p.slots = calloc(p.nr_slots, sizeof(*p.slots))))
+		handle_error("calloc");
+	for (int i = 0; i < p.nr_slots; i++) {
+		p.slots[i].ibuf = malloc(BATCH_PAGES * 2 * PAGE_SIZE);
+		p.slots[i].obuf = malloc(BATCH_PAGES * 2 * PAGE_SIZE);
+		if (!p.slots[i].ibuf || !p.slots[i].obuf)
+			handle_error("malloc");
+	}
+	pthread_mutex_init(&p.lock, NULL);
+	pthread_cond_init(&p.cond, NULL);
+	if (!(workers = malloc(nr_threads * sizeof(*workers))))
+		handle_error("malloc");
+	for (int i = 0; i < nr_threads; i++)
+		if (pthread_create(&workers[i], NULL, pipeline_worker, &p))
+			handle_error("pthread_create");
+	if (pthread_create(&writer, NULL, pipeline_writer, &p))
+		handle_error("pthread_create");
+	for (uint32_t n = 0; n < p.nr_batches; n++) {
+		struct batch *b = &p.slots[n % p.nr_slots];
+		wait_slot(&p, b, SLOT_FREE);
+		pipeline_read(&p, b, n);
+		pthread_mutex_lock(&p.lock);
+		b->state = SLOT_READ;
+		p.next_read++;
+		pthread_cond_broadcast(&p.cond);
+		pthread_mutex_unlock(&p.lock);
+	}
+	for (int i = 0; i < nr_threads; i++)
+		pthread_join(workers[i], NULL);
+	pthread_join(writer, NULL);
+	if (!decompress) {
+		if (fseek(ofile, 0, SEEK_SET) == -1)
+			handle_error("fseek");
+		intbuf.i = p.nr_pages;
+		if (fwrite(&intbuf.c, 1, 4, ofile) < 4)
+			handle_error("fwrite");
+		if (fwrite(p.table, sizeof(uint32_t), p.nr_pages, ofile) <
+		    p.nr_pages)
+			handle_error("fwrite");
+	}
+	fclose(ofile);
+	fclose(ifile);
+	clock_gettime(CLOCK_MONOTONIC, &t2);
+	add_time_diff(&elapsed, &t1, &t2);
+	for (int i = 0; i < p.nr_slots; i++) {
+		free(p.slots[i].obuf);
+		free(p.slots[i].ibuf);
+	}
+	pthread_cond_destroy(&p.cond);
+	pthread_mutex_destroy(&p.lock);
+	free(workers);
+	free(p.slots);
+	free(p.table);
+	print_stats(method, decompress, &p.stats);
+	printf("%d.%09ld seconds wall clock, %d threads\n",
+		(int)elapsed.tv_sec, elapsed.tv_nsec, nr_threads);
+	return 0;
+}
+
+/*
+ * -m mode: the input is mapped read-only and pages are compressed straight
+ * from the mapping. Compressed output goes out with one pwritev per batch,
+ * pages stored as is pointing into the input mapping, and the length table
+ * is written once at the end. Decompression maps the output file, sized
+ * for whole pages up front, and decodes each page into place; the file is
+ * cut to its real length at the end.
+ */
+static int do_mmap(int method, int decompress, const char *ifile_name,
+		   const char *ofile_name)
+{
+	const struct compressor_funcs *f = &compressors[method];
+	struct page_stats stats;
+	struct stat st;
+	uint32_t nr_pages, *table;
+	char *in, *out, *obuf, *wbuf, *opaque;
+	struct iovec iov[BATCH_PAGES];
+	int ifd, ofd;
+	memset(&stats, 0, sizeof(stats));
+	if ((ifd = open(ifile_name, O_RDONLY)) < 0) {
+		perror("open of ifile_name");
+		return 2;
+	}
+	if ((ofd = open(ofile_name, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0) {
+		perror("open of ofile_name");
+		return 3;
+	}
+	if (fstat(ifd, &st))
+		handle_error("fstat");
+	in = st.st_size ? mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, ifd, 0)
+			: NULL;
+	if (in == MAP_FAILED)
+		handle_error("mmap");
+	if (in)
+		madvise(in, st.st_size, MADV_SEQUENTIAL);
+	if (decompress) {
+		if (st.st_size < 4)
+			handle_error("input file too short");
+		memcpy(&nr_pages, in, 4);
+		printf("nr_pages: %u\n", nr_pages);
+		if (((uint64_t)nr_pages + 1) * 4 > (uint64_t)st.st_size)
+			handle_error("input file too short");
+		table = (uint32_t *)in + 1;
+		size_t out_length = (size_t)nr_pages * PAGE_SIZE;
+		if (ftruncate(ofd, out_length))
+			handle_error("ftruncate");
+		out = out_length ? mmap(NULL, out_length,
+					PROT_READ | PROT_WRITE,
+					MAP_SHARED, ofd, 0) : NULL;
+		if (out == MAP_FAILED)
+			handle_error("mmap");
+		opaque = f->decompress_init();
+		uint64_t ipos = ((uint64_t)nr_pages + 1) * 4;
+		uint32_t olen = 0;
+		for (uint32_t i = 0; i < nr_pages; i++) {
+			uint32_t ilen = table[i] & ~SAME_FILLED;
+			if (bad_entry(table[i]) ||
+			    ipos + ilen > (uint64_t)st.st_size)
+				handle_error("bad page length");
+			obuf = out + (size_t)i * PAGE_SIZE;
+			olen = decompress_page(f->decompress, opaque, in + ipos,
+					       table[i], i + 1 < nr_pages,
+					       obuf, &wbuf, &stats);
+			if (wbuf != obuf)
+				memcpy(obuf, wbuf, olen);
+			printf("%d -> %d\n", ilen, olen);
+			ipos += ilen;
+		}
+		f->decompress_free(opaque);
+		if (out_length) {
+			munmap(out, out_length);
+			if (ftruncate(ofd, out_length - PAGE_SIZE + olen))
+				handle_error("ftruncate");
+		}
+		goto out;
+	}
+	uint64_t nr = DIV_ROUND_UP((uint64_t)st.st_size, PAGE_SIZE);
+	if (nr > UINT32_MAX)
+		handle_error("inut file too big");
+	nr_pages = nr;
+	printf("compressor: %s\n", COMPRESSORS[method]);
+	printf("#pages: %u\n", nr_pages);
+	if (!(table = malloc(((size_t)nr_pages + 1) * sizeof(uint32_t))))
+		handle_error("malloc");
+	if (!(obuf = malloc(BATCH_PAGES * 2 * PAGE_SIZE)))
+		handle_error("malloc");
+	opaque = f->compress_init();
+	off_t opos = ((off_t)nr_pages + 1) * sizeof(uint32_t);
+	for (uint32_t i = 0; i < nr_pages; i += BATCH_PAGES) {
+		uint32_t n = nr_pages - i < BATCH_PAGES ? nr_pages - i :
+			BATCH_PAGES;
+		size_t batch_bytes = 0;
+		for (uint32_t j = 0; j < n; j++) {
+			off_t ipos = (off_t)(i + j) * PAGE_SIZE;
+			uint32_t ilen = st.st_size - ipos < PAGE_SIZE ?
+				st.st_size - ipos : PAGE_SIZE;
+			table[i + j] = compress_page(f->compress, opaque,
+				in + ipos, ilen, obuf + j * 2 * PAGE_SIZE,
+				&wbuf, &stats);
+			iov[j].iov_base = wbuf;
+			iov[j].iov_len = table[i + j] & ~SAME_FILLED;
+			batch_bytes += iov[j].iov_len;
+		}
+		if (pwritev(ofd, iov, n, opos) != (ssize_t)batch_bytes)
+			handle_error("pwritev");
+		opos += batch_bytes;
+	}
+	f->compress_free(opaque);
+	iov[0].iov_base = &nr_pages;
+	iov[0].iov_len = sizeof(nr_pages);
+	iov[1].iov_base = table;
+	iov[1].iov_len = (size_t)nr_pages * sizeof(uint32_t);
+	if (pwritev(ofd, iov, 2, 0) != (ssize_t)(iov[0].iov_len + iov[1].iov_len))
+		handle_error("pwritev");
+	free(obuf);
+	free(table);
+out:
+	if (st.st_size)
+		munmap(in, st.st_size);
+	close(ofd);
+	close(ifd);
+	print_stats(method, decompress, &stats);
+	printf("%d.%09ld seconds\n", (int)(stats.total_ns / ONE_BILLION),
+		(long)(stats.total_ns % ONE_BILLION));
 	return 0;
 }
 
 int main(int argc, char * const argv[])
 {
-	int c, compressor = -1, decompress = 0;
+	int c, compressor = -1, decompress = 0, nr_threads = 0, use_mmap = 0;
 	const char *ifile_name, *ofile_name;
 	FILE *ifile, *ofile;
 
-	while((c = getopt(argc, argv, "c:d")) != -1) {
+	while((c = getopt(argc, argv, "c:dj:m")) != -1) {
 		switch (c) {
 		case 'c':
 			if (strcasecmp(optarg, COMPRESSORS[LZO]) == 0)
@@ -408,20 +1005,36 @@ int main(int argc, char * const argv[])
 				compressor = SNAPPY;
 			else if (strcasecmp(optarg, COMPRESSORS[ZLIB]) == 0)
 				compressor = ZLIB;
+			else if (strcasecmp(optarg, COMPRESSORS[SNAPPY4K]) == 0)
+				compressor = SNAPPY4K;
 			else
 				goto usage;
 			break;
 		case 'd':
 			decompress = 1;
 			break;
+		case 'j':
+			nr_threads = atoi(optarg);
+			if (nr_threads <= 0)
+				goto usage;
+			break;
+		case 'm':
+			use_mmap = 1;
+			break;
 		default:
 			goto usage;
 		}
 	}
 	if (optind > argc - 2)
 		goto usage;
+	if (use_mmap && nr_threads)
+		goto usage;
 	ifile_name = argv[optind];
 	ofile_name = argv[optind + 1];
+	PAGE_SIZE = (int)sysconf(_SC_PAGE_SIZE);
+	PAGE_SHIFT = ffs(PAGE_SIZE) - 1;
+	if (use_mmap)
+		return do_mmap(compressor, decompress, ifile_name, ofile_name);
 	if (!(ifile = fopen(ifile_name, "rb"))) {
 		perror("fopen of ifile_name");
 		return 2;
@@ -430,14 +1043,16 @@ int main(int argc, char * const argv[])
 		perror("fopen of ofile_name");
 		return 3;
 	}
-	PAGE_SIZE = (int)sysconf(_SC_PAGE_SIZE);
-	PAGE_SHIFT = ffs(PAGE_SIZE) - 1;
+	if (nr_threads)
+		return do_pipelined(compressor, decompress, ifile, ofile,
+				    nr_threads);
 	if (!decompress)
 		return do_compress(compressor, ifile, ofile);
 	else
 		return do_decompress(compressor, ifile, ofile);
 usage:
 	fprintf(stderr,
-		"usage: block_compressor -c lzo|snappy|zlib [-d] ifile ofile\n");
+		"usage: block_compressor -c lzo|snappy|snappy4k|zlib [-d] "
+		"[-j N | -m] ifile ofile\n");
 	return 1;
 }
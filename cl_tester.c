@@ -1,8 +1,10 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
 #include <unistd.h>
 #include <sys/mman.h>
+#include <sys/uio.h>
 #include <signal.h>
 #include "csnappy.h"
 #ifndef MAP_ANONYMOUS
@@ -64,12 +66,20 @@ out:
 	return retval;
 }
 
-static int do_compress(FILE *ifile, FILE *ofile)
+enum { MODE_FAST, MODE_HIGH, MODE_LARGE };
+
+static int do_compress(FILE *ifile, FILE *ofile, int mode, int nr_threads,
+		       int acceleration, int workmem_order)
 {
 	char *ibuf, *obuf;
 	void *working_memory;
 	uint32_t ilen, olen, max_compressed_len;
 
+	if (!workmem_order)
+		workmem_order = mode == MODE_LARGE ?
+			CSNAPPY_LARGE_WORKMEM_BYTES_POWER_OF_TWO :
+			CSNAPPY_WORKMEM_BYTES_POWER_OF_TWO;
+
 	if (!(ibuf = (char *)malloc(MAX_INPUT_SIZE))) {
 		fprintf(stderr, "malloc failed to allocate %d.\n", MAX_INPUT_SIZE);
 		fclose(ifile);
@@ -95,15 +105,35 @@ static int do_compress(FILE *ifile, FILE *ofile)
 		return 4;
 	}
 
-	if (!(working_memory = malloc(CSNAPPY_WORKMEM_BYTES))) {
-		fprintf(stderr, "malloc failed to allocate %d bytes.\n", CSNAPPY_WORKMEM_BYTES);
+	if (!(working_memory = malloc(1 << workmem_order))) {
+		fprintf(stderr, "malloc failed to allocate %d bytes.\n", 1 << workmem_order);
 		free(ibuf);
 		fclose(ofile);
 		return 4;
 	}
 
-	csnappy_compress(ibuf, ilen, obuf, &olen,
-			working_memory, CSNAPPY_WORKMEM_BYTES_POWER_OF_TWO);
+	if (nr_threads) {
+		if (csnappy_compress_parallel(ibuf, ilen, obuf, &olen,
+				workmem_order, nr_threads) != CSNAPPY_E_OK) {
+			fprintf(stderr, "csnappy_compress_parallel failed.\n");
+			free(ibuf);
+			free(working_memory);
+			free(obuf);
+			fclose(ofile);
+			return 4;
+		}
+	} else if (mode == MODE_HIGH)
+		csnappy_compress_hc(ibuf, ilen, obuf, &olen,
+				working_memory, workmem_order);
+	else if (mode == MODE_LARGE)
+		csnappy_compress_large(ibuf, ilen, obuf, &olen,
+				working_memory, workmem_order);
+	else if (acceleration)
+		csnappy_compress_ex(ibuf, ilen, obuf, &olen,
+				working_memory, workmem_order, acceleration);
+	else
+		csnappy_compress(ibuf, ilen, obuf, &olen,
+				working_memory, workmem_order);
 	free(ibuf);
 	free(working_memory);
 
@@ -113,6 +143,239 @@ static int do_compress(FILE *ifile, FILE *ofile)
 	return 0;
 }
 
+/*
+ * Feeds the compressed input to the stream decompressor "chunk" bytes at
+ * a time, without ever holding all of it in memory.
+ */
+static int do_decompress_stream(FILE *ifile, FILE *ofile, uint32_t chunk)
+{
+	struct csnappy_decompress_stream stream;
+	char header[5], *ibuf, *obuf;
+	uint32_t hlen, ilen, olen;
+	int status, retval = 0;
+
+	hlen = fread(header, 1, sizeof(header), ifile);
+	if ((status = csnappy_get_uncompressed_length(header, hlen, &olen)) < 0) {
+		fprintf(stderr, "snappy_get_uncompressed_length returned %d.\n", status);
+		fclose(ifile);
+		fclose(ofile);
+		return 6;
+	}
+	if (!(ibuf = (char *)malloc(chunk)) || !(obuf = (char *)malloc(olen))) {
+		fprintf(stderr, "malloc failed.\n");
+		free(ibuf);
+		fclose(ifile);
+		fclose(ofile);
+		return 4;
+	}
+	csnappy_decompress_stream_init(&stream, obuf, olen);
+	status = csnappy_decompress_stream_update(&stream, header, hlen);
+	while (status == CSNAPPY_E_OK &&
+	       (ilen = fread(ibuf, 1, chunk, ifile)) > 0)
+		status = csnappy_decompress_stream_update(&stream, ibuf, ilen);
+	if (status == CSNAPPY_E_OK)
+		status = csnappy_decompress_stream_finish(&stream, &olen);
+	fclose(ifile);
+	free(ibuf);
+	if (status != CSNAPPY_E_OK) {
+		fprintf(stderr, "csnappy_decompress_stream returned %d.\n", status);
+		retval = 7;
+	} else {
+		fwrite(obuf, 1, olen, ofile);
+	}
+	fclose(ofile);
+	free(obuf);
+	return retval;
+}
+
+static int write_file(void *opaque, const char *buf, uint32_t len)
+{
+	return fwrite(buf, 1, len, (FILE *)opaque) == len ? 0 : -1;
+}
+
+/*
+ * Compresses the input "chunk" bytes at a time in constant memory, so it
+ * is not limited to MAX_INPUT_SIZE. The input must be seekable, to learn
+ * its length for the header.
+ */
+static int do_compress_stream(FILE *ifile, FILE *ofile, uint32_t chunk)
+{
+	struct csnappy_compress_stream stream;
+	char *ibuf, *buffer;
+	void *working_memory;
+	long total;
+	uint32_t ilen;
+	int status, retval = 0;
+
+	if (fseek(ifile, 0, SEEK_END) || (total = ftell(ifile)) < 0 ||
+	    total > (long)UINT32_MAX || fseek(ifile, 0, SEEK_SET)) {
+		fprintf(stderr, "cannot determine input length.\n");
+		fclose(ifile);
+		fclose(ofile);
+		return 5;
+	}
+	ibuf = (char *)malloc(chunk);
+	buffer = (char *)malloc(CSNAPPY_COMPRESS_STREAM_BUFFER_BYTES);
+	working_memory = malloc(CSNAPPY_WORKMEM_BYTES);
+	if (!ibuf || !buffer || !working_memory) {
+		fprintf(stderr, "malloc failed.\n");
+		retval = 4;
+		goto out;
+	}
+	csnappy_compress_stream_init(&stream, total, buffer, working_memory,
+			CSNAPPY_WORKMEM_BYTES_POWER_OF_TWO, write_file, ofile);
+	status = CSNAPPY_E_OK;
+	while (status == CSNAPPY_E_OK &&
+	       (ilen = fread(ibuf, 1, chunk, ifile)) > 0)
+		status = csnappy_compress_stream_update(&stream, ibuf, ilen);
+	if (status == CSNAPPY_E_OK)
+		status = csnappy_compress_stream_finish(&stream);
+	if (status != CSNAPPY_E_OK) {
+		fprintf(stderr, "csnappy_compress_stream returned %d.\n", status);
+		retval = 7;
+	}
+out:
+	free(working_memory);
+	free(buffer);
+	free(ibuf);
+	fclose(ifile);
+	fclose(ofile);
+	return retval;
+}
+
+/*
+ * Framing format in either direction, in constant memory. Works on pipes.
+ */
+static int do_framed(FILE *ifile, FILE *ofile, int decompress)
+{
+	struct csnappy_framed_compress enc;
+	struct csnappy_framed_decompress dec;
+	char *ibuf, *buffer;
+	void *working_memory = NULL;
+	uint32_t ilen;
+	int status = CSNAPPY_E_OK, retval = 0;
+
+	ibuf = (char *)malloc(CSNAPPY_FRAMED_CHUNK_BYTES);
+	buffer = (char *)malloc(decompress ?
+			CSNAPPY_FRAMED_DECOMPRESS_BUFFER_BYTES :
+			CSNAPPY_FRAMED_COMPRESS_BUFFER_BYTES);
+	if (!decompress)
+		working_memory = malloc(CSNAPPY_WORKMEM_BYTES);
+	if (!ibuf || !buffer || (!decompress && !working_memory)) {
+		fprintf(stderr, "malloc failed.\n");
+		retval = 4;
+		goto out;
+	}
+	if (decompress)
+		csnappy_framed_decompress_init(&dec, buffer, write_file, ofile);
+	else
+		csnappy_framed_compress_init(&enc, buffer, working_memory,
+			CSNAPPY_WORKMEM_BYTES_POWER_OF_TWO, write_file, ofile);
+	while (status == CSNAPPY_E_OK &&
+	       (ilen = fread(ibuf, 1, CSNAPPY_FRAMED_CHUNK_BYTES, ifile)) > 0)
+		status = decompress ?
+			csnappy_framed_decompress_update(&dec, ibuf, ilen) :
+			csnappy_framed_compress_update(&enc, ibuf, ilen);
+	if (status == CSNAPPY_E_OK)
+		status = decompress ?
+			csnappy_framed_decompress_finish(&dec) :
+			csnappy_framed_compress_finish(&enc);
+	if (status != CSNAPPY_E_OK) {
+		fprintf(stderr, "csnappy_framed returned %d.\n", status);
+		retval = 7;
+	}
+out:
+	free(working_memory);
+	free(buffer);
+	free(ibuf);
+	fclose(ifile);
+	fclose(ofile);
+	return retval;
+}
+
+/*
+ * Seekable container. Compression streams the input in; decompression
+ * maps the file (or reads stdin into memory) and reads the data back
+ * "chunk" bytes at a time through csnappy_seekable_read.
+ */
+#define SEEKABLE_BLOCK_BYTES (1 << 16)
+static int do_seekable(FILE *ifile, FILE *ofile, const char *ifile_name,
+		       int decompress, uint32_t chunk)
+{
+	struct csnappy_seekable_compress enc;
+	struct csnappy_seekable reader;
+	char *ibuf = NULL, *buf;
+	void *working_memory = NULL;
+	uint64_t offset;
+	uint32_t ilen, n;
+	int status, finish_status, retval = 0;
+
+	if (!chunk)
+		chunk = 1 << 20;
+	if (!(buf = (char *)malloc(chunk))) {
+		fprintf(stderr, "malloc failed.\n");
+		retval = 4;
+		goto out;
+	}
+	if (!decompress) {
+		if (!(working_memory = malloc(CSNAPPY_WORKMEM_BYTES))) {
+			fprintf(stderr, "malloc failed.\n");
+			retval = 4;
+			goto out;
+		}
+		status = csnappy_seekable_compress_init(&enc,
+				SEEKABLE_BLOCK_BYTES, CSNAPPY_SEEKABLE_CHECKSUMS,
+				working_memory, CSNAPPY_WORKMEM_BYTES_POWER_OF_TWO,
+				write_file, ofile);
+		while (status == CSNAPPY_E_OK &&
+		       (ilen = fread(buf, 1, chunk, ifile)) > 0)
+			status = csnappy_seekable_compress_update(&enc, buf, ilen);
+		finish_status = csnappy_seekable_compress_finish(&enc);
+		if (status == CSNAPPY_E_OK)
+			status = finish_status;
+		if (status != CSNAPPY_E_OK) {
+			fprintf(stderr, "csnappy_seekable_compress returned %d.\n", status);
+			retval = 7;
+		}
+		goto out;
+	}
+	if (ifile_name) {
+		status = csnappy_seekable_open_file(&reader, ifile_name);
+	} else {
+		if (!(ibuf = (char *)malloc(MAX_INPUT_SIZE))) {
+			fprintf(stderr, "malloc failed.\n");
+			retval = 4;
+			goto out;
+		}
+		ilen = fread(ibuf, 1, MAX_INPUT_SIZE, ifile);
+		status = csnappy_seekable_open(&reader, ibuf, ilen);
+	}
+	if (status != CSNAPPY_E_OK) {
+		fprintf(stderr, "csnappy_seekable_open returned %d.\n", status);
+		retval = 6;
+		goto out;
+	}
+	for (offset = 0; offset < reader.length; offset += n) {
+		n = reader.length - offset < chunk ?
+			(uint32_t)(reader.length - offset) : chunk;
+		status = csnappy_seekable_read(&reader, offset, buf, n);
+		if (status != CSNAPPY_E_OK) {
+			fprintf(stderr, "csnappy_seekable_read returned %d.\n", status);
+			retval = 7;
+			break;
+		}
+		fwrite(buf, 1, n, ofile);
+	}
+	csnappy_seekable_close(&reader);
+out:
+	free(working_memory);
+	free(ibuf);
+	free(buf);
+	fclose(ifile);
+	fclose(ofile);
+	return retval;
+}
+
 #define handle_error(msg) \
   do { perror(msg); exit(EXIT_FAILURE); } while (0)
 
@@ -164,9 +427,639 @@ int do_selftest_compression(void)
 	return EXIT_FAILURE;
 }
 
+static int append_buf(void *opaque, const char *buf, uint32_t len)
+{
+	char **p = (char **)opaque;
+	memcpy(*p, buf, len);
+	*p += len;
+	return 0;
+}
+
+/*
+ * Test input for the self-tests: in every "period" bytes, the first "text"
+ * are drawn from 8 letters and compress well, the rest are noise. Reseeds
+ * rand(), so a test that keeps calling it gets the same sequence each run.
+ */
+static void fill_test_input(char *buf, uint32_t len, uint32_t period,
+			    uint32_t text)
+{
+	uint32_t i;
+	srand(1);
+	for (i = 0; i < len; i++)
+		buf[i] = i % period < text ?
+			"abcdefgh"[rand() % 8] : (char)rand();
+}
+
+/*
+ * Returns "len" writable bytes that end right at an inaccessible page, so
+ * that writing even one byte past them faults.
+ */
+static char *guarded_alloc(uint32_t len)
+{
+	long page = sysconf(_SC_PAGE_SIZE);
+	uint32_t map_len = (len + page - 1) / page * page;
+	char *map = (char*)mmap(NULL, map_len + page,
+		    PROT_READ | PROT_WRITE,
+		    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (map == MAP_FAILED)
+		handle_error("mmap");
+	if (mprotect(map + map_len, page, PROT_NONE))
+		handle_error("mprotect");
+	return map + map_len - len;
+}
+
+static void guarded_free(char *buf, uint32_t len)
+{
+	long page = sysconf(_SC_PAGE_SIZE);
+	uint32_t map_len = (len + page - 1) / page * page;
+	if (munmap(buf + len - map_len, map_len + page))
+		handle_error("munmap");
+}
+
+/*
+ * Known CRC32C value, a hand made framed stream with every kind of chunk,
+ * and the same stream with a bad checksum, fed one byte at a time.
+ */
+static const char framed[] =
+	"\xff\x06\x00\x00sNaPpY"
+	"\xfe\x02\x00\x00\x00\x00"
+	"\x01\x07\x00\x00\x61\x8a\xbe\xfe" "foo"
+	"\x80\x00\x00\x00"
+	"\x00\x0b\x00\x00\xae\x64\x51\x7c\x09\x08" "bar" "\x09\x03"
+	"\xff\x06\x00\x00sNaPpY";
+int do_selftest_framed(void)
+{
+	struct csnappy_framed_decompress dec;
+	char buffer[CSNAPPY_FRAMED_DECOMPRESS_BUFFER_BYTES];
+	char out[16], *op;
+	char bad[sizeof(framed) - 1];
+	uint32_t i;
+	int ret;
+
+	if (csnappy_crc32c(0, "123456789", 9) != 0xe3069283) {
+		fprintf(stderr, "csnappy_crc32c returned wrong value\n");
+		return EXIT_FAILURE;
+	}
+	op = out;
+	csnappy_framed_decompress_init(&dec, buffer, append_buf, &op);
+	for (i = 0, ret = 0; i < sizeof(framed) - 1 && !ret; i++)
+		ret = csnappy_framed_decompress_update(&dec, framed + i, 1);
+	if (!ret)
+		ret = csnappy_framed_decompress_finish(&dec);
+	if (ret || op - out != 12 || memcmp(out, "foobarbarbar", 12)) {
+		fprintf(stderr, "csnappy_framed_decompress failed: %d\n", ret);
+		return EXIT_FAILURE;
+	}
+	memcpy(bad, framed, sizeof(bad));
+	bad[20] ^= 1;
+	op = out;
+	csnappy_framed_decompress_init(&dec, buffer, append_buf, &op);
+	ret = csnappy_framed_decompress_update(&dec, bad, sizeof(bad));
+	if (ret != CSNAPPY_E_CHECKSUM_BAD) {
+		fprintf(stderr, "csnappy_framed_decompress, bad checksum: %d\n", ret);
+		return EXIT_FAILURE;
+	}
+	return 0;
+}
+
+/*
+ * Round trips a few pages through the batch calls, then checks that a page
+ * that does not fit and a truncated page fail without affecting the others,
+ * both when compressing and when decompressing.
+ */
+#define BATCH_PAGES 5
+int do_selftest_batch(void)
+{
+	struct csnappy_batch_item items[BATCH_PAGES], bounded[BATCH_PAGES];
+	char *ibuf, *cbuf, *obuf, *workmem;
+	uint32_t i, page = 4096, max = csnappy_max_compressed_length(4096);
+	uint32_t ok, clen, budget[BATCH_PAGES];
+
+	ibuf = (char *)malloc(BATCH_PAGES * page);
+	cbuf = (char *)malloc(BATCH_PAGES * max);
+	obuf = (char *)malloc(BATCH_PAGES * page);
+	workmem = (char *)malloc(CSNAPPY_WORKMEM_BYTES);
+	if (!ibuf || !cbuf || !obuf || !workmem)
+		handle_error("malloc");
+	fill_test_input(ibuf, BATCH_PAGES * page, BATCH_PAGES * page, 2 * page);
+	for (i = 0; i < BATCH_PAGES; i++) {
+		items[i].input = ibuf + i * page;
+		items[i].input_length = page;
+		items[i].output = cbuf + i * max;
+		items[i].max_output = max;
+	}
+	if ((ok = csnappy_compress_batch(items, BATCH_PAGES, workmem,
+			CSNAPPY_WORKMEM_BYTES_POWER_OF_TWO)) != BATCH_PAGES) {
+		fprintf(stderr, "csnappy_compress_batch: %u ok\n", ok);
+		return EXIT_FAILURE;
+	}
+	/*
+	 * Again with budgets below the worst case: one byte short of the
+	 * compressed size must fail, the exact size or more must give the
+	 * same output. Each budget ends at a guard page.
+	 */
+	for (i = 0; i < BATCH_PAGES; i++) {
+		clen = items[i].output_length;
+		budget[i] = i == 0 || i == 3 ? clen - 1 :
+			i == 1 ? clen : (clen + max) / 2;
+		bounded[i] = items[i];
+		bounded[i].output = guarded_alloc(budget[i]);
+		bounded[i].max_output = budget[i];
+	}
+	ok = csnappy_compress_batch(bounded, BATCH_PAGES, workmem,
+			CSNAPPY_WORKMEM_BYTES_POWER_OF_TWO);
+	for (i = 0; i < BATCH_PAGES; i++) {
+		clen = items[i].output_length;
+		if (budget[i] < clen ?
+		    bounded[i].status != CSNAPPY_E_OUTPUT_INSUF :
+		    (bounded[i].status != CSNAPPY_E_OK ||
+		     bounded[i].output_length != clen ||
+		     memcmp(bounded[i].output, items[i].output, clen)) ||
+		    budget[i] >= max) {
+			fprintf(stderr, "csnappy_compress_batch, page %u with "
+				"budget %u of %u: %d\n", i, budget[i], clen,
+				bounded[i].status);
+			return EXIT_FAILURE;
+		}
+		guarded_free(bounded[i].output, budget[i]);
+	}
+	if (ok != BATCH_PAGES - 2) {
+		fprintf(stderr, "csnappy_compress_batch, bounded: %u ok\n", ok);
+		return EXIT_FAILURE;
+	}
+	for (i = 0; i < BATCH_PAGES; i++) {
+		items[i].input = items[i].output;
+		items[i].input_length = items[i].output_length;
+		items[i].output = obuf + i * page;
+		items[i].max_output = page;
+	}
+	ok = csnappy_decompress_batch(items, BATCH_PAGES);
+	if (ok != BATCH_PAGES || memcmp(ibuf, obuf, BATCH_PAGES * page)) {
+		fprintf(stderr, "csnappy_decompress_batch: %u ok\n", ok);
+		return EXIT_FAILURE;
+	}
+	items[0].max_output = page - 1;
+	items[3].input_length -= 100;
+	ok = csnappy_decompress_batch(items, BATCH_PAGES);
+	if (ok != BATCH_PAGES - 2 ||
+	    items[0].status != CSNAPPY_E_OUTPUT_OVERRUN ||
+	    items[3].status != CSNAPPY_E_DATA_MALFORMED ||
+	    items[1].output_length != page || items[4].output_length != page) {
+		fprintf(stderr, "csnappy_decompress_batch, bad items: %u ok\n", ok);
+		return EXIT_FAILURE;
+	}
+	free(workmem);
+	free(obuf);
+	free(cbuf);
+	free(ibuf);
+	return 0;
+}
+
+/*
+ * Round trips data that crosses fragment boundaries through the iovec calls,
+ * split into odd sized segments (empty ones included) on both sides.
+ */
+#define IOV_BYTES (3 * 32768 + 1000)
+#define IOV_SEGMENTS 64
+int do_selftest_iov(void)
+{
+	static const uint32_t sizes[] = { 1, 7, 0, 100, 4096, 33000, 3 };
+	struct iovec iov[IOV_SEGMENTS];
+	char *ibuf, *cbuf, *flat, *obuf, *bounce, *workmem;
+	uint32_t i, n, off, clen, flen;
+	int cnt, ret;
+
+	ibuf = (char *)malloc(IOV_BYTES);
+	cbuf = (char *)malloc(csnappy_max_compressed_length(IOV_BYTES));
+	flat = (char *)malloc(csnappy_max_compressed_length(IOV_BYTES));
+	obuf = (char *)malloc(IOV_BYTES);
+	bounce = (char *)malloc(CSNAPPY_FRAGMENT_BYTES);
+	workmem = (char *)malloc(CSNAPPY_WORKMEM_BYTES);
+	if (!ibuf || !cbuf || !flat || !obuf || !bounce || !workmem)
+		handle_error("malloc");
+	fill_test_input(ibuf, IOV_BYTES, 32768, 20000);
+	for (cnt = 0, off = 0; off < IOV_BYTES; cnt++, off += n) {
+		n = sizes[cnt % 7];
+		if (n > IOV_BYTES - off)
+			n = IOV_BYTES - off;
+		iov[cnt].iov_base = ibuf + off;
+		iov[cnt].iov_len = n;
+	}
+	ret = csnappy_compress_iov(iov, cnt, cbuf, &clen, bounce,
+			workmem, CSNAPPY_WORKMEM_BYTES_POWER_OF_TWO);
+	csnappy_compress(ibuf, IOV_BYTES, flat, &flen,
+			workmem, CSNAPPY_WORKMEM_BYTES_POWER_OF_TWO);
+	if (ret || clen != flen || memcmp(cbuf, flat, clen)) {
+		fprintf(stderr, "csnappy_compress_iov differs from csnappy_compress: %d\n", ret);
+		return EXIT_FAILURE;
+	}
+	for (i = 0; i < (uint32_t)cnt; i++)
+		iov[i].iov_base = obuf + ((char *)iov[i].iov_base - ibuf);
+	ret = csnappy_decompress_iov(cbuf, clen, iov, cnt);
+	if (ret || memcmp(ibuf, obuf, IOV_BYTES)) {
+		fprintf(stderr, "csnappy_decompress_iov failed: %d\n", ret);
+		return EXIT_FAILURE;
+	}
+	ret = csnappy_decompress_iov(cbuf, clen, iov, cnt - 1);
+	if (ret != CSNAPPY_E_OUTPUT_INSUF) {
+		fprintf(stderr, "csnappy_decompress_iov, short output: %d\n", ret);
+		return EXIT_FAILURE;
+	}
+	ret = csnappy_decompress_iov(cbuf, clen - 1, iov, cnt);
+	if (ret != CSNAPPY_E_DATA_MALFORMED) {
+		fprintf(stderr, "csnappy_decompress_iov, truncated input: %d\n", ret);
+		return EXIT_FAILURE;
+	}
+	free(workmem);
+	free(bounce);
+	free(obuf);
+	free(flat);
+	free(cbuf);
+	free(ibuf);
+	return 0;
+}
+
+/*
+ * Reads random ranges back from a container with small blocks, then checks
+ * that a corrupted block is caught by its checksum and the one before it
+ * still reads fine.
+ */
+#define SEEKABLE_BYTES 100000
+#define SEEKABLE_BLOCK 1000
+int do_selftest_seekable(void)
+{
+	struct csnappy_seekable_compress enc;
+	struct csnappy_seekable reader;
+	char *ibuf, *cbuf, *obuf, *op, *workmem;
+	const uint8_t *idx;
+	uint32_t i, off, len;
+	int ret;
+
+	ibuf = (char *)malloc(SEEKABLE_BYTES);
+	cbuf = (char *)malloc(2 * SEEKABLE_BYTES);
+	obuf = (char *)malloc(SEEKABLE_BYTES);
+	workmem = (char *)malloc(CSNAPPY_WORKMEM_BYTES);
+	if (!ibuf || !cbuf || !obuf || !workmem)
+		handle_error("malloc");
+	fill_test_input(ibuf, SEEKABLE_BYTES, 3000, 2000);
+	op = cbuf;
+	ret = csnappy_seekable_compress_init(&enc, SEEKABLE_BLOCK,
+			CSNAPPY_SEEKABLE_CHECKSUMS, workmem,
+			CSNAPPY_WORKMEM_BYTES_POWER_OF_TWO, append_buf, &op);
+	for (off = 0; !ret && off < SEEKABLE_BYTES; off += len) {
+		len = rand() % 3000;
+		if (len > SEEKABLE_BYTES - off)
+			len = SEEKABLE_BYTES - off;
+		ret = csnappy_seekable_compress_update(&enc, ibuf + off, len);
+	}
+	if (csnappy_seekable_compress_finish(&enc) || ret ||
+	    (ret = csnappy_seekable_open(&reader, cbuf, op - cbuf))) {
+		fprintf(stderr, "csnappy_seekable_compress failed: %d\n", ret);
+		return EXIT_FAILURE;
+	}
+	for (i = 0; i < 1000; i++) {
+		off = rand() % SEEKABLE_BYTES;
+		len = rand() % (i & 1 ? 10 : 5000);
+		if (len > SEEKABLE_BYTES - off)
+			len = SEEKABLE_BYTES - off;
+		ret = csnappy_seekable_read(&reader, off, obuf, len);
+		if (ret || memcmp(obuf, ibuf + off, len)) {
+			fprintf(stderr, "csnappy_seekable_read(%u, %u): %d\n",
+				off, len, ret);
+			return EXIT_FAILURE;
+		}
+	}
+	ret = csnappy_seekable_read(&reader, SEEKABLE_BYTES - 1, obuf, 2);
+	if (ret != CSNAPPY_E_OUTPUT_OVERRUN) {
+		fprintf(stderr, "csnappy_seekable_read, past the end: %d\n", ret);
+		return EXIT_FAILURE;
+	}
+	/* Flip the last byte of block 50, a literal since it ends in noise. */
+	idx = (const uint8_t *)reader.index + 8 * 51;
+	cbuf[(idx[0] | idx[1] << 8 | idx[2] << 16) - 1] ^= 1;
+	ret = csnappy_seekable_read(&reader, 50 * SEEKABLE_BLOCK, obuf, 10);
+	if (ret != CSNAPPY_E_CHECKSUM_BAD ||
+	    csnappy_seekable_read(&reader, 49 * SEEKABLE_BLOCK, obuf,
+				  SEEKABLE_BLOCK)) {
+		fprintf(stderr, "csnappy_seekable_read, bad block: %d\n", ret);
+		return EXIT_FAILURE;
+	}
+	csnappy_seekable_close(&reader);
+	free(workmem);
+	free(obuf);
+	free(cbuf);
+	free(ibuf);
+	return 0;
+}
+
+/*
+ * Worst case for large window mode: rounds of the same 40000 words, each
+ * round shuffled, so most words last appeared 64KiB or more back and are
+ * followed by a different word than last time. Only 4 byte far matches
+ * are found; the output must still fit csnappy_max_compressed_length(),
+ * which ends right at a guard page.
+ */
+#define LARGE_WORDS 1040000
+#define LARGE_VOCAB 40000
+int do_selftest_large(void)
+{
+	uint32_t ilen = 4 * LARGE_WORDS;
+	uint32_t max_olen = csnappy_max_compressed_length(ilen);
+	uint32_t *words, i, j, round, n, t, olen = 0;
+	char *obuf, *dbuf, *workmem;
+	int ret;
+
+	obuf = guarded_alloc(max_olen);
+	words = (uint32_t *)malloc(ilen);
+	dbuf = (char *)malloc(ilen);
+	workmem = (char *)malloc(1 << 22);
+	if (!words || !dbuf || !workmem)
+		handle_error("malloc");
+	srand(1);
+	for (round = 0; round < LARGE_WORDS; round += LARGE_VOCAB) {
+		n = LARGE_WORDS - round;
+		if (n > LARGE_VOCAB)
+			n = LARGE_VOCAB;
+		for (i = 0; i < n; i++)
+			words[round + i] = i * 2654435761u;
+		for (i = n - 1; i > 0; i--) {
+			j = rand() % (i + 1);
+			t = words[round + i];
+			words[round + i] = words[round + j];
+			words[round + j] = t;
+		}
+	}
+	csnappy_compress_large((const char *)words, ilen, obuf, &olen,
+			workmem, 22);
+	if (olen > max_olen) {
+		fprintf(stderr, "csnappy_compress_large: %u > %u bytes\n",
+			olen, max_olen);
+		return EXIT_FAILURE;
+	}
+	ret = csnappy_decompress(obuf, olen, dbuf, ilen);
+	if (ret || memcmp(dbuf, words, ilen)) {
+		fprintf(stderr, "csnappy_decompress: %d\n", ret);
+		return EXIT_FAILURE;
+	}
+	guarded_free(obuf, max_olen);
+	free(workmem);
+	free(dbuf);
+	free(words);
+	return 0;
+}
+
+/*
+ * csnappy_compress_fragment_bounded on compressible, mixed and
+ * incompressible fragments, with budgets around the size of the unbounded
+ * output and a guard page right after each budget: it must return NULL
+ * exactly when that output does not fit, and the same output otherwise.
+ */
+#define BOUNDED_BYTES 32768
+int do_selftest_bounded(void)
+{
+	static const uint32_t texts[] = { BOUNDED_BYTES, 20000, 0 };
+	char *ibuf, *flat, *obuf, *end, *workmem;
+	uint32_t flen, budget, t;
+	int k;
+
+	ibuf = (char *)malloc(BOUNDED_BYTES);
+	flat = (char *)malloc(csnappy_max_compressed_length(BOUNDED_BYTES));
+	workmem = (char *)malloc(CSNAPPY_WORKMEM_BYTES);
+	if (!ibuf || !flat || !workmem)
+		handle_error("malloc");
+	for (t = 0; t < 3; t++) {
+		fill_test_input(ibuf, BOUNDED_BYTES, BOUNDED_BYTES, texts[t]);
+		flen = csnappy_compress_fragment(ibuf, BOUNDED_BYTES, flat,
+				workmem, CSNAPPY_WORKMEM_BYTES_POWER_OF_TWO) - flat;
+		for (k = 0; k < 43; k++) {
+			/* 0, half, then every budget within 20 bytes of flen. */
+			budget = k == 0 ? 0 : k == 1 ? flen / 2 : flen - 22 + k;
+			obuf = guarded_alloc(budget);
+			end = csnappy_compress_fragment_bounded(ibuf,
+					BOUNDED_BYTES, obuf, workmem,
+					CSNAPPY_WORKMEM_BYTES_POWER_OF_TWO, budget);
+			if (budget < flen ? end != NULL :
+			    (end != obuf + flen || memcmp(obuf, flat, flen))) {
+				fprintf(stderr, "csnappy_compress_fragment_bounded: "
+					"%u bytes of text, budget %u of %u\n",
+					texts[t], budget, flen);
+				return EXIT_FAILURE;
+			}
+			guarded_free(obuf, budget);
+		}
+	}
+	free(workmem);
+	free(flat);
+	free(ibuf);
+	return 0;
+}
+
+/*
+ * The 4KiB page functions: compressed output identical to
+ * csnappy_compress_fragment at workmem order 13, NULL when it does not fit
+ * in max_output (which ends at a guard page), and decompression of
+ * anything that is not exactly one page rejected with the documented error.
+ */
+int do_selftest_page4k(void)
+{
+	static const uint32_t texts[] = { 4096, 3000, 0 };
+	char *ibuf, *flat, *obuf, *dbuf, *end, *workmem;
+	uint32_t flen, t, max = csnappy_max_compressed_length(4097);
+	int ret;
+
+	ibuf = (char *)malloc(4097);
+	flat = (char *)malloc(max);
+	dbuf = (char *)malloc(CSNAPPY_PAGE4K_BYTES);
+	workmem = (char *)malloc(CSNAPPY_PAGE4K_WORKMEM_BYTES);
+	if (!ibuf || !flat || !dbuf || !workmem)
+		handle_error("malloc");
+	for (t = 0; t < 3; t++) {
+		fill_test_input(ibuf, 4097, 4097, texts[t]);
+		flen = csnappy_compress_fragment(ibuf, CSNAPPY_PAGE4K_BYTES,
+				flat, workmem,
+			CSNAPPY_PAGE4K_WORKMEM_BYTES_POWER_OF_TWO) - flat;
+		obuf = guarded_alloc(flen);
+		end = csnappy_compress_page4k(ibuf, obuf, workmem, flen);
+		if (end != obuf + flen || memcmp(obuf, flat, flen) ||
+		    csnappy_compress_page4k(ibuf, obuf, workmem, flen - 1)) {
+			fprintf(stderr, "csnappy_compress_page4k, %u bytes of "
+				"text: bad output\n", texts[t]);
+			return EXIT_FAILURE;
+		}
+		guarded_free(obuf, flen);
+		obuf = guarded_alloc(max);
+		end = csnappy_compress_page4k(ibuf, obuf, workmem, max);
+		if (end != obuf + flen || memcmp(obuf, flat, flen)) {
+			fprintf(stderr, "csnappy_compress_page4k, %u bytes of "
+				"text, unbounded: bad output\n", texts[t]);
+			return EXIT_FAILURE;
+		}
+		guarded_free(obuf, max);
+		ret = csnappy_decompress_page4k(flat, flen, dbuf);
+		if (ret || memcmp(dbuf, ibuf, CSNAPPY_PAGE4K_BYTES)) {
+			fprintf(stderr, "csnappy_decompress_page4k: %d\n", ret);
+			return EXIT_FAILURE;
+		}
+		flen = csnappy_compress_fragment(ibuf, 4095, flat, workmem,
+			CSNAPPY_PAGE4K_WORKMEM_BYTES_POWER_OF_TWO) - flat;
+		ret = csnappy_decompress_page4k(flat, flen, dbuf);
+		if (ret != CSNAPPY_E_DATA_MALFORMED) {
+			fprintf(stderr, "csnappy_decompress_page4k, "
+				"short page: %d\n", ret);
+			return EXIT_FAILURE;
+		}
+		flen = csnappy_compress_fragment(ibuf, 4097, flat, workmem,
+			CSNAPPY_PAGE4K_WORKMEM_BYTES_POWER_OF_TWO) - flat;
+		ret = csnappy_decompress_page4k(flat, flen, dbuf);
+		if (ret != CSNAPPY_E_OUTPUT_OVERRUN) {
+			fprintf(stderr, "csnappy_decompress_page4k, "
+				"long page: %d\n", ret);
+			return EXIT_FAILURE;
+		}
+	}
+	free(workmem);
+	free(dbuf);
+	free(flat);
+	free(ibuf);
+	return 0;
+}
+
+/*
+ * Returns 0 if every copy in the fragment "src" refers back to bytes that
+ * the fragment itself has already produced.
+ */
+static int check_copy_offsets(const char *src, uint32_t src_len)
+{
+	const uint8_t *ip = (const uint8_t *)src;
+	const uint8_t *end = ip + src_len;
+	uint32_t pos = 0, len, offset, n;
+
+	while (ip < end) {
+		len = *ip >> 2;
+		switch (*ip++ & 3) {
+		case 0:
+			if (len >= 60) {
+				/* 1 to 4 more bytes of length, little endian. */
+				n = len - 59;
+				for (len = 0; n--; )
+					len = len << 8 | ip[n];
+				ip += (ip[-1] >> 2) - 59;
+			}
+			ip += len + 1;
+			pos += len + 1;
+			continue;
+		case 1:
+			offset = (len >> 3) << 8 | *ip++;
+			len = 4 + (len & 7);
+			break;
+		case 2:
+			offset = ip[0] | ip[1] << 8;
+			ip += 2;
+			len++;
+			break;
+		default:
+			offset = ip[0] | ip[1] << 8 | ip[2] << 16 |
+				 (uint32_t)ip[3] << 24;
+			ip += 4;
+			len++;
+			break;
+		}
+		if (offset == 0 || offset > pos)
+			return 1;
+		pos += len;
+	}
+	return 0;
+}
+
+/*
+ * Compresses one record with "ctx", then checks that no copy reaches back
+ * before the record's start and that it round trips.
+ */
+static int ctx_record(struct csnappy_compress_ctx *ctx, const char *rec,
+		      uint32_t len, char *cbuf, char *obuf)
+{
+	char *end = csnappy_compress_fragment_ctx(ctx, rec, len, cbuf);
+	uint32_t olen = len;
+	int ret;
+
+	if (check_copy_offsets(cbuf, end - cbuf)) {
+		fprintf(stderr, "csnappy_compress_fragment_ctx at epoch %u: "
+			"copy from before the fragment\n", ctx->epoch);
+		return 1;
+	}
+	ret = csnappy_decompress_noheader(cbuf, end - cbuf, obuf, &olen);
+	if (ret || olen != len || memcmp(rec, obuf, len)) {
+		fprintf(stderr, "csnappy_compress_fragment_ctx at epoch %u: "
+			"round trip failed: %d\n", ctx->epoch, ret);
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * Pushes 300KiB of short, similar records through one compression context,
+ * so the epoch wraps past 2^16 several times and the table is full of
+ * entries from earlier records. Then repeats a record after exactly
+ * 2^16 - k bytes of filler, so that its stale entries land k bytes ahead
+ * of the same data in the repeat (k = 0 is the current position itself):
+ * they must not be used.
+ */
+#define CTX_DICT 4096
+#define CTX_BYTES (300 * 1024)
+#define CTX_RECORD 1000
+int do_selftest_ctx(void)
+{
+	struct csnappy_compress_ctx ctx;
+	char *dict, *rec, *cbuf, *obuf, *workmem;
+	uint32_t total, len, i, k, filler;
+
+	dict = (char *)malloc(CTX_DICT);
+	rec = (char *)malloc(32768);
+	cbuf = (char *)malloc(csnappy_max_compressed_length(32768));
+	obuf = (char *)malloc(32768);
+	workmem = (char *)malloc(1 << 15);
+	if (!dict || !rec || !cbuf || !obuf || !workmem)
+		handle_error("malloc");
+	fill_test_input(dict, CTX_DICT, CTX_DICT, CTX_DICT);
+	csnappy_compress_ctx_init(&ctx, workmem, 15);
+	for (total = 0; total < CTX_BYTES; total += len) {
+		len = 1 + rand() % CTX_RECORD;
+		memcpy(rec, dict + rand() % (CTX_DICT - len), len);
+		for (i = 0; i < 4; i++)
+			rec[rand() % len] = (char)rand();
+		if (ctx_record(&ctx, rec, len, cbuf, obuf))
+			return EXIT_FAILURE;
+	}
+	for (k = 0; k <= 16; k++) {
+		/* 16 letters, 4 times: at k = 16 the stale entries match too. */
+		for (i = 0; i < 64; i++)
+			rec[i] = dict[i % 16];
+		if (ctx_record(&ctx, rec, 64, cbuf, obuf))
+			return EXIT_FAILURE;
+		/* Filler of one repeated byte does not touch the table. */
+		memset(rec, 'z', 32768);
+		for (filler = 65536 - 64 - k; filler; filler -= len) {
+			len = filler < 32768 ? filler : 32768;
+			if (ctx_record(&ctx, rec, len, cbuf, obuf))
+				return EXIT_FAILURE;
+		}
+		for (i = 0; i < 64; i++)
+			rec[i] = dict[i % 16];
+		if (ctx_record(&ctx, rec, 64, cbuf, obuf))
+			return EXIT_FAILURE;
+	}
+	free(workmem);
+	free(obuf);
+	free(cbuf);
+	free(rec);
+	free(dict);
+	return 0;
+}
+
 static const char fake[] = "\x32\xc4\x66\x6f\x6f\x6f\x6f\x6f\x6f";
 int do_selftest_decompression(void)
 {
+	struct csnappy_decompress_stream stream;
 	char *obuf, *ibuf, *workmem;
 	FILE *ifile;
 	int ret;
@@ -194,6 +1087,16 @@ int do_selftest_decompression(void)
 	ibuf = obuf;
 	ilen = olen;
 	olen = PAGE_SIZE;
+	ret = csnappy_validate(ibuf, ilen);
+	if (ret != CSNAPPY_E_OK) {
+		fprintf(stderr, "csnappy_validate returned %d.\n", ret);
+		exit(EXIT_FAILURE);
+	}
+	ret = csnappy_validate(ibuf, ilen - 1);
+	if (ret == CSNAPPY_E_OK) {
+		fprintf(stderr, "csnappy_validate, stream cut off: %d\n", ret);
+		exit(EXIT_FAILURE);
+	}
 	obuf = (char*)mmap(NULL, PAGE_SIZE * 2,
 		    PROT_READ | PROT_WRITE,
 		    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
@@ -233,19 +1136,160 @@ int do_selftest_decompression(void)
 		fprintf(stderr, "csnappy_decompress_noheader, stream cut off mid literal: %d\n", ret);
 		exit(EXIT_FAILURE);
 	}
+	ret = csnappy_validate(fake, 9);
+	if (ret == CSNAPPY_E_OK) {
+		fprintf(stderr, "csnappy_validate, stream cut off mid literal: %d\n", ret);
+		exit(EXIT_FAILURE);
+	}
+	csnappy_decompress_stream_init(&stream, obuf, olen);
+	ret = csnappy_decompress_stream_update(&stream, fake, 9);
+	if (ret == CSNAPPY_E_OK)
+		ret = csnappy_decompress_stream_finish(&stream, &n);
+	if (ret == CSNAPPY_E_OK) {
+		fprintf(stderr, "csnappy_decompress_stream, stream cut off mid literal: %d\n", ret);
+		exit(EXIT_FAILURE);
+	}
 	free(obuf);
 	return 0;
 }
 
+#ifdef CSNAPPY_STATS
+static struct csnappy_stats stats;
+
+static void print_op_stats(const char *name, const struct csnappy_op_stats *s)
+{
+	fprintf(stderr, "%s: %.0f literals of %.0f bytes, "
+		"%.0f copies of %.0f bytes\n", name,
+		(double)s->literal_runs,
+		(double)s->literal_bytes,
+		(double)s->copies,
+		(double)s->copy_bytes);
+}
+
+static void print_stats(void)
+{
+	const struct csnappy_op_stats *e = &stats.emitted, *d = &stats.decoded;
+	int i;
+
+	fprintf(stderr, "hash probes: %.0f, collisions: %.0f (%.1f%%), "
+		"skips: %.0f over %.0f bytes\n",
+		(double)stats.hash_probes,
+		(double)stats.hash_collisions,
+		stats.hash_probes ?
+			100.0 * stats.hash_collisions / stats.hash_probes : 0,
+		(double)stats.skips,
+		(double)stats.skipped_bytes);
+	print_op_stats("emitted", e);
+	print_op_stats("decoded", d);
+	fprintf(stderr, "copy length\temitted\tdecoded\n");
+	for (i = 0; i <= CSNAPPY_STATS_MAX_COPY_LENGTH; i++)
+		if (e->copy_length[i] || d->copy_length[i])
+			fprintf(stderr, "%d\t\t%.0f\t%.0f\n", i,
+				(double)e->copy_length[i],
+				(double)d->copy_length[i]);
+	fprintf(stderr, "offset < 2^n\temitted\tdecoded\n");
+	for (i = 0; i <= CSNAPPY_STATS_OFFSET_BITS; i++)
+		if (e->copy_offset[i] || d->copy_offset[i])
+			fprintf(stderr, "%d\t\t%.0f\t%.0f\n", i,
+				(double)e->copy_offset[i],
+				(double)d->copy_offset[i]);
+}
+
+static int check_op_stats(const char *name, const struct csnappy_op_stats *s,
+			  uint32_t length)
+{
+	uint64_t copies = 0, copy_bytes = 0, offsets = 0;
+	int i;
+
+	for (i = 0; i <= CSNAPPY_STATS_MAX_COPY_LENGTH; i++) {
+		copies += s->copy_length[i];
+		copy_bytes += i * s->copy_length[i];
+	}
+	for (i = 0; i <= CSNAPPY_STATS_OFFSET_BITS; i++)
+		offsets += s->copy_offset[i];
+	if (s->literal_bytes + s->copy_bytes != length ||
+	    copies != s->copies || offsets != s->copies ||
+	    copy_bytes != s->copy_bytes || s->copy_offset[0]) {
+		fprintf(stderr, "%s: counts do not add up\n", name);
+		print_stats();
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * Counts must cover every byte of the input, the decoder must see exactly
+ * the ops the compressor emitted, and incompressible data must skip.
+ */
+#define STATS_BYTES (3 * 32768 + 1000)
+int do_selftest_stats(void)
+{
+	char *ibuf, *cbuf, *obuf, *workmem;
+	uint32_t clen;
+	int mode;
+
+	ibuf = (char *)malloc(STATS_BYTES);
+	cbuf = (char *)malloc(csnappy_max_compressed_length(STATS_BYTES));
+	obuf = (char *)malloc(STATS_BYTES);
+	workmem = (char *)malloc(CSNAPPY_WORKMEM_BYTES);
+	if (!ibuf || !cbuf || !obuf || !workmem)
+		handle_error("malloc");
+	fill_test_input(ibuf, STATS_BYTES, STATS_BYTES, STATS_BYTES / 2);
+	for (mode = MODE_FAST; mode <= MODE_HIGH; mode++) {
+		memset(&stats, 0, sizeof(stats));
+		csnappy_stats_attach(&stats);
+		if (mode == MODE_FAST)
+			csnappy_compress(ibuf, STATS_BYTES, cbuf, &clen, workmem,
+					 CSNAPPY_WORKMEM_BYTES_POWER_OF_TWO);
+		else
+			csnappy_compress_hc(ibuf, STATS_BYTES, cbuf, &clen,
+					    workmem,
+					    CSNAPPY_WORKMEM_BYTES_POWER_OF_TWO);
+		if (csnappy_decompress(cbuf, clen, obuf, STATS_BYTES) !=
+				CSNAPPY_E_OK || memcmp(ibuf, obuf, STATS_BYTES)) {
+			fprintf(stderr, "round trip failed\n");
+			return EXIT_FAILURE;
+		}
+		csnappy_stats_attach(NULL);
+		csnappy_decompress(cbuf, clen, obuf, STATS_BYTES);
+		if (check_op_stats("emitted", &stats.emitted, STATS_BYTES))
+			return EXIT_FAILURE;
+		if (memcmp(&stats.emitted, &stats.decoded,
+			   sizeof(stats.emitted))) {
+			fprintf(stderr, "emitted and decoded ops differ\n");
+			print_stats();
+			return EXIT_FAILURE;
+		}
+		if (mode == MODE_FAST &&
+		    (!stats.hash_collisions || !stats.skips ||
+		     stats.hash_probes <= stats.hash_collisions)) {
+			fprintf(stderr, "no probes, collisions or skips\n");
+			print_stats();
+			return EXIT_FAILURE;
+		}
+	}
+	free(workmem);
+	free(obuf);
+	free(cbuf);
+	free(ibuf);
+	return 0;
+}
+#endif
+
 int main(int argc, char * const argv[])
 {
 	int c;
-	int decompress = 0, files = 1;
+	int decompress = 0, files = 1, mode = MODE_FAST, nr_threads = 0;
+	int chunk = 0, acceleration = 0, workmem_order = 0;
 	int selftest_compression = 0, selftest_decompression = 0;
+	int selftest_framed = 0, selftest_batch = 0, selftest_iov = 0;
+	int framed = 0, seekable = 0, selftest_seekable = 0;
+	int selftest_stats = 0, selftest_large = 0, selftest_bounded = 0;
+	int selftest_ctx = 0, selftest_page4k = 0;
 	const char *ifile_name, *ofile_name;
 	FILE *ifile, *ofile;
 
-	while((c = getopt(argc, argv, "S:dc")) != -1) {
+	while((c = getopt(argc, argv, "S:dcHLA:j:s:FKW:")) != -1) {
 		switch (c) {
 		case 'S':
 			switch (optarg[0]) {
@@ -255,6 +1299,33 @@ int main(int argc, char * const argv[])
 			case 'd':
 				selftest_decompression = 1;
 				break;
+			case 'f':
+				selftest_framed = 1;
+				break;
+			case 'b':
+				selftest_batch = 1;
+				break;
+			case 'i':
+				selftest_iov = 1;
+				break;
+			case 'k':
+				selftest_seekable = 1;
+				break;
+			case 't':
+				selftest_stats = 1;
+				break;
+			case 'l':
+				selftest_large = 1;
+				break;
+			case 'o':
+				selftest_bounded = 1;
+				break;
+			case 'x':
+				selftest_ctx = 1;
+				break;
+			case 'p':
+				selftest_page4k = 1;
+				break;
 			default:
 				goto usage;
 			}
@@ -265,14 +1336,84 @@ int main(int argc, char * const argv[])
 		case 'c':
 			files = 0;
 			break;
+		case 'H':
+			mode = MODE_HIGH;
+			break;
+		case 'L':
+			mode = MODE_LARGE;
+			break;
+		case 'F':
+			framed = 1;
+			break;
+		case 'K':
+			seekable = 1;
+			break;
+		case 's':
+			chunk = atoi(optarg);
+			if (chunk <= 0)
+				goto usage;
+			break;
+		case 'A':
+			acceleration = atoi(optarg);
+			if (acceleration <= 0)
+				goto usage;
+			break;
+		case 'j':
+			nr_threads = atoi(optarg);
+			if (nr_threads <= 0)
+				goto usage;
+			break;
+		case 'W':
+			workmem_order = atoi(optarg);
+			if (workmem_order < 9)
+				goto usage;
+			break;
 		default:
 			goto usage;
 		}
 	}
+	if ((nr_threads || framed || seekable || (chunk && !decompress) ||
+	     acceleration) && mode != MODE_FAST)
+		goto usage;
+	if (acceleration && (nr_threads || framed || chunk || decompress))
+		goto usage;
+	if (seekable && (nr_threads || framed || acceleration))
+		goto usage;
+	if (workmem_order && (framed || seekable || chunk || decompress ||
+	    workmem_order > (mode == MODE_LARGE ? 24 : 16)))
+		goto usage;
 	if (selftest_compression)
 		return do_selftest_compression();
 	if (selftest_decompression)
 		return do_selftest_decompression();
+	if (selftest_framed)
+		return do_selftest_framed();
+	if (selftest_batch)
+		return do_selftest_batch();
+	if (selftest_iov)
+		return do_selftest_iov();
+	if (selftest_seekable)
+		return do_selftest_seekable();
+	if (selftest_large)
+		return do_selftest_large();
+	if (selftest_bounded)
+		return do_selftest_bounded();
+	if (selftest_ctx)
+		return do_selftest_ctx();
+	if (selftest_page4k)
+		return do_selftest_page4k();
+	if (selftest_stats) {
+#ifdef CSNAPPY_STATS
+		return do_selftest_stats();
+#else
+		fprintf(stderr, "built without CSNAPPY_STATS\n");
+		return 1;
+#endif
+	}
+#ifdef CSNAPPY_STATS
+	csnappy_stats_attach(&stats);
+	atexit(print_stats);
+#endif
 	ifile = stdin;
 	ofile = stdout;
 	if (files) {
@@ -289,16 +1430,45 @@ int main(int argc, char * const argv[])
 			return 3;
 		}
 	}
+	if (framed)
+		return do_framed(ifile, ofile, decompress);
+	if (seekable)
+		return do_seekable(ifile, ofile, files ? ifile_name : NULL,
+				   decompress, chunk);
+	if (decompress && chunk)
+		return do_decompress_stream(ifile, ofile, chunk);
 	if (decompress)
 		return do_decompress(ifile, ofile);
+	else if (chunk)
+		return do_compress_stream(ifile, ofile, chunk);
 	else
-		return do_compress(ifile, ofile);
+		return do_compress(ifile, ofile, mode, nr_threads,
+				   acceleration, workmem_order);
 usage:
 	fprintf(stderr,
 	"Usage:\n"
 	"cl_tester [-d] infile outfile\t-\t[de]compress infile to outfile.\n"
 	"cl_tester [-d] -c\t\t-\t[de]compress stdin to stdout.\n"
+	"cl_tester -H ...\t\t-\tCompress in high compression mode.\n"
+	"cl_tester -L ...\t\t-\tCompress in large window mode.\n"
+	"cl_tester -A N ...\t\t-\tCompress faster, N > 1 trades ratio.\n");
+	fprintf(stderr,
+	"cl_tester -j N ...\t\t-\tCompress using N threads.\n"
+	"cl_tester -W N ...\t\t-\tCompress with 2^N bytes of working memory.\n"
+	"cl_tester [-d] -F ...\t\t-\tUse the framing format.\n"
+	"cl_tester [-d] -K ...\t\t-\tUse the seekable container.\n"
+	"cl_tester [-d] -s N ...\t\t-\t[De]compress, reading N bytes at a time.\n"
 	"cl_tester -S c\t\t\t-\tSelf-test compression.\n"
-	"cl_tester -S d\t\t\t-\tSelf-test decompression.\n");
+	"cl_tester -S d\t\t\t-\tSelf-test decompression.\n"
+	"cl_tester -S f\t\t\t-\tSelf-test framing format.\n"
+	"cl_tester -S b\t\t\t-\tSelf-test batch calls.\n"
+	"cl_tester -S i\t\t\t-\tSelf-test iovec calls.\n");
+	fprintf(stderr,
+	"cl_tester -S k\t\t\t-\tSelf-test seekable container.\n"
+	"cl_tester -S l\t\t\t-\tSelf-test large window worst case.\n"
+	"cl_tester -S o\t\t\t-\tSelf-test bounded output.\n"
+	"cl_tester -S x\t\t\t-\tSelf-test compression context.\n"
+	"cl_tester -S p\t\t\t-\tSelf-test 4KiB page calls.\n"
+	"cl_tester -S t\t\t\t-\tSelf-test statistics (CSNAPPY_STATS builds).\n");
 	return 1;
 }
@@ -13,6 +13,10 @@ extern "C" {
 #define CSNAPPY_WORKMEM_BYTES_POWER_OF_TWO 16
 #define CSNAPPY_WORKMEM_BYTES (1 << CSNAPPY_WORKMEM_BYTES_POWER_OF_TWO)
 
+#define CSNAPPY_LARGE_FRAGMENT_BYTES (1 << 22)
+#define CSNAPPY_LARGE_WORKMEM_BYTES_POWER_OF_TWO 20
+#define CSNAPPY_LARGE_WORKMEM_BYTES (1 << CSNAPPY_LARGE_WORKMEM_BYTES_POWER_OF_TWO)
+
 #ifndef __GNUC__
 #define __attribute__(x) /*NOTHING*/
 #endif
@@ -71,6 +75,340 @@ csnappy_compress(
 	void *working_memory,
 	const int workmem_bytes_power_of_two);
 
+/*
+ * Like csnappy_compress, but the input is scattered over "iovcnt" segments
+ * of "iov", e.g. a message held as a chain of buffers. The output is the
+ * same as if the segments were concatenated first. Fragments that lie
+ * within one segment are compressed in place; ones that straddle segments
+ * are gathered into "bounce", of CSNAPPY_FRAGMENT_BYTES, first.
+ * REQUIRES: "compressed" has csnappy_max_compressed_length(total) bytes.
+ * Returns CSNAPPY_E_OK, or CSNAPPY_E_INPUT_NOT_CONSUMED if the total is
+ * 4GiB or more.
+ */
+struct iovec;
+int
+csnappy_compress_iov(
+	const struct iovec *iov,
+	int iovcnt,
+	char *compressed,
+	uint32_t *out_compressed_length,
+	char *bounce,
+	void *working_memory,
+	const int workmem_bytes_power_of_two);
+
+/*
+ * Returns 1 if "input" is a single 8 byte word repeated throughout (e.g. a
+ * zero page, or one filled with one byte), with the last repetition
+ * possibly cut short, and stores that word in "*fill". Returns 0 otherwise
+ * and for input shorter than 16 bytes. The word is taken as it lies in
+ * memory, so copying it over and over to a buffer recreates the input.
+ * Callers can store such buffers as just the fill word. The compressors
+ * check for this themselves and encode such input directly.
+ */
+int
+csnappy_is_same_filled(
+	const char *input,
+	uint32_t input_length,
+	uint64_t *fill);
+
+/*
+ * Variants of csnappy_compress_fragment and csnappy_compress that trade
+ * compression ratio for speed. After 32 bytes without a match the
+ * compressor starts skipping input, checking every other byte, then every
+ * third, and so on; "acceleration" N makes the skip grow N times faster.
+ * 1 (or less) is the default and gives the same output as the functions
+ * above; values above CSNAPPY_MAX_ACCELERATION are treated as that
+ * maximum, which already stops looking for matches after a few probes.
+ * Output is ordinary Snappy data.
+ * On testdata/urls.10K (see userspace_benchmark.txt) output grows from
+ * 50.6% to 53.4% of the input at 8, 56.2% at 16 and 61.3% at 32, while
+ * compression gets 18%, 38% and 72% faster.
+ */
+#define CSNAPPY_MAX_ACCELERATION 65537
+char*
+csnappy_compress_fragment_ex(
+	const char *input,
+	const uint32_t input_length,
+	char *output,
+	void *working_memory,
+	const int workmem_bytes_power_of_two,
+	int acceleration);
+
+void
+csnappy_compress_ex(
+	const char *input,
+	uint32_t input_length,
+	char *compressed,
+	uint32_t *out_compressed_length,
+	void *working_memory,
+	const int workmem_bytes_power_of_two,
+	const int acceleration);
+
+/*
+ * High compression variants of csnappy_compress_fragment and
+ * csnappy_compress. They search up to 8 earlier positions per hash bucket
+ * and evaluate matches lazily, so they are several times slower but
+ * produce smaller output. The output is ordinary Snappy data and
+ * decompresses just as fast.
+ *
+ * Same requirements as the functions above, except:
+ * REQUIRES: 9 <= workmem_bytes_power_of_two <= 16.
+ * Larger working memory gives better compression; for full 32KiB
+ * fragments CSNAPPY_WORKMEM_BYTES_POWER_OF_TWO is recommended.
+ */
+char*
+csnappy_compress_fragment_hc(
+	const char *input,
+	const uint32_t input_length,
+	char *output,
+	void *working_memory,
+	const int workmem_bytes_power_of_two);
+
+void
+csnappy_compress_hc(
+	const char *input,
+	uint32_t input_length,
+	char *compressed,
+	uint32_t *out_compressed_length,
+	void *working_memory,
+	const int workmem_bytes_power_of_two);
+
+/*
+ * Like csnappy_compress_fragment, but never writes more than "max_output"
+ * bytes to "output". Compression stops as soon as the result is known not
+ * to fit, which for incompressible input is usually well before the end,
+ * and NULL is returned. Otherwise the output is identical to that of
+ * csnappy_compress_fragment.
+ * Use it when data is only worth storing compressed below some size, e.g.
+ * a page that must shrink to fit in a smaller slot: "output" then needs
+ * only "max_output" bytes, not csnappy_max_compressed_length().
+ */
+char*
+csnappy_compress_fragment_bounded(
+	const char *input,
+	const uint32_t input_length,
+	char *output,
+	void *working_memory,
+	const int workmem_bytes_power_of_two,
+	const uint32_t max_output);
+
+/*
+ * Fixed size variants for 4KiB pages, e.g. for compressed swap.
+ * These are built from the same code as csnappy_compress_fragment and
+ * csnappy_decompress_noheader, with the page size and table size known at
+ * compile time, so the per call setup and size checks fold away.
+ * csnappy_compress_page4k compresses exactly CSNAPPY_PAGE4K_BYTES of
+ * "input", with working memory of CSNAPPY_PAGE4K_WORKMEM_BYTES, into at
+ * most "max_output" bytes, like csnappy_compress_fragment_bounded: it
+ * returns the end of the output, or NULL if that would not fit. With
+ * max_output of csnappy_max_compressed_length(CSNAPPY_PAGE4K_BYTES) or
+ * more it always fits, and the size checks fold away as well.
+ * The output is identical to csnappy_compress_fragment with
+ * workmem_bytes_power_of_two = CSNAPPY_PAGE4K_WORKMEM_BYTES_POWER_OF_TWO.
+ * csnappy_decompress_page4k is csnappy_decompress_noheader with an output
+ * of exactly CSNAPPY_PAGE4K_BYTES: it returns CSNAPPY_E_DATA_MALFORMED if
+ * "src" decodes to fewer bytes and CSNAPPY_E_OUTPUT_OVERRUN if to more.
+ * REQUIRES: "dst" has CSNAPPY_PAGE4K_BYTES.
+ */
+#define CSNAPPY_PAGE4K_BYTES 4096
+#define CSNAPPY_PAGE4K_WORKMEM_BYTES_POWER_OF_TWO 13
+#define CSNAPPY_PAGE4K_WORKMEM_BYTES \
+	(1 << CSNAPPY_PAGE4K_WORKMEM_BYTES_POWER_OF_TWO)
+char*
+csnappy_compress_page4k(
+	const char *input,
+	char *output,
+	void *working_memory,
+	const uint32_t max_output);
+
+int
+csnappy_decompress_page4k(
+	const char *src,
+	uint32_t src_len,
+	char *dst);
+
+/*
+ * Compresses many independent small buffers (e.g. pages) in one call, each
+ * like csnappy_compress_fragment, sharing the working memory.
+ * For each item, set input, input_length (at most 32KiB), output and
+ * max_output, the space at output. If max_output is below
+ * csnappy_max_compressed_length(input_length), the item is compressed as
+ * with csnappy_compress_fragment_bounded.
+ * On return each item has status CSNAPPY_E_OK and output_length set,
+ * CSNAPPY_E_OUTPUT_INSUF if it did not fit in max_output, or
+ * CSNAPPY_E_INPUT_NOT_CONSUMED if input_length is too large.
+ * REQUIRES: 9 <= workmem_bytes_power_of_two <= 15.
+ *
+ * Returns the number of items compressed successfully.
+ */
+struct csnappy_batch_item {
+	const char *input;
+	uint32_t input_length;
+	char *output;
+	uint32_t max_output;
+	uint32_t output_length;
+	int status;
+};
+
+uint32_t
+csnappy_compress_batch(
+	struct csnappy_batch_item *items,
+	uint32_t nr_items,
+	void *working_memory,
+	const int workmem_bytes_power_of_two);
+
+/*
+ * Large window variants of csnappy_compress_fragment and csnappy_compress.
+ * Input is split into fragments of up to CSNAPPY_LARGE_FRAGMENT_BYTES
+ * instead of 32KiB, and the hash table holds 32bit positions, so matches
+ * can reach back across the whole fragment. Offsets of 64KiB or more use
+ * COPY_4_BYTE_OFFSET, which every Snappy decoder understands, but which
+ * the regular compressor never emits.
+ *
+ * Same requirements as the functions above, except:
+ * REQUIRES: "input" is at most CSNAPPY_LARGE_FRAGMENT_BYTES long
+ * (csnappy_compress_fragment_large only).
+ * REQUIRES: 9 <= workmem_bytes_power_of_two <= 24.
+ * CSNAPPY_LARGE_WORKMEM_BYTES_POWER_OF_TWO is recommended.
+ */
+char*
+csnappy_compress_fragment_large(
+	const char *input,
+	const uint32_t input_length,
+	char *output,
+	void *working_memory,
+	const int workmem_bytes_power_of_two);
+
+void
+csnappy_compress_large(
+	const char *input,
+	uint32_t input_length,
+	char *compressed,
+	uint32_t *out_compressed_length,
+	void *working_memory,
+	const int workmem_bytes_power_of_two);
+
+/*
+ * Compression context for callers that compress many small fragments.
+ * csnappy_compress_fragment clears its whole working memory on every
+ * call. A context clears it once, in csnappy_compress_ctx_init; after
+ * that each table entry is checked against the position of the fragment
+ * being compressed, and entries left over from earlier fragments are
+ * ignored.
+ * The check costs a little on every hash probe, so this only pays off when
+ * working memory is much larger than the fragments, e.g. records of a few
+ * hundred bytes with a 32KiB table. For 4KiB pages with an 8KiB table,
+ * clearing is cheaper and csnappy_compress_fragment is faster.
+ *
+ * Output is a valid fragment, as produced by csnappy_compress_fragment.
+ * REQUIRES: working_memory has (1 << workmem_bytes_power_of_two) bytes
+ * and is used by only this context while the context is in use.
+ * REQUIRES: 9 <= workmem_bytes_power_of_two <= 15.
+ * REQUIRES: "input" is at most 32KiB long.
+ */
+struct csnappy_compress_ctx {
+	void *working_memory;
+	int workmem_bytes_power_of_two;
+	uint32_t epoch;
+};
+
+void
+csnappy_compress_ctx_init(
+	struct csnappy_compress_ctx *ctx,
+	void *working_memory,
+	const int workmem_bytes_power_of_two);
+
+char*
+csnappy_compress_fragment_ctx(
+	struct csnappy_compress_ctx *ctx,
+	const char *input,
+	const uint32_t input_length,
+	char *output);
+
+/*
+ * Multi-threaded csnappy_compress for large inputs (userspace only).
+ * Fragments are compressed by up to nr_threads threads (the calling thread
+ * included), each with its own working memory of
+ * (1 << workmem_bytes_power_of_two) bytes and a scratch buffer of about
+ * 1.2MiB. If nr_threads <= 0, the number of online CPUs is used.
+ * The output is byte-identical to that of csnappy_compress with the same
+ * workmem_bytes_power_of_two.
+ *
+ * REQUIRES: "compressed" must point to an area of memory that is at
+ * least "csnappy_max_compressed_length(input_length)" bytes in length.
+ * REQUIRES: 9 <= workmem_bytes_power_of_two <= 16.
+ *
+ * Returns CSNAPPY_E_OK and sets "*out_compressed_length", or
+ * CSNAPPY_E_NOMEM if no thread could allocate its buffers.
+ */
+int
+csnappy_compress_parallel(
+	const char *input,
+	uint32_t input_length,
+	char *compressed,
+	uint32_t *out_compressed_length,
+	const int workmem_bytes_power_of_two,
+	int nr_threads);
+
+/*
+ * Streaming compression of input that arrives in pieces, in bounded memory:
+ * one fragment of input, one fragment of output and the working memory.
+ * The Snappy header holds the uncompressed length, so the caller must
+ * supply it up front as "total_length".
+ * Whenever a 32KiB fragment is complete it is compressed and handed to
+ * "write" (the first time preceded by the header); csnappy_compress_stream_
+ * finish flushes the last, short fragment. The output is byte-identical
+ * to that of csnappy_compress with the same workmem_bytes_power_of_two.
+ *
+ * REQUIRES: "buffer" has CSNAPPY_COMPRESS_STREAM_BUFFER_BYTES bytes.
+ * REQUIRES: working_memory has (1 << workmem_bytes_power_of_two) bytes.
+ * REQUIRES: 9 <= workmem_bytes_power_of_two <= 16.
+ *
+ * update and finish return CSNAPPY_E_OK or an error code.
+ * Input beyond "total_length" makes update return
+ *  CSNAPPY_E_INPUT_NOT_CONSUMED; finish before all of it was given returns
+ *  CSNAPPY_E_HEADER_BAD. A negative value returned by "write" is passed
+ *  back to the caller. After an error every later call returns it too.
+ */
+#define CSNAPPY_FRAGMENT_BYTES (1 << 15)
+#define CSNAPPY_COMPRESS_STREAM_BUFFER_BYTES \
+	(CSNAPPY_FRAGMENT_BYTES + 5 + 32 + \
+	 CSNAPPY_FRAGMENT_BYTES + CSNAPPY_FRAGMENT_BYTES / 6)
+
+typedef int (*csnappy_write_fn)(void *opaque, const char *buf, uint32_t len);
+
+struct csnappy_compress_stream {
+	char *buffer;
+	uint32_t buffered;
+	uint32_t remaining;
+	int header_written;
+	int status;
+	void *working_memory;
+	int workmem_bytes_power_of_two;
+	csnappy_write_fn write;
+	void *opaque;
+};
+
+void
+csnappy_compress_stream_init(
+	struct csnappy_compress_stream *stream,
+	uint32_t total_length,
+	char *buffer,
+	void *working_memory,
+	const int workmem_bytes_power_of_two,
+	csnappy_write_fn write,
+	void *opaque);
+
+int
+csnappy_compress_stream_update(
+	struct csnappy_compress_stream *stream,
+	const char *input,
+	uint32_t input_length);
+
+int
+csnappy_compress_stream_finish(
+	struct csnappy_compress_stream *stream);
+
 /*
  * Reads header of compressed data to get stored length of uncompressed data.
  * REQUIRES: start points to compressed data.
@@ -118,6 +456,353 @@ csnappy_decompress_noheader(
 	char *dst,
 	uint32_t *dst_len);
 
+/*
+ * Decompresses many independent headerless streams (e.g. pages produced by
+ * csnappy_compress_fragment) in one call, each like
+ * csnappy_decompress_noheader. Uses struct csnappy_batch_item: set input,
+ * input_length, output and max_output, the space at output.
+ * On return each item has output_length and status set; status is
+ * CSNAPPY_E_OK or an error. Batch is at least as strict as
+ * csnappy_decompress_noheader: every stream that call rejects fails here
+ * too, but a stream whose last op is truncated may fail here even though
+ * csnappy_decompress_noheader accepts it.
+ *
+ * Returns the number of items decompressed successfully.
+ */
+uint32_t
+csnappy_decompress_batch(
+	struct csnappy_batch_item *items,
+	uint32_t nr_items);
+
+/*
+ * Checks that "src" is a well formed compressed buffer (with header) that
+ * csnappy_decompress would accept, without writing any output: every
+ * literal lies within the input, every copy offset is within the bytes
+ * produced so far, and the total is exactly the length in the header.
+ * It writes nothing, so it needs no output buffer, but it is only about
+ * 1.2-1.4 times as fast as csnappy_decompress: both are bound by finding
+ * one opcode after the other.
+ * Returns CSNAPPY_E_OK, CSNAPPY_E_HEADER_BAD, CSNAPPY_E_DATA_MALFORMED
+ * (also when the data decodes to fewer bytes than the header says, which
+ * csnappy_decompress does not check) or CSNAPPY_E_OUTPUT_OVERRUN when it
+ * decodes to more.
+ */
+int
+csnappy_validate(
+	const char *src,
+	uint32_t src_len);
+
+/*
+ * Like csnappy_decompress, but the output is scattered over "iovcnt"
+ * segments of "iov", filled in order. Back-references may reach across
+ * segment boundaries. Segments may have any length, including 0.
+ * Returns CSNAPPY_E_OUTPUT_INSUF if the segments hold less than the
+ * uncompressed length, CSNAPPY_E_DATA_MALFORMED if the data decodes to
+ * fewer bytes than that, or any other csnappy_decompress error.
+ */
+int
+csnappy_decompress_iov(
+	const char *src,
+	uint32_t src_len,
+	const struct iovec *iov,
+	int iovcnt);
+
+/*
+ * Resumable decompression of a stream (with header) that arrives in pieces.
+ * The whole output goes to the flat array "dst" of size "dst_len" given to
+ * csnappy_decompress_stream_init; the compressed input can be split
+ * anywhere and is fed through csnappy_decompress_stream_update as it
+ * arrives. Only partial opcodes (at most 5 bytes) are kept between calls;
+ * the input pieces themselves are not referenced once a call returns.
+ *
+ * csnappy_decompress_stream_update returns CSNAPPY_E_OK or an error code.
+ * After an error every later call returns the same error.
+ * If the recorded length in the header is greater than dst_len, returns
+ *  CSNAPPY_E_OUTPUT_INSUF.
+ *
+ * csnappy_decompress_stream_finish checks that the stream ended exactly
+ * after the last opcode and filled the recorded length. If so, sets
+ * *dst_len to the number of bytes decompressed and returns CSNAPPY_E_OK.
+ */
+struct csnappy_decompress_stream {
+	char *dst;
+	char *op;
+	char *op_limit;
+	uint32_t dst_len;
+	uint32_t literal_left;
+	int state;
+	uint32_t tag_len;
+	unsigned char tag[8];
+};
+
+void
+csnappy_decompress_stream_init(
+	struct csnappy_decompress_stream *stream,
+	char *dst,
+	uint32_t dst_len);
+
+int
+csnappy_decompress_stream_update(
+	struct csnappy_decompress_stream *stream,
+	const char *src,
+	uint32_t src_len);
+
+int
+csnappy_decompress_stream_finish(
+	struct csnappy_decompress_stream *stream,
+	uint32_t *dst_len);
+
+/*
+ * CRC32C (Castagnoli) of "len" bytes at "data", continuing from "crc"
+ * (0 to start). Uses the SSE4.2 crc32 instruction where available and
+ * slicing-by-8 tables elsewhere.
+ */
+uint32_t
+csnappy_crc32c(uint32_t crc, const char *data, uint32_t len);
+
+/*
+ * Snappy framing format (framing_format.txt in Google Snappy): a stream
+ * identifier followed by chunks of up to 64KiB of data, compressed or
+ * stored, each carrying the masked CRC32C of its uncompressed contents.
+ * Unlike the raw format it needs no total length up front, and streams
+ * can be concatenated.
+ *
+ * Both directions work like csnappy_compress_stream: input is passed in
+ * pieces of any size and output is handed to "write" as each chunk is
+ * done, so memory use is constant. Errors are sticky and a negative value
+ * returned by "write" is passed back to the caller.
+ *
+ * The encoder needs a buffer of CSNAPPY_FRAMED_COMPRESS_BUFFER_BYTES and
+ * working memory as for csnappy_compress.
+ * REQUIRES: 9 <= workmem_bytes_power_of_two <= 16.
+ *
+ * The decoder needs a buffer of CSNAPPY_FRAMED_DECOMPRESS_BUFFER_BYTES.
+ * Its update returns CSNAPPY_E_HEADER_BAD if the stream does not start
+ * with a stream identifier, CSNAPPY_E_CHECKSUM_BAD on a checksum mismatch
+ * and CSNAPPY_E_DATA_MALFORMED (or any csnappy_decompress error) on a bad
+ * chunk. Its finish returns CSNAPPY_E_DATA_MALFORMED if the input ended
+ * inside a chunk.
+ */
+#define CSNAPPY_FRAMED_CHUNK_BYTES (1 << 16)
+#define CSNAPPY_FRAMED_MAX_CHUNK_LENGTH \
+	(4 + 32 + CSNAPPY_FRAMED_CHUNK_BYTES + CSNAPPY_FRAMED_CHUNK_BYTES / 6)
+#define CSNAPPY_FRAMED_COMPRESS_BUFFER_BYTES \
+	(CSNAPPY_FRAMED_CHUNK_BYTES + 4 + CSNAPPY_FRAMED_MAX_CHUNK_LENGTH)
+#define CSNAPPY_FRAMED_DECOMPRESS_BUFFER_BYTES \
+	(CSNAPPY_FRAMED_MAX_CHUNK_LENGTH + CSNAPPY_FRAMED_CHUNK_BYTES)
+
+struct csnappy_framed_compress {
+	char *buffer;
+	uint32_t buffered;
+	int header_written;
+	int status;
+	void *working_memory;
+	int workmem_bytes_power_of_two;
+	csnappy_write_fn write;
+	void *opaque;
+};
+
+void
+csnappy_framed_compress_init(
+	struct csnappy_framed_compress *stream,
+	char *buffer,
+	void *working_memory,
+	const int workmem_bytes_power_of_two,
+	csnappy_write_fn write,
+	void *opaque);
+
+int
+csnappy_framed_compress_update(
+	struct csnappy_framed_compress *stream,
+	const char *input,
+	uint32_t input_length);
+
+int
+csnappy_framed_compress_finish(
+	struct csnappy_framed_compress *stream);
+
+struct csnappy_framed_decompress {
+	char *buffer;
+	int state;
+	uint32_t have;
+	uint32_t chunk_length;
+	char header[4];
+	int seen_identifier;
+	int status;
+	csnappy_write_fn write;
+	void *opaque;
+};
+
+void
+csnappy_framed_decompress_init(
+	struct csnappy_framed_decompress *stream,
+	char *buffer,
+	csnappy_write_fn write,
+	void *opaque);
+
+int
+csnappy_framed_decompress_update(
+	struct csnappy_framed_decompress *stream,
+	const char *src,
+	uint32_t src_len);
+
+int
+csnappy_framed_decompress_finish(
+	struct csnappy_framed_decompress *stream);
+
+/*
+ * Seekable container (userspace only): the data is cut into blocks of
+ * "block_size" bytes (the last may be shorter), each compressed on its own
+ * as a raw Snappy stream. Layout, all integers little endian:
+ *   header:  "sNaPsEeK", le32 block_size, le32 flags
+ *   blocks:  one after another
+ *   index:   le64 file offset of each block, then of the end of the last
+ *   checksums (if CSNAPPY_SEEKABLE_CHECKSUMS): le32 CRC32C of each
+ *            block's uncompressed contents
+ *   trailer: le64 uncompressed length, "sNaPiNdX"
+ * The index comes last so the encoder can write it out as it goes, with
+ * the same interface as csnappy_framed_compress. Its init allocates a
+ * buffer of about two blocks and returns CSNAPPY_E_NOMEM if it cannot;
+ * finish writes the index and frees everything, and must be called even
+ * after an error.
+ * REQUIRES: 1 <= block_size <= CSNAPPY_SEEKABLE_MAX_BLOCK_BYTES.
+ * REQUIRES: 9 <= workmem_bytes_power_of_two <= 16.
+ *
+ * The reader works on the whole container in memory, or mmaps a file
+ * (CSNAPPY_E_IO if that fails, with errno set). Opening only checks the
+ * header and trailer, so it takes the same time for any size. Then
+ * csnappy_seekable_read decompresses any range of the data, touching only
+ * the blocks it covers: whole blocks are decoded straight into "buf",
+ * partly covered ones through a buffer that keeps the last such block
+ * for the next read. A reader must not be used by two threads at once.
+ * Returns CSNAPPY_E_OUTPUT_OVERRUN if the range runs past "length",
+ * CSNAPPY_E_CHECKSUM_BAD on a checksum mismatch and
+ * CSNAPPY_E_DATA_MALFORMED on a bad block or index entry.
+ */
+#define CSNAPPY_SEEKABLE_MAX_BLOCK_BYTES (1 << 24)
+#define CSNAPPY_SEEKABLE_CHECKSUMS 1
+
+struct csnappy_seekable_compress {
+	char *buffer;
+	uint32_t buffered;
+	uint32_t block_size;
+	int flags;
+	int status;
+	uint64_t *offsets;
+	uint32_t *checksums;
+	uint32_t nr_blocks;
+	uint32_t index_room;
+	uint64_t length;
+	void *working_memory;
+	int workmem_bytes_power_of_two;
+	csnappy_write_fn write;
+	void *opaque;
+};
+
+int
+csnappy_seekable_compress_init(
+	struct csnappy_seekable_compress *stream,
+	uint32_t block_size,
+	int flags,
+	void *working_memory,
+	const int workmem_bytes_power_of_two,
+	csnappy_write_fn write,
+	void *opaque);
+
+int
+csnappy_seekable_compress_update(
+	struct csnappy_seekable_compress *stream,
+	const char *input,
+	uint32_t input_length);
+
+int
+csnappy_seekable_compress_finish(
+	struct csnappy_seekable_compress *stream);
+
+struct csnappy_seekable {
+	const char *data;
+	uint64_t size;
+	uint64_t length;	/* of the uncompressed data */
+	uint32_t block_size;
+	uint32_t nr_blocks;
+	int flags;
+	const char *index;
+	const char *checksums;
+	char *scratch;
+	uint32_t cached_block;
+	int mapped;
+};
+
+int
+csnappy_seekable_open(
+	struct csnappy_seekable *reader,
+	const char *data,
+	uint64_t size);
+
+int
+csnappy_seekable_open_file(
+	struct csnappy_seekable *reader,
+	const char *path);
+
+int
+csnappy_seekable_read(
+	struct csnappy_seekable *reader,
+	uint64_t offset,
+	char *buf,
+	uint32_t len);
+
+void
+csnappy_seekable_close(
+	struct csnappy_seekable *reader);
+
+#ifdef CSNAPPY_STATS
+/*
+ * Counters kept by a library built with -DCSNAPPY_STATS (userspace only),
+ * to pick workmem_bytes_power_of_two and acceleration for a dataset from
+ * data. Without it none of this exists and the code paths are unchanged.
+ *
+ * csnappy_stats_attach makes the calling thread add to "stats" until it
+ * attaches another struct, or NULL to stop counting. The caller zeroes it.
+ * The worker threads of csnappy_compress_parallel count nothing.
+ *
+ * Hash probes, collisions (a table entry that did not hold a 4 byte match,
+ * including never written ones) and skips (probes that stepped over bytes
+ * after 32 / acceleration probes without a match) are counted by the fast
+ * compressor: csnappy_compress_fragment and csnappy_compress with their
+ * _ex, _large, _bounded, _page4k, _ctx, _batch and _iov variants, and the
+ * streaming, framed and seekable compressors built on them. The high
+ * compression mode (_hc) counts only what it emits.
+ * Ops are counted as emitted by the compressors and as executed by
+ * csnappy_decompress, _noheader, _page4k, _batch and the streaming
+ * decompressor; _iov and csnappy_validate count nothing.
+ */
+#define CSNAPPY_STATS_MAX_COPY_LENGTH 64
+#define CSNAPPY_STATS_OFFSET_BITS 32
+
+struct csnappy_op_stats {
+	uint64_t literal_runs;
+	uint64_t literal_bytes;
+	uint64_t copies;
+	uint64_t copy_bytes;
+	/* Copies by length, 1..64 (one op, longer matches take several). */
+	uint64_t copy_length[CSNAPPY_STATS_MAX_COPY_LENGTH + 1];
+	/* Copies by bit length of offset: [n] is [1 << (n-1), 1 << n). */
+	uint64_t copy_offset[CSNAPPY_STATS_OFFSET_BITS + 1];
+};
+
+struct csnappy_stats {
+	uint64_t hash_probes;
+	uint64_t hash_collisions;
+	uint64_t skips;
+	uint64_t skipped_bytes;	/* never probed because of skips */
+	struct csnappy_op_stats emitted;
+	struct csnappy_op_stats decoded;
+};
+
+void
+csnappy_stats_attach(struct csnappy_stats *stats);
+#endif
+
 /*
  * Return values (< 0 = Error)
  */
@@ -127,6 +812,9 @@ csnappy_decompress_noheader(
 #define CSNAPPY_E_OUTPUT_OVERRUN	(-3)
 #define CSNAPPY_E_INPUT_NOT_CONSUMED	(-4)
 #define CSNAPPY_E_DATA_MALFORMED	(-5)
+#define CSNAPPY_E_NOMEM			(-6)
+#define CSNAPPY_E_CHECKSUM_BAD		(-7)
+#define CSNAPPY_E_IO			(-8)
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,347 @@
+/*
+Benchmark for csnappy_compress and csnappy_decompress over a corpus.
+
+Every non-empty regular file named on the command line, or found directly
+inside a directory named there (testdata/ by default), is compressed and
+decompressed in memory. After warmup runs, which also pick an iteration
+count so that one trial takes at least 20ms, each operation is timed over
+a number of trials. Reported per file and operation:
+  the compression ratio (compressed / original size),
+  min, p99, median and max throughput over the trials in MB/s of
+  uncompressed data (p99 is the throughput that 99% of the trials beat,
+  the same as min below 100 trials),
+  the median number of cycles per uncompressed byte.
+Cycles come from the CPU cycle counter through perf_event_open if the
+kernel allows it, else from the x86 time stamp counter (which ticks at a
+fixed rate, not the core clock); the header says which.
+
+With -o csv the output is one line per file and operation, to compare
+library versions: the library is linked dynamically, so point
+LD_LIBRARY_PATH at each build in turn and tell the runs apart with -l.
+*/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sched.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+#include <linux/perf_event.h>
+#include "csnappy.h"
+
+#define MAX_FILE_SIZE (1 << 30)
+#define MIN_TRIAL_SECONDS 0.02
+
+enum { OP_COMPRESS, OP_DECOMPRESS };
+static const char *const op_names[] = { "compress", "decompress" };
+
+enum { CYCLES_NONE, CYCLES_PERF, CYCLES_TSC };
+static const char *const cycles_names[] = { "none", "perf", "tsc" };
+static int cycles_source = CYCLES_NONE, perf_fd = -1;
+
+static int trials = 100, warmup = 3, csv;
+static const char *label = "";
+static void *workmem;
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void cycles_init(void)
+{
+	struct perf_event_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.type = PERF_TYPE_HARDWARE;
+	attr.size = sizeof(attr);
+	attr.config = PERF_COUNT_HW_CPU_CYCLES;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	perf_fd = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+	if (perf_fd >= 0) {
+		ioctl(perf_fd, PERF_EVENT_IOC_ENABLE, 0);
+		cycles_source = CYCLES_PERF;
+		return;
+	}
+#if defined(__x86_64__) || defined(__i386__)
+	cycles_source = CYCLES_TSC;
+#endif
+}
+
+static uint64_t cycles(void)
+{
+	uint64_t count = 0;
+	if (cycles_source == CYCLES_PERF) {
+		if (read(perf_fd, &count, sizeof(count)) != sizeof(count))
+			count = 0;
+	}
+#if defined(__x86_64__) || defined(__i386__)
+	else if (cycles_source == CYCLES_TSC) {
+		uint32_t lo, hi;
+		__asm__ __volatile__("rdtsc" : "=a" (lo), "=d" (hi));
+		count = ((uint64_t)hi << 32) | lo;
+	}
+#endif
+	return count;
+}
+
+struct buffers {
+	const char *input;
+	uint32_t input_length;
+	char *compressed;
+	uint32_t compressed_length;
+	char *output;
+};
+
+static void run(int op, struct buffers *b, long iterations)
+{
+	long i;
+	for (i = 0; i < iterations; i++) {
+		if (op == OP_COMPRESS)
+			csnappy_compress(b->input, b->input_length,
+				b->compressed, &b->compressed_length,
+				workmem, CSNAPPY_WORKMEM_BYTES_POWER_OF_TWO);
+		else if (csnappy_decompress(b->compressed,
+				b->compressed_length, b->output,
+				b->input_length) != CSNAPPY_E_OK)
+			abort();
+	}
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+	const double x = *(const double *)a, y = *(const double *)b;
+	return x < y ? -1 : x > y;
+}
+
+static void bench(const char *name, int op, struct buffers *b)
+{
+	double *mbps, *cpb, t;
+	uint64_t c;
+	long iterations = 1;
+	/* 1% of the trials are slower than mbps[p99]; with 100 it is mbps[1]. */
+	int i, p99 = trials / 100;
+
+	if (!(mbps = malloc(trials * sizeof(double))) ||
+	    !(cpb = malloc(trials * sizeof(double)))) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+	/* The last run of the calibration counts as the first warmup run. */
+	for (;;) {
+		t = now();
+		run(op, b, iterations);
+		t = now() - t;
+		if (t >= MIN_TRIAL_SECONDS || iterations >= (1L << 30))
+			break;
+		iterations *= 2;
+	}
+	for (i = 1; i < warmup; i++)
+		run(op, b, iterations);
+	for (i = 0; i < trials; i++) {
+		t = now();
+		c = cycles();
+		run(op, b, iterations);
+		c = cycles() - c;
+		t = now() - t;
+		mbps[i] = (double)b->input_length * iterations / t / 1e6;
+		cpb[i] = (double)c / ((double)b->input_length * iterations);
+	}
+	qsort(mbps, trials, sizeof(double), cmp_double);
+	qsort(cpb, trials, sizeof(double), cmp_double);
+	if (csv)
+		printf("%s,%s,%u,%u,%.4f,%s,%.1f,%.1f,%.1f,%.1f,%.3f\n",
+		       label, name, b->input_length, b->compressed_length,
+		       (double)b->compressed_length / b->input_length,
+		       op_names[op], mbps[0], mbps[p99],
+		       mbps[trials / 2], mbps[trials - 1],
+		       cycles_source == CYCLES_NONE ? 0 : cpb[trials / 2]);
+	else
+		printf("%-30s %-10s %10u %6.1f%% %8.1f %8.1f %8.1f %8.1f %7.2f\n",
+		       name, op_names[op], b->input_length,
+		       100.0 * b->compressed_length / b->input_length,
+		       mbps[0], mbps[p99], mbps[trials / 2],
+		       mbps[trials - 1],
+		       cycles_source == CYCLES_NONE ? 0 : cpb[trials / 2]);
+	free(cpb);
+	free(mbps);
+}
+
+/*
+ * A file named on the command line ("named") must be a readable regular
+ * file; entries of a directory that are not are skipped silently.
+ */
+static void bench_file(const char *path, int named)
+{
+	struct buffers b;
+	struct stat st;
+	char *input;
+	FILE *f;
+
+	if (stat(path, &st)) {
+		if (!named)
+			return;
+		perror(path);
+		exit(EXIT_FAILURE);
+	}
+	if (!S_ISREG(st.st_mode)) {
+		if (!named)
+			return;
+		fprintf(stderr, "%s: not a regular file\n", path);
+		exit(EXIT_FAILURE);
+	}
+	if (!st.st_size) {
+		if (named)
+			fprintf(stderr, "%s: skipped, empty\n", path);
+		return;
+	}
+	if (st.st_size > MAX_FILE_SIZE) {
+		fprintf(stderr, "%s: skipped, larger than %d bytes\n",
+			path, MAX_FILE_SIZE);
+		return;
+	}
+	b.input_length = st.st_size;
+	input = malloc(b.input_length + 1);
+	b.compressed = malloc(csnappy_max_compressed_length(b.input_length));
+	b.output = malloc(b.input_length + 1);
+	if (!input || !b.compressed || !b.output) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+	if (!(f = fopen(path, "rb")) ||
+	    fread(input, 1, b.input_length, f) != b.input_length) {
+		perror(path);
+		exit(EXIT_FAILURE);
+	}
+	fclose(f);
+	b.input = input;
+	run(OP_COMPRESS, &b, 1);
+	run(OP_DECOMPRESS, &b, 1);
+	if (memcmp(b.output, b.input, b.input_length)) {
+		fprintf(stderr, "%s: round trip failed\n", path);
+		exit(EXIT_FAILURE);
+	}
+	bench(path, OP_COMPRESS, &b);
+	bench(path, OP_DECOMPRESS, &b);
+	free(b.output);
+	free(b.compressed);
+	free(input);
+}
+
+static int cmp_name(const void *a, const void *b)
+{
+	return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/* Files directly inside "dir", in name order, so runs line up. */
+static void bench_dir(const char *dir)
+{
+	struct dirent *e;
+	char **names = NULL;
+	size_t n = 0, i;
+	DIR *d;
+
+	if (!(d = opendir(dir))) {
+		perror(dir);
+		exit(EXIT_FAILURE);
+	}
+	while ((e = readdir(d))) {
+		if (e->d_name[0] == '.')
+			continue;
+		if (!(names = realloc(names, (n + 1) * sizeof(*names))) ||
+		    !(names[n] = malloc(strlen(dir) + strlen(e->d_name) + 2))) {
+			perror("malloc");
+			exit(EXIT_FAILURE);
+		}
+		sprintf(names[n++], "%s/%s", dir, e->d_name);
+	}
+	closedir(d);
+	qsort(names, n, sizeof(*names), cmp_name);
+	for (i = 0; i < n; i++) {
+		bench_file(names[i], 0);
+		free(names[i]);
+	}
+	free(names);
+}
+
+int main(int argc, char * const argv[])
+{
+	struct stat st;
+	cpu_set_t set;
+	int c, i, cpu = -1;
+
+	while ((c = getopt(argc, argv, "t:w:c:o:l:")) != -1) {
+		switch (c) {
+		case 't':
+			if ((trials = atoi(optarg)) <= 0)
+				goto usage;
+			break;
+		case 'w':
+			if ((warmup = atoi(optarg)) < 0)
+				goto usage;
+			break;
+		case 'c':
+			if ((cpu = atoi(optarg)) < 0)
+				goto usage;
+			break;
+		case 'o':
+			if (strcmp(optarg, "csv") == 0)
+				csv = 1;
+			else if (strcmp(optarg, "text") != 0)
+				goto usage;
+			break;
+		case 'l':
+			label = optarg;
+			break;
+		default:
+			goto usage;
+		}
+	}
+	if (cpu >= 0) {
+		CPU_ZERO(&set);
+		CPU_SET(cpu, &set);
+		if (sched_setaffinity(0, sizeof(set), &set)) {
+			perror("sched_setaffinity");
+			return 1;
+		}
+	}
+	if (!(workmem = malloc(CSNAPPY_WORKMEM_BYTES))) {
+		perror("malloc");
+		return 1;
+	}
+	cycles_init();
+	if (csv)
+		printf("label,file,bytes,compressed_bytes,ratio,operation,"
+		       "min_mbps,p99_mbps,median_mbps,max_mbps,"
+		       "cycles_per_byte_%s\n", cycles_names[cycles_source]);
+	else
+		printf("%-30s %-10s %10s %7s %8s %8s %8s %8s %7s\n"
+		       "%-30s %-10s %10s %7s %35s %7s\n",
+		       "file", "operation", "bytes", "ratio",
+		       "min", "p99", "median", "max", "cyc/B",
+		       "", "", "", "",
+		       "(MB/s)", cycles_names[cycles_source]);
+	if (optind == argc)
+		bench_dir("testdata");
+	for (i = optind; i < argc; i++) {
+		if (!stat(argv[i], &st) && S_ISDIR(st.st_mode))
+			bench_dir(argv[i]);
+		else
+			bench_file(argv[i], 1);
+	}
+	free(workmem);
+	return 0;
+usage:
+	fprintf(stderr,
+	"usage: csnappy_bench [-t trials] [-w warmup] [-c cpu] [-o text|csv]\n"
+	"                     [-l label] [file|dir]...\n"
+	"Benchmarks the files given, and those directly inside the\n"
+	"directories given (testdata/ if none).\n");
+	return 1;
+}
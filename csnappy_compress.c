@@ -43,35 +43,6 @@ Steffen Mueller <smueller@cpan.org>
 #include "csnappy.h"
 
 
-static INLINE char*
-encode_varint32(char *sptr, uint32_t v)
-{
-	uint8_t* ptr = (uint8_t *)sptr;
-	static const int B = 128;
-	if (v < (1<<7)) {
-		*(ptr++) = v;
-	} else if (v < (1<<14)) {
-		*(ptr++) = v | B;
-		*(ptr++) = v>>7;
-	} else if (v < (1<<21)) {
-		*(ptr++) = v | B;
-		*(ptr++) = (v>>7) | B;
-		*(ptr++) = v>>14;
-	} else if (v < (1<<28)) {
-		*(ptr++) = v | B;
-		*(ptr++) = (v>>7) | B;
-		*(ptr++) = (v>>14) | B;
-		*(ptr++) = v>>21;
-	} else {
-		*(ptr++) = v | B;
-		*(ptr++) = (v>>7) | B;
-		*(ptr++) = (v>>14) | B;
-		*(ptr++) = (v>>21) | B;
-		*(ptr++) = v>>28;
-	}
-	return (char *)ptr;
-}
-
 /*
  * *** DO NOT CHANGE THE VALUE OF kBlockSize ***
 
@@ -85,6 +56,100 @@ encode_varint32(char *sptr, uint32_t v)
 #define kBlockLog 15
 #define kBlockSize (1 << kBlockLog)
 
+/*
+ * Opt-in large window mode uses fragments of up to this size instead, and
+ * emits COPY_4_BYTE_OFFSET when a match is 64KiB or more behind.
+ */
+#define kLargeBlockSize CSNAPPY_LARGE_FRAGMENT_BYTES
+
+
+/*
+ * Exact number of bytes a literal or a copy (with offset < 65536) takes
+ * in the output.
+ */
+static INLINE int
+LiteralSize(int len)
+{
+	const int n = len - 1;
+	return 1 + len + (n < 60 ? 0 : n < (1 << 8) ? 1 :
+			  n < (1 << 16) ? 2 : n < (1 << 24) ? 3 : 4);
+}
+
+static INLINE int
+CopySize(int offset, int len)
+{
+	int size = 0;
+	while (len >= 68) {
+		size += 3;
+		len -= 64;
+	}
+	if (len > 64) {
+		size += 3;
+		len -= 60;
+	}
+	return size + ((len < 12 && offset < 2048) ? 2 : 3);
+}
+
+/*
+ * Returns nonzero if "input" is one 8 byte word repeated throughout (the
+ * last repetition may be cut short), and stores that word in "*fill".
+ * Most buffers differ within the first 16 bytes, so this is cheap for
+ * them; uniform ones are compared 64 bytes per iteration.
+ */
+static INLINE int
+FindFill(const char *input, uint32_t input_size, uint64_t *fill)
+{
+	const uint64_t word = UNALIGNED_LOAD64(input);
+	uint32_t i = 16;
+	if (input_size < 16 || UNALIGNED_LOAD64(input + 8) != word)
+		return 0;
+#ifdef CSNAPPY_X86_64_SIMD
+	{
+		const __m128i w = _mm_set1_epi64x(word);
+		__m128i eq;
+		for (; i + 64 <= input_size; i += 64) {
+			eq = _mm_and_si128(
+				_mm_and_si128(_mm_cmpeq_epi8(w,
+					_mm_loadu_si128((const __m128i *)(input + i))),
+					_mm_cmpeq_epi8(w,
+					_mm_loadu_si128((const __m128i *)(input + i + 16)))),
+				_mm_and_si128(_mm_cmpeq_epi8(w,
+					_mm_loadu_si128((const __m128i *)(input + i + 32))),
+					_mm_cmpeq_epi8(w,
+					_mm_loadu_si128((const __m128i *)(input + i + 48)))));
+			if (_mm_movemask_epi8(eq) != 0xffff)
+				return 0;
+		}
+	}
+#else
+	for (; i + 32 <= input_size; i += 32) {
+		if ((UNALIGNED_LOAD64(input + i) ^ word) |
+		    (UNALIGNED_LOAD64(input + i + 8) ^ word) |
+		    (UNALIGNED_LOAD64(input + i + 16) ^ word) |
+		    (UNALIGNED_LOAD64(input + i + 24) ^ word))
+			return 0;
+	}
+#endif
+	for (; i < input_size; i++) {
+		if (input[i] != input[i - 8])
+			return 0;
+	}
+	*fill = word;
+	return 1;
+}
+
+/* Shortest period of a fill word, in bytes: 1, 2, 4 or 8. */
+static INLINE int
+FillPeriod(uint64_t word)
+{
+	if (word == ((word >> 8) | (word << 56)))
+		return 1;
+	if (word == ((word >> 16) | (word << 48)))
+		return 2;
+	if (word == ((word >> 32) | (word << 32)))
+		return 4;
+	return 8;
+}
 
 #if defined(__arm__) && !defined(ARCH_ARM_HAVE_UNALIGNED)
 
@@ -97,6 +162,7 @@ static uint8_t* emit_literal(
 	uint32_t n = length - 1;
 	if (!length)
 		return op;
+	STATS_LITERAL(emitted, length);
 	if (n < 60) {
 		/* Fits in tag byte */
 		*op++ = LITERAL | (n << 2);
@@ -124,6 +190,7 @@ static uint8_t* emit_copy(
 	/* Emit 64 byte copies but make sure to keep at least four bytes
 	 * reserved */
 	while (unlikely(len >= 68)) {
+		STATS_COPY(emitted, offset, 64);
 		*op++ = COPY_2_BYTE_OFFSET | ((64 - 1) << 2);
 		*op++ = offset & 255;
 		*op++ = offset >> 8;
@@ -133,6 +200,7 @@ static uint8_t* emit_copy(
 	/* Emit an extra 60 byte copy if have too much data to fit in one
 	 * copy */
 	if (unlikely(len > 64)) {
+		STATS_COPY(emitted, offset, 60);
 		*op++ = COPY_2_BYTE_OFFSET | ((60 - 1) << 2);
 		*op++ = offset & 255;
 		*op++ = offset >> 8;
@@ -141,6 +209,7 @@ static uint8_t* emit_copy(
 
 	/* Emit remainder */
 	DCHECK_GE(len, 4);
+	STATS_COPY(emitted, offset, len);
 	if ((len < 12) && (offset < 2048)) {
 		int len_minus_4 = len - 4;
 		*op++ = COPY_1_BYTE_OFFSET   |
@@ -170,13 +239,15 @@ static uint32_t hash(uint32_t v)
 	return v * UINT32_C(0x1e35a7bd);
 }
 
-char*
-csnappy_compress_fragment(
+/* If op_limit is not NULL, returns NULL rather than write past it. */
+static char*
+compress_fragment_simple(
 	const char *input,
 	const uint32_t input_size,
 	char *dst,
 	void *working_memory,
-	const int workmem_bytes_power_of_two)
+	const int workmem_bytes_power_of_two,
+	const char *op_limit)
 {
 	const uint8_t * const src_start = (const uint8_t *)input;
 	const uint8_t * const src_end_minus4 = src_start + input_size - 4;
@@ -185,8 +256,19 @@ csnappy_compress_fragment(
 	uint16_t *wm = (uint16_t *)working_memory;
 	int shift = 33 - workmem_bytes_power_of_two;
 	uint32_t curr_val, curr_hash, match_val, offset, length;
+	uint64_t fill;
 	if (unlikely(input_size < 4))
 		goto the_end;
+	if (unlikely(FindFill(input, input_size, &fill))) {
+		offset = FillPeriod(fill);
+		if (op_limit && (const uint8_t *)op_limit - op <
+				LiteralSize(offset) +
+				CopySize(offset, input_size - offset))
+			return NULL;
+		op = emit_literal(op, src_start, src_start + offset);
+		op = emit_copy(op, offset, input_size - offset);
+		return (char *)op;
+	}
 	memset(wm, 0, 1 << workmem_bytes_power_of_two);
 	for (;;) {
 		curr_val = (src[1] << 8) | (src[2] << 16) | (src[3] << 24);
@@ -196,26 +278,147 @@ csnappy_compress_fragment(
 				goto the_end;
 			curr_val = (curr_val >> 8) | (src[3] << 24);
 			DCHECK_EQ(curr_val, get_unaligned_le32(src));
+			if (op_limit &&
+			    src - done_upto >= (const uint8_t *)op_limit - op)
+				return NULL;
 			curr_hash = hash(curr_val) >> shift;
 			match = src_start + wm[curr_hash];
 			DCHECK_LT(match, src);
 			wm[curr_hash] = src - src_start;
 			match_val = get_unaligned_le32(match);
+			STATS_INC(hash_probes);
+			STATS_ADD(hash_collisions, curr_val != match_val);
 		} while (likely(curr_val != match_val));
 		offset = src - match;
 		length = 4 + find_match_length(
 			match + 4, src + 4, src_end_minus4 + 4);
 		DCHECK_EQ(memcmp(src, match, length), 0);
+		if (op_limit && (const uint8_t *)op_limit - op <
+				(src > done_upto ? LiteralSize(src - done_upto) : 0) +
+				CopySize(offset, length))
+			return NULL;
 		op = emit_literal(op, done_upto, src);
 		op = emit_copy(op, offset, length);
 		done_upto = src + length;
 		src = done_upto - 1;
 	}
 the_end:
+	if (op_limit && src_end_minus4 + 4 > done_upto &&
+	    (const uint8_t *)op_limit - op <
+			LiteralSize(src_end_minus4 + 4 - done_upto))
+		return NULL;
 	op = emit_literal(op, done_upto, src_end_minus4 + 4);
 	return (char *)op;
 }
 
+char*
+csnappy_compress_fragment(
+	const char *input,
+	const uint32_t input_size,
+	char *dst,
+	void *working_memory,
+	const int workmem_bytes_power_of_two)
+{
+	return compress_fragment_simple(input, input_size, dst,
+		working_memory, workmem_bytes_power_of_two, NULL);
+}
+
+/* The simple implementation has no skipping to accelerate. */
+char*
+csnappy_compress_fragment_ex(
+	const char *input,
+	const uint32_t input_size,
+	char *dst,
+	void *working_memory,
+	const int workmem_bytes_power_of_two,
+	int acceleration)
+{
+	return compress_fragment_simple(input, input_size, dst,
+		working_memory, workmem_bytes_power_of_two, NULL);
+}
+
+char*
+csnappy_compress_fragment_bounded(
+	const char *input,
+	const uint32_t input_size,
+	char *dst,
+	void *working_memory,
+	const int workmem_bytes_power_of_two,
+	const uint32_t max_output)
+{
+	return compress_fragment_simple(input, input_size, dst,
+		working_memory, workmem_bytes_power_of_two, dst + max_output);
+}
+
+char*
+csnappy_compress_page4k(
+	const char *input,
+	char *dst,
+	void *working_memory,
+	const uint32_t max_output)
+{
+	return compress_fragment_simple(input, CSNAPPY_PAGE4K_BYTES, dst,
+		working_memory, CSNAPPY_PAGE4K_WORKMEM_BYTES_POWER_OF_TWO,
+		dst + max_output);
+}
+
+/* No large window for this simple implementation, use 32KiB fragments. */
+char*
+csnappy_compress_fragment_large(
+	const char *input,
+	const uint32_t input_size,
+	char *dst,
+	void *working_memory,
+	const int workmem_bytes_power_of_two)
+{
+	uint32_t remaining = input_size, n;
+	while (remaining > 0) {
+		n = min(remaining, (uint32_t)kBlockSize);
+		dst = csnappy_compress_fragment(input, n, dst, working_memory,
+			min(workmem_bytes_power_of_two, kBlockLog));
+		input += n;
+		remaining -= n;
+	}
+	return dst;
+}
+
+/* The simple implementation clears its table for every fragment. */
+void
+csnappy_compress_ctx_init(
+	struct csnappy_compress_ctx *ctx,
+	void *working_memory,
+	const int workmem_bytes_power_of_two)
+{
+	ctx->working_memory = working_memory;
+	ctx->workmem_bytes_power_of_two = workmem_bytes_power_of_two;
+	ctx->epoch = 0;
+}
+
+char*
+csnappy_compress_fragment_ctx(
+	struct csnappy_compress_ctx *ctx,
+	const char *input,
+	const uint32_t input_size,
+	char *dst)
+{
+	return csnappy_compress_fragment(input, input_size, dst,
+		ctx->working_memory,
+		min(ctx->workmem_bytes_power_of_two, kBlockLog));
+}
+
+/* No separate high compression mode for this simple implementation. */
+char*
+csnappy_compress_fragment_hc(
+	const char *input,
+	const uint32_t input_size,
+	char *dst,
+	void *working_memory,
+	const int workmem_bytes_power_of_two)
+{
+	return csnappy_compress_fragment(input, input_size, dst,
+		working_memory, workmem_bytes_power_of_two);
+}
+
 #else /* !simple */
 
 /*
@@ -251,7 +454,7 @@ static INLINE uint32_t Hash(const char *p, int shift)
  */
 #if defined(__x86_64__) || defined(__aarch64__)
 static INLINE int
-FindMatchLength(const char *s1, const char *s2, const char *s2_limit)
+FindMatchLength64(const char *s1, const char *s2, const char *s2_limit)
 {
 	uint64_t x;
 	int matched, matching_bits;
@@ -328,11 +531,88 @@ FindMatchLength(const char *s1, const char *s2, const char *s2_limit)
 }
 #endif /* !defined(__x86_64__) && !defined(__aarch64__) */
 
+/*
+ * On x86_64 compare 16 bytes at a time with SSE2 (always available), and
+ * 32 bytes at a time with AVX2 when the CPU we run on has it. The first
+ * 16 bytes are compared inline, because most matches are short. Only a
+ * match that is longer than that pays for an indirect call to the best
+ * implementation for the host CPU, chosen the first time it is needed.
+ */
+#ifdef CSNAPPY_X86_64_SIMD
+static int
+FindMatchLengthSSE2(const char *s1, const char *s2, const char *s2_limit)
+{
+	__m128i a, b;
+	uint32_t mask;
+	int matched = 0;
+	DCHECK_GE(s2_limit, s2);
+	while (likely(s2 <= s2_limit - 16)) {
+		a = _mm_loadu_si128((const __m128i *)(s1 + matched));
+		b = _mm_loadu_si128((const __m128i *)s2);
+		mask = _mm_movemask_epi8(_mm_cmpeq_epi8(a, b)) ^ 0xffff;
+		if (mask)
+			return matched + FindLSBSetNonZero(mask);
+		s2 += 16;
+		matched += 16;
+	}
+	return matched + FindMatchLength64(s1 + matched, s2, s2_limit);
+}
+
+static __attribute__((target("avx2"))) int
+FindMatchLengthAVX2(const char *s1, const char *s2, const char *s2_limit)
+{
+	__m256i a, b;
+	uint32_t mask;
+	int matched = 0;
+	DCHECK_GE(s2_limit, s2);
+	while (likely(s2 <= s2_limit - 32)) {
+		a = _mm256_loadu_si256((const __m256i *)(s1 + matched));
+		b = _mm256_loadu_si256((const __m256i *)s2);
+		mask = ~(uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(a, b));
+		if (mask)
+			return matched + FindLSBSetNonZero(mask);
+		s2 += 32;
+		matched += 32;
+	}
+	return matched + FindMatchLength64(s1 + matched, s2, s2_limit);
+}
+
+static int (*FindMatchLengthLong)(const char *, const char *, const char *) =
+	FindMatchLengthSSE2;
+
+static CSNAPPY_INIT void
+FindMatchLengthInit(void)
+{
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		FindMatchLengthLong = FindMatchLengthAVX2;
+}
+
+static INLINE int
+FindMatchLength(const char *s1, const char *s2, const char *s2_limit)
+{
+	__m128i a, b;
+	uint32_t mask;
+	DCHECK_GE(s2_limit, s2);
+	if (unlikely(s2 > s2_limit - 16))
+		return FindMatchLength64(s1, s2, s2_limit);
+	a = _mm_loadu_si128((const __m128i *)s1);
+	b = _mm_loadu_si128((const __m128i *)s2);
+	mask = _mm_movemask_epi8(_mm_cmpeq_epi8(a, b)) ^ 0xffff;
+	if (likely(mask))
+		return FindLSBSetNonZero(mask);
+	return 16 + FindMatchLengthLong(s1 + 16, s2 + 16, s2_limit);
+}
+#elif defined(__x86_64__) || defined(__aarch64__)
+#define FindMatchLength FindMatchLength64
+#endif
+
 
 static INLINE char*
 EmitLiteral(char *op, const char *literal, int len, int allow_fast_path)
 {
 	int n = len - 1; /* Zero-length literals are disallowed */
+	STATS_LITERAL(emitted, len);
 	if (n < 60) {
 		/* Fits in tag byte */
 		*op++ = LITERAL | (n << 2);
@@ -376,6 +656,7 @@ EmitCopyLessThan64(char *op, int offset, int len)
 	DCHECK_LE(len, 64);
 	DCHECK_GE(len, 4);
 	DCHECK_LT(offset, 65536);
+	STATS_COPY(emitted, offset, len);
 
 	if ((len < 12) && (offset < 2048)) {
 		int len_minus_4 = len - 4;
@@ -465,30 +746,118 @@ static INLINE uint32_t GetUint32AtOffset(const char* v, int offset) {
 #endif /* !ARCH_K8 */
 
 
+/*
+ * Copies with offsets of 64KiB or more, only made in large window mode.
+ * COPY_4_BYTE_OFFSET has the same 1..64 length range as
+ * COPY_2_BYTE_OFFSET, without the 4 byte minimum of COPY_1_BYTE_OFFSET.
+ * Each one costs 5 bytes, so a far match is only taken once it is at least
+ * kMinFarMatch bytes long: shorter ones would come out bigger than the
+ * input they replace and break csnappy_max_compressed_length().
+ */
+#define kMinFarMatch 6
+
+static INLINE char*
+EmitFarCopy(char *op, uint32_t offset, int len)
+{
+	int n;
+	DCHECK_GE(offset, 65536);
+	DCHECK_GE(len, kMinFarMatch);
+	while (len > 0) {
+		n = min(len, 64);
+		STATS_COPY(emitted, offset, n);
+		*op++ = COPY_4_BYTE_OFFSET + ((n-1) << 2);
+		*op++ = offset & 0xff;
+		*op++ = (offset >> 8) & 0xff;
+		*op++ = (offset >> 16) & 0xff;
+		*op++ = offset >> 24;
+		len -= n;
+	}
+	return op;
+}
+
 #define kInputMarginBytes 15
-char*
-csnappy_compress_fragment(
+
+/*
+ * True if the 4 byte match of ip with candidate is too far back to be
+ * worth a copy: the offset needs COPY_4_BYTE_OFFSET and the match is
+ * shorter than kMinFarMatch. ip is before ip_limit, so 6 bytes are there.
+ */
+static INLINE int
+ShortFarMatch(const int large, const char *ip, const char *candidate)
+{
+	return large && ip - candidate >= 65536 &&
+	       UNALIGNED_LOAD16(ip + 4) != UNALIGNED_LOAD16(candidate + 4);
+}
+
+/*
+ * Table entries of a csnappy_compress_ctx are positions (mod 2^16) in the
+ * stream of all fragments the context has compressed. An entry is only
+ * usable as a candidate if it lies before ip in the current fragment;
+ * anything else is left over from an earlier fragment and is mapped to
+ * offset 0, the same thing a zeroed table would hold.
+ * An old entry may also happen to land inside that range. That is harmless:
+ * every candidate is checked for a 4 byte match before it is used, so it
+ * is just a useless (or lucky) candidate, as after a hash collision.
+ */
+static INLINE uint32_t
+ValidOffset(uint16_t entry, uint16_t epoch, uint32_t limit)
+{
+	const uint32_t offset = (uint16_t)(entry - epoch);
+	return likely(offset < limit) ? offset : 0;
+}
+
+/*
+ * Shared body of the csnappy_compress_fragment variants. The mode flags are
+ * compile time constants at each call site, so each variant gets its own
+ * specialized copy of the loop.
+ * In large mode the table holds uint32_t positions, so fragments can be
+ * up to kLargeBlockSize long and copies reach arbitrarily far back.
+ * In epoch mode the table is not cleared; entries hold positions offset
+ * by "epoch" and stale ones are filtered out by ValidOffset().
+ * If op_limit is not NULL, nothing is written at or past it: before each
+ * literal or copy is emitted its exact size is checked against what is
+ * left, and NULL is returned as soon as the output would not fit. Since
+ * unmatched bytes always end up in a literal, the scan gives up as soon as
+ * the pending ones alone fill the budget.
+ */
+static INLINE __attribute__((always_inline)) char*
+compress_fragment(
 	const char *input,
 	const uint32_t input_size,
 	char *op,
 	void *working_memory,
-	const int workmem_bytes_power_of_two)
+	const int workmem_bytes_power_of_two,
+	const int large,
+	const int use_epoch,
+	const uint16_t epoch,
+	const int acceleration,
+	const char *op_limit)
 {
 	const char *ip, *ip_end, *base_ip, *next_emit, *ip_limit, *next_ip,
 			*candidate, *base;
 	uint16_t *table = (uint16_t *)working_memory;
+	uint32_t *table32 = (uint32_t *)working_memory;
 	EightBytesReference input_bytes;
 	uint32_t hash, next_hash, prev_hash, cur_hash, skip, candidate_bytes;
+	uint64_t fill;
 	int shift, matched;
 
+#define TABLE_GET(h)		(large ? table32[h] : !use_epoch ? table[h] : \
+				 ValidOffset(table[h], epoch, ip - base_ip))
+#define TABLE_SET(h, v)		do {					\
+					if (large) table32[h] = (v);	\
+					else table[h] = (v) + epoch;	\
+				} while (0)
+
 	DCHECK_GE(workmem_bytes_power_of_two, 9);
-	DCHECK_LE(workmem_bytes_power_of_two, 15);
-	/* Table of 2^X bytes, need (X-1) bits to address table of uint16_t.
+	DCHECK_LE(workmem_bytes_power_of_two, large ? 24 : 15);
+	/* Table of 2^X bytes, need (X-1) bits to address table of uint16_t,
+	 * or (X-2) bits for uint32_t.
 	 * How many bits of 32bit hash function result are discarded? */
-	shift = 33 - workmem_bytes_power_of_two;
+	shift = (large ? 34 : 33) - workmem_bytes_power_of_two;
 	/* "ip" is the input pointer, and "op" is the output pointer. */
 	ip = input;
-	DCHECK_LE(input_size, kBlockSize);
+	DCHECK_LE(input_size, large ? kLargeBlockSize : kBlockSize);
 	ip_end = input + input_size;
 	base_ip = ip;
 	/* Bytes in [next_emit, ip) will be emitted as literal bytes. Or
@@ -498,7 +867,22 @@ csnappy_compress_fragment(
 	if (unlikely(input_size < kInputMarginBytes))
 		goto emit_remainder;
 
-	memset(working_memory, 0, 1 << workmem_bytes_power_of_two);
+	/*
+	 * A fragment of one repeated byte or word (typically a zero page)
+	 * becomes one period of literal and a chain of copies, which is what
+	 * the loop below would produce, without clearing or probing the table.
+	 */
+	if (unlikely(FindFill(input, input_size, &fill))) {
+		matched = FillPeriod(fill);
+		if (op_limit && unlikely(op_limit - op < LiteralSize(matched) +
+					 CopySize(matched, input_size - matched)))
+			return NULL;
+		op = EmitLiteral(op, input, matched, 0);
+		return EmitCopy(op, matched, input_size - matched);
+	}
+
+	if (!use_epoch)
+		memset(working_memory, 0, 1 << workmem_bytes_power_of_two);
 
 	ip_limit = input + input_size - kInputMarginBytes;
 	next_hash = Hash(++ip, shift);
@@ -531,6 +915,10 @@ main_loop:
 	* The "skip" variable keeps track of how many bytes there are since the
 	* last match; dividing it by 32 (ie. right-shifting by five) gives the
 	* number of bytes to move ahead for each iteration.
+	* With "acceleration" N, skip grows N times as fast, so the step
+	* increases every 32/N bytes instead of every 32. N is at most
+	* CSNAPPY_MAX_ACCELERATION, so skip cannot wrap before the scan runs
+	* off the end of a fragment.
 	*/
 	skip = 32;
 
@@ -539,17 +927,26 @@ main_loop:
 		ip = next_ip;
 		hash = next_hash;
 		DCHECK_EQ(hash, Hash(ip, shift));
-		next_ip = ip + (skip++ >> 5);
+		next_ip = ip + (skip >> 5);
+		skip += acceleration;
 		if (unlikely(next_ip > ip_limit))
 			goto emit_remainder;
+		if (op_limit && unlikely(ip - next_emit >= op_limit - op))
+			return NULL;
 		next_hash = Hash(next_ip, shift);
-		candidate = base_ip + table[hash];
+		candidate = base_ip + TABLE_GET(hash);
 		DCHECK_GE(candidate, base_ip);
 		DCHECK_LT(candidate, ip);
 
-		table[hash] = ip - base_ip;
+		TABLE_SET(hash, ip - base_ip);
+		STATS_INC(hash_probes);
+		STATS_ADD(hash_collisions,
+			  UNALIGNED_LOAD32(ip) != UNALIGNED_LOAD32(candidate));
+		STATS_ADD(skips, next_ip - ip > 1);
+		STATS_ADD(skipped_bytes, next_ip - ip - 1);
 	} while (likely(UNALIGNED_LOAD32(ip) !=
-			UNALIGNED_LOAD32(candidate)));
+			UNALIGNED_LOAD32(candidate)) ||
+		 ShortFarMatch(large, ip, candidate));
 
 	/*
 	* Step 2: A 4-byte match has been found. We'll later see if more
@@ -557,7 +954,15 @@ main_loop:
 	* bytes [next_emit, ip) are unmatched. Emit them as "literal bytes."
 	*/
 	DCHECK_LE(next_emit + 16, ip_end);
-	op = EmitLiteral(op, next_emit, ip - next_emit, 1);
+	if (op_limit) {
+		if (unlikely(op_limit - op < LiteralSize(ip - next_emit)))
+			return NULL;
+		/* The fast path may write 16 bytes after the tag. */
+		op = EmitLiteral(op, next_emit, ip - next_emit,
+				 op_limit - op >= 17);
+	} else {
+		op = EmitLiteral(op, next_emit, ip - next_emit, 1);
+	}
 
 	/*
 	* Step 3: Call EmitCopy, and then see if another EmitCopy could
@@ -578,7 +983,13 @@ main_loop:
 		matched = 4 + FindMatchLength(candidate + 4, ip + 4, ip_end);
 		ip += matched;
 		DCHECK_EQ(0, memcmp(base, candidate, matched));
-		op = EmitCopy(op, base - candidate, matched);
+		if (op_limit && unlikely(op_limit - op <
+					 CopySize(base - candidate, matched)))
+			return NULL;
+		if (large && base - candidate >= 65536)
+			op = EmitFarCopy(op, base - candidate, matched);
+		else
+			op = EmitCopy(op, base - candidate, matched);
 		/* We could immediately start working at ip now, but to improve
 		 compression we first update table[Hash(ip - 1, ...)]. */
 		next_emit = ip;
@@ -586,12 +997,16 @@ main_loop:
 			goto emit_remainder;
 		input_bytes = GetEightBytesAt(ip - 1);
 		prev_hash = HashBytes(GetUint32AtOffset(input_bytes, 0), shift);
-		table[prev_hash] = ip - base_ip - 1;
+		TABLE_SET(prev_hash, ip - base_ip - 1);
 		cur_hash = HashBytes(GetUint32AtOffset(input_bytes, 1), shift);
-		candidate = base_ip + table[cur_hash];
+		candidate = base_ip + TABLE_GET(cur_hash);
 		candidate_bytes = UNALIGNED_LOAD32(candidate);
-		table[cur_hash] = ip - base_ip;
-	} while (GetUint32AtOffset(input_bytes, 1) == candidate_bytes);
+		TABLE_SET(cur_hash, ip - base_ip);
+		STATS_INC(hash_probes);
+		STATS_ADD(hash_collisions,
+			  GetUint32AtOffset(input_bytes, 1) != candidate_bytes);
+	} while (GetUint32AtOffset(input_bytes, 1) == candidate_bytes &&
+		 !ShortFarMatch(large, ip, candidate));
 
 	next_hash = HashBytes(GetUint32AtOffset(input_bytes, 2), shift);
 	++ip;
@@ -599,6 +1014,237 @@ main_loop:
 
 emit_remainder:
 	/* Emit the remaining bytes as a literal */
+	if (next_emit < ip_end) {
+		if (op_limit && op_limit - op < LiteralSize(ip_end - next_emit))
+			return NULL;
+		op = EmitLiteral(op, next_emit, ip_end - next_emit, 0);
+	}
+
+	return op;
+#undef TABLE_GET
+#undef TABLE_SET
+}
+
+char*
+csnappy_compress_fragment(
+	const char *input,
+	const uint32_t input_size,
+	char *op,
+	void *working_memory,
+	const int workmem_bytes_power_of_two)
+{
+	return compress_fragment(input, input_size, op, working_memory,
+				 workmem_bytes_power_of_two, 0, 0, 0, 1, NULL);
+}
+
+char*
+csnappy_compress_fragment_ex(
+	const char *input,
+	const uint32_t input_size,
+	char *op,
+	void *working_memory,
+	const int workmem_bytes_power_of_two,
+	int acceleration)
+{
+	if (acceleration < 1)
+		acceleration = 1;
+	else if (acceleration > CSNAPPY_MAX_ACCELERATION)
+		acceleration = CSNAPPY_MAX_ACCELERATION;
+	return compress_fragment(input, input_size, op, working_memory,
+				 workmem_bytes_power_of_two, 0, 0, 0,
+				 acceleration, NULL);
+}
+
+char*
+csnappy_compress_fragment_bounded(
+	const char *input,
+	const uint32_t input_size,
+	char *op,
+	void *working_memory,
+	const int workmem_bytes_power_of_two,
+	const uint32_t max_output)
+{
+	return compress_fragment(input, input_size, op, working_memory,
+				 workmem_bytes_power_of_two, 0, 0, 0, 1,
+				 op + max_output);
+}
+
+char*
+csnappy_compress_page4k(
+	const char *input,
+	char *op,
+	void *working_memory,
+	const uint32_t max_output)
+{
+	const int order = CSNAPPY_PAGE4K_WORKMEM_BYTES_POWER_OF_TWO;
+	/* Separate copies, so the common unbounded case has no checks. */
+	if (max_output >= csnappy_max_compressed_length(CSNAPPY_PAGE4K_BYTES))
+		return compress_fragment(input, CSNAPPY_PAGE4K_BYTES, op,
+					 working_memory, order, 0, 0, 0, 1,
+					 NULL);
+	return compress_fragment(input, CSNAPPY_PAGE4K_BYTES, op,
+				 working_memory, order, 0, 0, 0, 1,
+				 op + max_output);
+}
+
+char*
+csnappy_compress_fragment_large(
+	const char *input,
+	const uint32_t input_size,
+	char *op,
+	void *working_memory,
+	const int workmem_bytes_power_of_two)
+{
+	return compress_fragment(input, input_size, op, working_memory,
+				 workmem_bytes_power_of_two, 1, 0, 0, 1, NULL);
+}
+
+void
+csnappy_compress_ctx_init(
+	struct csnappy_compress_ctx *ctx,
+	void *working_memory,
+	const int workmem_bytes_power_of_two)
+{
+	ctx->working_memory = working_memory;
+	ctx->workmem_bytes_power_of_two = workmem_bytes_power_of_two;
+	ctx->epoch = 0;
+	memset(working_memory, 0, 1 << workmem_bytes_power_of_two);
+}
+
+char*
+csnappy_compress_fragment_ctx(
+	struct csnappy_compress_ctx *ctx,
+	const char *input,
+	const uint32_t input_size,
+	char *op)
+{
+	DCHECK_LE(input_size, kBlockSize);
+	op = compress_fragment(input, input_size, op, ctx->working_memory,
+			       ctx->workmem_bytes_power_of_two, 0, 1,
+			       ctx->epoch, 1, NULL);
+	ctx->epoch += input_size;
+	return op;
+}
+
+/*
+ * High compression mode.
+ *
+ * Instead of one position per hash table slot, working memory holds
+ * buckets of kHCBucketWays positions each, most recent first. Every
+ * position is inserted, all candidates in the bucket are tried and the
+ * longest match wins (ties go to the most recent, i.e. smallest offset).
+ * Matching is lazy: before a match at ip is emitted, ip + 1 is searched
+ * too, and if it yields a longer match the byte at ip becomes a literal.
+ */
+#define kHCBucketWays 8
+
+static INLINE void
+HCInsert(uint16_t *table, const char *base_ip, const char *ip, int shift)
+{
+	uint16_t *bucket = table + kHCBucketWays * Hash(ip, shift);
+	const uint32_t bytes = UNALIGNED_LOAD32(ip);
+	if (ip - base_ip >= 4 && (bytes == UNALIGNED_LOAD32(ip - 1) ||
+	    bytes == UNALIGNED_LOAD32(ip - 2) || bytes == UNALIGNED_LOAD32(ip - 3) ||
+	    bytes == UNALIGNED_LOAD32(ip - 4)))
+		return;
+	memmove(bucket + 1, bucket, (kHCBucketWays - 1) * sizeof(*bucket));
+	bucket[0] = ip - base_ip;
+}
+
+static INLINE int
+HCFindBestMatch(const uint16_t *table, const char *base_ip, const char *ip,
+		const char *ip_end, int shift, const char **match)
+{
+	const uint16_t *bucket = table + kHCBucketWays * Hash(ip, shift);
+	const char *candidate;
+	int i, len, best_len = 0;
+	for (i = 0; i < kHCBucketWays; i++) {
+		candidate = base_ip + bucket[i];
+		/* Only a candidate that agrees at ip[best_len] can do better. */
+		if (candidate < ip && (best_len == 0 || (ip + best_len < ip_end &&
+				candidate[best_len] == ip[best_len])) &&
+				UNALIGNED_LOAD32(ip) == UNALIGNED_LOAD32(candidate)) {
+			len = 4 + FindMatchLength(candidate + 4, ip + 4,
+						  ip_end);
+			if (len > best_len) {
+				best_len = len;
+				*match = candidate;
+			}
+		}
+		/* Unused slots are zero and sorted after the used ones. */
+		if (bucket[i] == 0)
+			break;
+	}
+	return best_len;
+}
+
+char*
+csnappy_compress_fragment_hc(
+	const char *input,
+	const uint32_t input_size,
+	char *op,
+	void *working_memory,
+	const int workmem_bytes_power_of_two)
+{
+	const char *ip, *ip_end, *base_ip, *next_emit, *ip_limit, *inserted,
+			*candidate, *next_candidate;
+	uint16_t *table = (uint16_t *)working_memory;
+	int shift, matched, next_matched;
+
+	DCHECK_GE(workmem_bytes_power_of_two, 9);
+	DCHECK_LE(workmem_bytes_power_of_two, 16);
+	/* Table of 2^X bytes holds 2^(X-4) buckets of 8 uint16_t each. */
+	shift = 36 - workmem_bytes_power_of_two;
+	ip = input;
+	DCHECK_LE(input_size, kBlockSize);
+	ip_end = input + input_size;
+	base_ip = ip;
+	next_emit = ip;
+
+	if (unlikely(input_size < kInputMarginBytes))
+		goto emit_remainder;
+
+	memset(working_memory, 0, 1 << workmem_bytes_power_of_two);
+
+	ip_limit = input + input_size - kInputMarginBytes;
+	/* Positions in [base_ip, inserted) are in the table. */
+	inserted = ip;
+	candidate = next_candidate = NULL;
+
+	while (ip < ip_limit) {
+		matched = HCFindBestMatch(table, base_ip, ip, ip_end, shift,
+					  &candidate);
+		HCInsert(table, base_ip, ip, shift);
+		inserted = ip + 1;
+		if (matched < 4) {
+			++ip;
+			continue;
+		}
+		/* Lazy evaluation: would starting one byte later be better? */
+		while (ip + 1 < ip_limit) {
+			next_matched = HCFindBestMatch(table, base_ip, ip + 1,
+					ip_end, shift, &next_candidate);
+			HCInsert(table, base_ip, ip + 1, shift);
+			inserted = ip + 2;
+			if (next_matched <= matched)
+				break;
+			++ip;
+			matched = next_matched;
+			candidate = next_candidate;
+		}
+		DCHECK_EQ(0, memcmp(ip, candidate, matched));
+		if (ip > next_emit)
+			op = EmitLiteral(op, next_emit, ip - next_emit, 1);
+		op = EmitCopy(op, ip - candidate, matched);
+		ip += matched;
+		next_emit = ip;
+		while (inserted < ip && inserted < ip_limit) {
+			HCInsert(table, base_ip, inserted, shift);
+			++inserted;
+		}
+	}
+
+emit_remainder:
 	if (next_emit < ip_end)
 		op = EmitLiteral(op, next_emit, ip_end - next_emit, 0);
 
@@ -607,6 +1253,13 @@ emit_remainder:
 #endif /* !simple */
 #if defined(__KERNEL__) && !defined(STATIC)
 EXPORT_SYMBOL(csnappy_compress_fragment);
+EXPORT_SYMBOL(csnappy_compress_fragment_hc);
+EXPORT_SYMBOL(csnappy_compress_fragment_ex);
+EXPORT_SYMBOL(csnappy_compress_fragment_bounded);
+EXPORT_SYMBOL(csnappy_compress_page4k);
+EXPORT_SYMBOL(csnappy_compress_fragment_large);
+EXPORT_SYMBOL(csnappy_compress_ctx_init);
+EXPORT_SYMBOL(csnappy_compress_fragment_ctx);
 #endif
 
 uint32_t __attribute__((const))
@@ -618,14 +1271,168 @@ csnappy_max_compressed_length(uint32_t source_len)
 EXPORT_SYMBOL(csnappy_max_compressed_length);
 #endif
 
-void
-csnappy_compress(
+int
+csnappy_is_same_filled(
 	const char *input,
 	uint32_t input_length,
+	uint64_t *fill)
+{
+	return FindFill(input, input_length, fill);
+}
+#if defined(__KERNEL__) && !defined(STATIC)
+EXPORT_SYMBOL(csnappy_is_same_filled);
+#endif
+
+/*
+ * One table for the whole batch, sized per item like compress_fragments
+ * does, so short records clear only a small table. While an item is being
+ * compressed the start of the next one is prefetched.
+ */
+uint32_t
+csnappy_compress_batch(
+	struct csnappy_batch_item *items,
+	uint32_t nr_items,
+	void *working_memory,
+	const int workmem_bytes_power_of_two)
+{
+	struct csnappy_batch_item *item, *end = items + nr_items;
+	uint32_t nr_ok = 0;
+	char *op;
+	for (item = items; item < end; item++) {
+		if (item + 1 < end) {
+			__builtin_prefetch(item[1].input);
+			__builtin_prefetch(item[1].input + 64);
+		}
+		item->output_length = 0;
+		if (unlikely(item->input_length > kBlockSize)) {
+			item->status = CSNAPPY_E_INPUT_NOT_CONSUMED;
+			continue;
+		}
+		if (item->max_output >=
+		    csnappy_max_compressed_length(item->input_length))
+			op = csnappy_compress_fragment(item->input,
+				item->input_length, item->output,
+				working_memory,
+				fragment_workmem_order(item->input_length,
+					kBlockSize, workmem_bytes_power_of_two));
+		else
+			op = csnappy_compress_fragment_bounded(item->input,
+				item->input_length, item->output,
+				working_memory,
+				fragment_workmem_order(item->input_length,
+					kBlockSize, workmem_bytes_power_of_two),
+				item->max_output);
+		if (!op) {
+			item->status = CSNAPPY_E_OUTPUT_INSUF;
+			continue;
+		}
+		item->output_length = op - item->output;
+		item->status = CSNAPPY_E_OK;
+		nr_ok++;
+	}
+	return nr_ok;
+}
+#if defined(__KERNEL__) && !defined(STATIC)
+EXPORT_SYMBOL(csnappy_compress_batch);
+#endif
+
+/*
+ * Where compress_fragments takes its input from: the flat buffer "input",
+ * or if "iov" is set, segments of an iovec array, which fragments that
+ * span segments are gathered from into "bounce".
+ */
+struct fragment_source {
+	const char *input;
+	const struct iovec *iov;
+	const char *seg;
+	size_t seg_left;
+	char *bounce;
+};
+
+static const char*
+next_fragment(struct fragment_source *src, uint32_t n)
+{
+	const char *fragment;
+	size_t chunk;
+	uint32_t have;
+	if (!src->iov) {
+		fragment = src->input;
+		src->input += n;
+		return fragment;
+	}
+	while (!src->seg_left) {
+		src->seg = (const char *)src->iov->iov_base;
+		src->seg_left = src->iov++->iov_len;
+	}
+	if (src->seg_left >= n) {
+		fragment = src->seg;
+		src->seg += n;
+		src->seg_left -= n;
+		return fragment;
+	}
+	for (have = 0; have < n; have += chunk) {
+		while (!src->seg_left) {
+			src->seg = (const char *)src->iov->iov_base;
+			src->seg_left = src->iov++->iov_len;
+		}
+		chunk = min(src->seg_left, (size_t)(n - have));
+		memcpy(src->bounce + have, src->seg, chunk);
+		src->seg += chunk;
+		src->seg_left -= chunk;
+	}
+	return src->bounce;
+}
+
+typedef char *(*fragment_compressor)(const char *input,
+				    const uint32_t input_length,
+				    char *output,
+				    void *working_memory,
+				    const int workmem_bytes_power_of_two,
+				    int acceleration);
+
+static char*
+fragment_fast(const char *input, const uint32_t input_length, char *output,
+	      void *working_memory, const int workmem_bytes_power_of_two,
+	      int acceleration)
+{
+	return csnappy_compress_fragment(input, input_length, output,
+				working_memory, workmem_bytes_power_of_two);
+}
+
+static char*
+fragment_hc(const char *input, const uint32_t input_length, char *output,
+	    void *working_memory, const int workmem_bytes_power_of_two,
+	    int acceleration)
+{
+	return csnappy_compress_fragment_hc(input, input_length, output,
+				working_memory, workmem_bytes_power_of_two);
+}
+
+static char*
+fragment_large(const char *input, const uint32_t input_length, char *output,
+	       void *working_memory, const int workmem_bytes_power_of_two,
+	       int acceleration)
+{
+	return csnappy_compress_fragment_large(input, input_length, output,
+				working_memory, workmem_bytes_power_of_two);
+}
+
+/*
+ * The one loop behind csnappy_compress and its variants: writes the
+ * header, then compresses the input from "src" in fragments of
+ * "block_size" bytes with "compress_fragment".
+ */
+static void
+compress_fragments(
+	struct fragment_source *src,
+	uint32_t input_length,
 	char *compressed,
 	uint32_t *compressed_length,
 	void *working_memory,
-	const int workmem_bytes_power_of_two)
+	const int workmem_bytes_power_of_two,
+	fragment_compressor compress_fragment,
+	const int acceleration,
+	const uint32_t block_size)
 {
 	int workmem_size;
 	int num_to_read;
@@ -634,29 +1441,237 @@ csnappy_compress(
 	written += (p - compressed);
 	compressed = p;
 	while (input_length > 0) {
-		num_to_read = min(input_length, (uint32_t)kBlockSize);
-		workmem_size = workmem_bytes_power_of_two;
-		if (unlikely(num_to_read < kBlockSize)) {
-			for (workmem_size = 9;
-			     workmem_size < workmem_bytes_power_of_two;
-			     ++workmem_size) {
-				if ((1 << (workmem_size-1)) >= num_to_read)
-					break;
-			}
-		}
-		p = csnappy_compress_fragment(
-				input, num_to_read, compressed,
-				working_memory, workmem_size);
+		num_to_read = min(input_length, block_size);
+		workmem_size = fragment_workmem_order(num_to_read, block_size,
+					workmem_bytes_power_of_two);
+		p = compress_fragment(
+				next_fragment(src, num_to_read), num_to_read,
+				compressed, working_memory, workmem_size,
+				acceleration);
 		written += (p - compressed);
 		compressed = p;
 		input_length -= num_to_read;
-		input += num_to_read;
 	}
 	*compressed_length = written;
 }
+
+void
+csnappy_compress(
+	const char *input,
+	uint32_t input_length,
+	char *compressed,
+	uint32_t *compressed_length,
+	void *working_memory,
+	const int workmem_bytes_power_of_two)
+{
+	struct fragment_source src = { 0 };
+	src.input = input;
+	compress_fragments(&src, input_length, compressed, compressed_length,
+			   working_memory, workmem_bytes_power_of_two,
+			   fragment_fast, 1, kBlockSize);
+}
 #if defined(__KERNEL__) && !defined(STATIC)
 EXPORT_SYMBOL(csnappy_compress);
+#endif
+
+void
+csnappy_compress_ex(
+	const char *input,
+	uint32_t input_length,
+	char *compressed,
+	uint32_t *compressed_length,
+	void *working_memory,
+	const int workmem_bytes_power_of_two,
+	const int acceleration)
+{
+	struct fragment_source src = { 0 };
+	src.input = input;
+	compress_fragments(&src, input_length, compressed, compressed_length,
+			   working_memory, workmem_bytes_power_of_two,
+			   csnappy_compress_fragment_ex, acceleration,
+			   kBlockSize);
+}
+#if defined(__KERNEL__) && !defined(STATIC)
+EXPORT_SYMBOL(csnappy_compress_ex);
+#endif
+
+int
+csnappy_compress_iov(
+	const struct iovec *iov,
+	int iovcnt,
+	char *compressed,
+	uint32_t *compressed_length,
+	char *bounce,
+	void *working_memory,
+	const int workmem_bytes_power_of_two)
+{
+	struct fragment_source src = { 0 };
+	size_t total = 0;
+	int i;
+	for (i = 0; i < iovcnt; i++) {
+		if (iov[i].iov_len > 0xffffffffU - total)
+			return CSNAPPY_E_INPUT_NOT_CONSUMED;
+		total += iov[i].iov_len;
+	}
+	src.iov = iov;
+	src.bounce = bounce;
+	compress_fragments(&src, total, compressed, compressed_length,
+			   working_memory, workmem_bytes_power_of_two,
+			   fragment_fast, 1, kBlockSize);
+	return CSNAPPY_E_OK;
+}
+#if defined(__KERNEL__) && !defined(STATIC)
+EXPORT_SYMBOL(csnappy_compress_iov);
+#endif
+
+void
+csnappy_compress_hc(
+	const char *input,
+	uint32_t input_length,
+	char *compressed,
+	uint32_t *compressed_length,
+	void *working_memory,
+	const int workmem_bytes_power_of_two)
+{
+	struct fragment_source src = { 0 };
+	src.input = input;
+	compress_fragments(&src, input_length, compressed, compressed_length,
+			   working_memory, workmem_bytes_power_of_two,
+			   fragment_hc, 1, kBlockSize);
+}
+
+void
+csnappy_compress_large(
+	const char *input,
+	uint32_t input_length,
+	char *compressed,
+	uint32_t *compressed_length,
+	void *working_memory,
+	const int workmem_bytes_power_of_two)
+{
+	struct fragment_source src = { 0 };
+	src.input = input;
+	compress_fragments(&src, input_length, compressed, compressed_length,
+			   working_memory, workmem_bytes_power_of_two,
+			   fragment_large, 1, kLargeBlockSize);
+}
+
+/*
+ * The stream buffer holds the input fragment being gathered, followed by
+ * room for the header and the compressed fragment.
+ */
+void
+csnappy_compress_stream_init(
+	struct csnappy_compress_stream *stream,
+	uint32_t total_length,
+	char *buffer,
+	void *working_memory,
+	const int workmem_bytes_power_of_two,
+	csnappy_write_fn write,
+	void *opaque)
+{
+	stream->buffer = buffer;
+	stream->buffered = 0;
+	stream->remaining = total_length;
+	stream->header_written = 0;
+	stream->status = CSNAPPY_E_OK;
+	stream->working_memory = working_memory;
+	stream->workmem_bytes_power_of_two = workmem_bytes_power_of_two;
+	stream->write = write;
+	stream->opaque = opaque;
+}
+
+static int
+stream_emit(struct csnappy_compress_stream *stream,
+	    const char *input, uint32_t input_length)
+{
+	char *start = stream->buffer + kBlockSize, *p = start;
+	int ret;
+	if (!stream->header_written) {
+		/* remaining already excludes this fragment */
+		p = encode_varint32(p, stream->remaining + input_length);
+		stream->header_written = 1;
+	}
+	if (input_length)
+		p = csnappy_compress_fragment(input, input_length, p,
+			stream->working_memory,
+			fragment_workmem_order(input_length, kBlockSize,
+				stream->workmem_bytes_power_of_two));
+	ret = stream->write(stream->opaque, start, p - start);
+	return ret < 0 ? ret : CSNAPPY_E_OK;
+}
+
+int
+csnappy_compress_stream_update(
+	struct csnappy_compress_stream *stream,
+	const char *input,
+	uint32_t input_length)
+{
+	uint32_t n;
+	if (stream->status < 0)
+		return stream->status;
+	if (input_length > stream->remaining) {
+		stream->status = CSNAPPY_E_INPUT_NOT_CONSUMED;
+		return stream->status;
+	}
+	while (input_length > 0) {
+		if (!stream->buffered && input_length >= kBlockSize) {
+			/* Whole fragment available: compress it in place. */
+			n = kBlockSize;
+			stream->remaining -= n;
+			stream->status = stream_emit(stream, input, n);
+		} else {
+			n = min(input_length, kBlockSize - stream->buffered);
+			memcpy(stream->buffer + stream->buffered, input, n);
+			stream->buffered += n;
+			stream->remaining -= n;
+			if (stream->buffered == kBlockSize) {
+				stream->buffered = 0;
+				stream->status = stream_emit(stream,
+						stream->buffer, kBlockSize);
+			}
+		}
+		if (stream->status < 0)
+			return stream->status;
+		input += n;
+		input_length -= n;
+	}
+	return CSNAPPY_E_OK;
+}
+
+int
+csnappy_compress_stream_finish(
+	struct csnappy_compress_stream *stream)
+{
+	if (stream->status < 0)
+		return stream->status;
+	if (stream->remaining) {
+		stream->status = CSNAPPY_E_HEADER_BAD;
+		return stream->status;
+	}
+	if (stream->buffered || !stream->header_written)
+		stream->status = stream_emit(stream,
+				stream->buffer, stream->buffered);
+	stream->buffered = 0;
+	return stream->status;
+}
+#if defined(__KERNEL__) && !defined(STATIC)
+EXPORT_SYMBOL(csnappy_compress_hc);
+EXPORT_SYMBOL(csnappy_compress_large);
+EXPORT_SYMBOL(csnappy_compress_stream_init);
+EXPORT_SYMBOL(csnappy_compress_stream_update);
+EXPORT_SYMBOL(csnappy_compress_stream_finish);
 
 MODULE_LICENSE("BSD");
 MODULE_DESCRIPTION("Snappy Compressor");
 #endif
+
+#ifdef CSNAPPY_STATS
+__thread struct csnappy_stats *csnappy_stats_current;
+
+void
+csnappy_stats_attach(struct csnappy_stats *stats)
+{
+	csnappy_stats_current = stats;
+}
+#endif
@@ -73,6 +73,61 @@ err_out:
 EXPORT_SYMBOL(csnappy_get_uncompressed_length);
 #endif
 
+/*
+ * Data stored per entry in lookup table:
+ *      Range   Bits-used       Description
+ *      ------------------------------------
+ *      1..64   0..7            Literal/copy length encoded in opcode byte
+ *      0..7    8..10           Copy offset encoded in opcode byte / 256
+ *      0..4    11..13          Extra bytes after opcode
+ *
+ * We use eight bits for the length even though 7 would have sufficed
+ * because of efficiency reasons:
+ *      (1) Extracting a byte is faster than a bit-field
+ *      (2) It properly aligns copy offset so we do not need a <<8
+ */
+static const uint16_t char_table[256] = {
+	0x0001, 0x0804, 0x1001, 0x2001, 0x0002, 0x0805, 0x1002, 0x2002,
+	0x0003, 0x0806, 0x1003, 0x2003, 0x0004, 0x0807, 0x1004, 0x2004,
+	0x0005, 0x0808, 0x1005, 0x2005, 0x0006, 0x0809, 0x1006, 0x2006,
+	0x0007, 0x080a, 0x1007, 0x2007, 0x0008, 0x080b, 0x1008, 0x2008,
+	0x0009, 0x0904, 0x1009, 0x2009, 0x000a, 0x0905, 0x100a, 0x200a,
+	0x000b, 0x0906, 0x100b, 0x200b, 0x000c, 0x0907, 0x100c, 0x200c,
+	0x000d, 0x0908, 0x100d, 0x200d, 0x000e, 0x0909, 0x100e, 0x200e,
+	0x000f, 0x090a, 0x100f, 0x200f, 0x0010, 0x090b, 0x1010, 0x2010,
+	0x0011, 0x0a04, 0x1011, 0x2011, 0x0012, 0x0a05, 0x1012, 0x2012,
+	0x0013, 0x0a06, 0x1013, 0x2013, 0x0014, 0x0a07, 0x1014, 0x2014,
+	0x0015, 0x0a08, 0x1015, 0x2015, 0x0016, 0x0a09, 0x1016, 0x2016,
+	0x0017, 0x0a0a, 0x1017, 0x2017, 0x0018, 0x0a0b, 0x1018, 0x2018,
+	0x0019, 0x0b04, 0x1019, 0x2019, 0x001a, 0x0b05, 0x101a, 0x201a,
+	0x001b, 0x0b06, 0x101b, 0x201b, 0x001c, 0x0b07, 0x101c, 0x201c,
+	0x001d, 0x0b08, 0x101d, 0x201d, 0x001e, 0x0b09, 0x101e, 0x201e,
+	0x001f, 0x0b0a, 0x101f, 0x201f, 0x0020, 0x0b0b, 0x1020, 0x2020,
+	0x0021, 0x0c04, 0x1021, 0x2021, 0x0022, 0x0c05, 0x1022, 0x2022,
+	0x0023, 0x0c06, 0x1023, 0x2023, 0x0024, 0x0c07, 0x1024, 0x2024,
+	0x0025, 0x0c08, 0x1025, 0x2025, 0x0026, 0x0c09, 0x1026, 0x2026,
+	0x0027, 0x0c0a, 0x1027, 0x2027, 0x0028, 0x0c0b, 0x1028, 0x2028,
+	0x0029, 0x0d04, 0x1029, 0x2029, 0x002a, 0x0d05, 0x102a, 0x202a,
+	0x002b, 0x0d06, 0x102b, 0x202b, 0x002c, 0x0d07, 0x102c, 0x202c,
+	0x002d, 0x0d08, 0x102d, 0x202d, 0x002e, 0x0d09, 0x102e, 0x202e,
+	0x002f, 0x0d0a, 0x102f, 0x202f, 0x0030, 0x0d0b, 0x1030, 0x2030,
+	0x0031, 0x0e04, 0x1031, 0x2031, 0x0032, 0x0e05, 0x1032, 0x2032,
+	0x0033, 0x0e06, 0x1033, 0x2033, 0x0034, 0x0e07, 0x1034, 0x2034,
+	0x0035, 0x0e08, 0x1035, 0x2035, 0x0036, 0x0e09, 0x1036, 0x2036,
+	0x0037, 0x0e0a, 0x1037, 0x2037, 0x0038, 0x0e0b, 0x1038, 0x2038,
+	0x0039, 0x0f04, 0x1039, 0x2039, 0x003a, 0x0f05, 0x103a, 0x203a,
+	0x003b, 0x0f06, 0x103b, 0x203b, 0x003c, 0x0f07, 0x103c, 0x203c,
+	0x0801, 0x0f08, 0x103d, 0x203d, 0x1001, 0x0f09, 0x103e, 0x203e,
+	0x1801, 0x0f0a, 0x103f, 0x203f, 0x2001, 0x0f0b, 0x1040, 0x2040
+};
+
+/* A type that writes to a flat array. */
+struct SnappyArrayWriter {
+	char *base;
+	char *op;
+	char *op_limit;
+};
+
 #if defined(__arm__) && !defined(ARCH_ARM_HAVE_UNALIGNED)
 int csnappy_decompress_noheader(
 	const char	*src_,
@@ -103,6 +158,7 @@ int csnappy_decompress_noheader(
 			}
 			if (unlikely(src + length > src_end))
 				return CSNAPPY_E_DATA_MALFORMED;
+			STATS_LITERAL(decoded, length);
 			copy_src = src;
 			src += length;
 		} else {
@@ -126,6 +182,7 @@ int csnappy_decompress_noheader(
 			}
 			if (unlikely(!offset || (offset > dst - dst_base)))
 				return CSNAPPY_E_DATA_MALFORMED;
+			STATS_COPY(decoded, offset, length);
 			copy_src = (const uint8_t *)dst - offset;
 		}
 		if (unlikely(dst + length > dst_end))
@@ -135,55 +192,73 @@ int csnappy_decompress_noheader(
 	*dst_len = dst - dst_base;
 	return CSNAPPY_E_OK;
 }
-#else /* !(arm with no unaligned access) */
-/*
- * Data stored per entry in lookup table:
- *      Range   Bits-used       Description
- *      ------------------------------------
- *      1..64   0..7            Literal/copy length encoded in opcode byte
- *      0..7    8..10           Copy offset encoded in opcode byte / 256
- *      0..4    11..13          Extra bytes after opcode
- *
- * We use eight bits for the length even though 7 would have sufficed
- * because of efficiency reasons:
- *      (1) Extracting a byte is faster than a bit-field
- *      (2) It properly aligns copy offset so we do not need a <<8
- */
-static const uint16_t char_table[256] = {
-	0x0001, 0x0804, 0x1001, 0x2001, 0x0002, 0x0805, 0x1002, 0x2002,
-	0x0003, 0x0806, 0x1003, 0x2003, 0x0004, 0x0807, 0x1004, 0x2004,
-	0x0005, 0x0808, 0x1005, 0x2005, 0x0006, 0x0809, 0x1006, 0x2006,
-	0x0007, 0x080a, 0x1007, 0x2007, 0x0008, 0x080b, 0x1008, 0x2008,
-	0x0009, 0x0904, 0x1009, 0x2009, 0x000a, 0x0905, 0x100a, 0x200a,
-	0x000b, 0x0906, 0x100b, 0x200b, 0x000c, 0x0907, 0x100c, 0x200c,
-	0x000d, 0x0908, 0x100d, 0x200d, 0x000e, 0x0909, 0x100e, 0x200e,
-	0x000f, 0x090a, 0x100f, 0x200f, 0x0010, 0x090b, 0x1010, 0x2010,
-	0x0011, 0x0a04, 0x1011, 0x2011, 0x0012, 0x0a05, 0x1012, 0x2012,
-	0x0013, 0x0a06, 0x1013, 0x2013, 0x0014, 0x0a07, 0x1014, 0x2014,
-	0x0015, 0x0a08, 0x1015, 0x2015, 0x0016, 0x0a09, 0x1016, 0x2016,
-	0x0017, 0x0a0a, 0x1017, 0x2017, 0x0018, 0x0a0b, 0x1018, 0x2018,
-	0x0019, 0x0b04, 0x1019, 0x2019, 0x001a, 0x0b05, 0x101a, 0x201a,
-	0x001b, 0x0b06, 0x101b, 0x201b, 0x001c, 0x0b07, 0x101c, 0x201c,
-	0x001d, 0x0b08, 0x101d, 0x201d, 0x001e, 0x0b09, 0x101e, 0x201e,
-	0x001f, 0x0b0a, 0x101f, 0x201f, 0x0020, 0x0b0b, 0x1020, 0x2020,
-	0x0021, 0x0c04, 0x1021, 0x2021, 0x0022, 0x0c05, 0x1022, 0x2022,
-	0x0023, 0x0c06, 0x1023, 0x2023, 0x0024, 0x0c07, 0x1024, 0x2024,
-	0x0025, 0x0c08, 0x1025, 0x2025, 0x0026, 0x0c09, 0x1026, 0x2026,
-	0x0027, 0x0c0a, 0x1027, 0x2027, 0x0028, 0x0c0b, 0x1028, 0x2028,
-	0x0029, 0x0d04, 0x1029, 0x2029, 0x002a, 0x0d05, 0x102a, 0x202a,
-	0x002b, 0x0d06, 0x102b, 0x202b, 0x002c, 0x0d07, 0x102c, 0x202c,
-	0x002d, 0x0d08, 0x102d, 0x202d, 0x002e, 0x0d09, 0x102e, 0x202e,
-	0x002f, 0x0d0a, 0x102f, 0x202f, 0x0030, 0x0d0b, 0x1030, 0x2030,
-	0x0031, 0x0e04, 0x1031, 0x2031, 0x0032, 0x0e05, 0x1032, 0x2032,
-	0x0033, 0x0e06, 0x1033, 0x2033, 0x0034, 0x0e07, 0x1034, 0x2034,
-	0x0035, 0x0e08, 0x1035, 0x2035, 0x0036, 0x0e09, 0x1036, 0x2036,
-	0x0037, 0x0e0a, 0x1037, 0x2037, 0x0038, 0x0e0b, 0x1038, 0x2038,
-	0x0039, 0x0f04, 0x1039, 0x2039, 0x003a, 0x0f05, 0x103a, 0x203a,
-	0x003b, 0x0f06, 0x103b, 0x203b, 0x003c, 0x0f07, 0x103c, 0x203c,
-	0x0801, 0x0f08, 0x103d, 0x203d, 0x1001, 0x0f09, 0x103e, 0x203e,
-	0x1801, 0x0f0a, 0x103f, 0x203f, 0x2001, 0x0f0b, 0x1040, 0x2040
-};
 
+static INLINE int
+SAW__Append(struct SnappyArrayWriter *this,
+	    const char *ip, uint32_t len)
+{
+	if (unlikely((uint32_t)(this->op_limit - this->op) < len))
+		return CSNAPPY_E_OUTPUT_OVERRUN;
+	memcpy(this->op, ip, len);
+	this->op += len;
+	return CSNAPPY_E_OK;
+}
+
+static INLINE int
+SAW__AppendFastPath(struct SnappyArrayWriter *this,
+		    const char *ip, uint32_t len)
+{
+	return SAW__Append(this, ip, len);
+}
+
+static INLINE int
+SAW__AppendFromSelf(struct SnappyArrayWriter *this,
+		    uint32_t offset, uint32_t len)
+{
+	char *op = this->op;
+	const char *copy_src = op - offset;
+	if (unlikely(!offset || offset > (uint32_t)(op - this->base)))
+		return CSNAPPY_E_DATA_MALFORMED;
+	if (unlikely((uint32_t)(this->op_limit - op) < len))
+		return CSNAPPY_E_OUTPUT_OVERRUN;
+	this->op = op + len;
+	while (len--)
+		*op++ = *copy_src++;
+	return CSNAPPY_E_OK;
+}
+int
+csnappy_decompress_page4k(
+	const char	*src,
+	uint32_t	src_len,
+	char		*dst)
+{
+	uint32_t dst_len = CSNAPPY_PAGE4K_BYTES;
+	int ret = csnappy_decompress_noheader(src, src_len, dst, &dst_len);
+	if (ret == CSNAPPY_E_OK && dst_len != CSNAPPY_PAGE4K_BYTES)
+		ret = CSNAPPY_E_DATA_MALFORMED;
+	return ret;
+}
+
+/* No interleaving for this simple implementation. */
+uint32_t
+csnappy_decompress_batch(
+	struct csnappy_batch_item *items,
+	uint32_t nr_items)
+{
+	uint32_t i, nr_ok = 0;
+	for (i = 0; i < nr_items; i++) {
+		items[i].output_length = items[i].max_output;
+		items[i].status = csnappy_decompress_noheader(items[i].input,
+			items[i].input_length, items[i].output,
+			&items[i].output_length);
+		if (items[i].status == CSNAPPY_E_OK)
+			nr_ok++;
+		else
+			items[i].output_length = 0;
+	}
+	return nr_ok;
+}
+#else /* !(arm with no unaligned access) */
 /*
  * Copy "len" bytes from "src" to "op", one byte at a time.  Used for
  * handling COPY operations where the input and output regions may
@@ -253,14 +328,102 @@ static INLINE void IncrementalCopyFastPath(const char *src, char *op, int len)
 	}
 }
 
-
-/* A type that writes to a flat array. */
-struct SnappyArrayWriter {
-	char *base;
-	char *op;
-	char *op_limit;
+#ifdef CSNAPPY_X86_64_SIMD
+/*
+ * Copies with offset < 8 repeat a short pattern. Instead of growing the
+ * pattern eight bytes at a time, build a whole vector of it with a single
+ * pshufb and store that repeatedly. Row "offset" holds (i % offset), so
+ * shuffling the bytes at op - offset yields the pattern starting at op;
+ * the second half of a row continues the pattern at op + 16.
+ *
+ * Each store advances op by the largest multiple of offset that fits in
+ * the vector, so every store starts at the same phase of the pattern.
+ * Like IncrementalCopyFastPath this may write past op + len, but never
+ * past op_limit. Requires op_limit - op >= max(len, 16).
+ */
+static const uint8_t pattern_shuffle[8][32] __attribute__((aligned(32))) = {
+	{ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 },
+	{ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 },
+	{ 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1,
+	  0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1, 0, 1 },
+	{ 0, 1, 2, 0, 1, 2, 0, 1, 2, 0, 1, 2, 0, 1, 2, 0,
+	  1, 2, 0, 1, 2, 0, 1, 2, 0, 1, 2, 0, 1, 2, 0, 1 },
+	{ 0, 1, 2, 3, 0, 1, 2, 3, 0, 1, 2, 3, 0, 1, 2, 3,
+	  0, 1, 2, 3, 0, 1, 2, 3, 0, 1, 2, 3, 0, 1, 2, 3 },
+	{ 0, 1, 2, 3, 4, 0, 1, 2, 3, 4, 0, 1, 2, 3, 4, 0,
+	  1, 2, 3, 4, 0, 1, 2, 3, 4, 0, 1, 2, 3, 4, 0, 1 },
+	{ 0, 1, 2, 3, 4, 5, 0, 1, 2, 3, 4, 5, 0, 1, 2, 3,
+	  4, 5, 0, 1, 2, 3, 4, 5, 0, 1, 2, 3, 4, 5, 0, 1 },
+	{ 0, 1, 2, 3, 4, 5, 6, 0, 1, 2, 3, 4, 5, 6, 0, 1,
+	  2, 3, 4, 5, 6, 0, 1, 2, 3, 4, 5, 6, 0, 1, 2, 3 }
 };
 
+static __attribute__((target("ssse3"))) void
+PatternCopySSSE3(char *op, uint32_t offset, int len, const char *op_limit)
+{
+	const int stride = 16 - 16 % offset;
+	const __m128i pattern = _mm_shuffle_epi8(
+		_mm_loadu_si128((const __m128i *)(op - offset)),
+		_mm_load_si128((const __m128i *)pattern_shuffle[offset]));
+	while (len > 0 && op_limit - op >= 16) {
+		_mm_storeu_si128((__m128i *)op, pattern);
+		op += stride;
+		len -= stride;
+	}
+	if (len > 0)
+		IncrementalCopy(op - offset, op, len);
+}
+
+static __attribute__((target("avx2"))) void
+PatternCopyAVX2(char *op, uint32_t offset, int len, const char *op_limit)
+{
+	const int stride32 = 32 - 32 % offset, stride16 = 16 - 16 % offset;
+	const __m128i src = _mm_loadu_si128((const __m128i *)(op - offset));
+	const __m128i lo = _mm_shuffle_epi8(src,
+		_mm_load_si128((const __m128i *)pattern_shuffle[offset]));
+	const __m128i hi = _mm_shuffle_epi8(src,
+		_mm_load_si128((const __m128i *)(pattern_shuffle[offset] + 16)));
+	const __m256i pattern = _mm256_set_m128i(hi, lo);
+	while (len > 16 && op_limit - op >= 32) {
+		_mm256_storeu_si256((__m256i *)op, pattern);
+		op += stride32;
+		len -= stride32;
+	}
+	while (len > 0 && op_limit - op >= 16) {
+		_mm_storeu_si128((__m128i *)op, lo);
+		op += stride16;
+		len -= stride16;
+	}
+	if (len > 0)
+		IncrementalCopy(op - offset, op, len);
+}
+
+static void
+PatternCopyGeneric(char *op, uint32_t offset, int len, const char *op_limit)
+{
+	if (op_limit - op >= len + kMaxIncrementCopyOverflow)
+		IncrementalCopyFastPath(op - offset, op, len);
+	else
+		IncrementalCopy(op - offset, op, len);
+}
+
+static void (*PatternCopy)(char *, uint32_t, int, const char *) =
+	PatternCopyGeneric;
+
+static CSNAPPY_INIT void
+PatternCopyInit(void)
+{
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		PatternCopy = PatternCopyAVX2;
+	else if (__builtin_cpu_supports("ssse3"))
+		PatternCopy = PatternCopySSSE3;
+}
+#endif /* CSNAPPY_X86_64_SIMD */
+
+
 static INLINE int
 SAW__AppendFastPath(struct SnappyArrayWriter *this,
 		    const char *ip, uint32_t len)
@@ -305,6 +468,12 @@ SAW__AppendFromSelf(struct SnappyArrayWriter *this,
 	if (len <= 16 && offset >= 8 && space_left >= 16) {
 		UnalignedCopy64(op - offset, op);
 		UnalignedCopy64(op - offset + 8, op + 8);
+#ifdef CSNAPPY_X86_64_SIMD
+	} else if (offset < 8 && len > 16 && space_left >= 16) {
+		if (space_left < len)
+			return CSNAPPY_E_OUTPUT_OVERRUN;
+		PatternCopy(op, offset, len, this->op_limit);
+#endif
         } else if (space_left >= (len + kMaxIncrementCopyOverflow)) {
 		IncrementalCopyFastPath(op - offset, op, len);
 	} else {
@@ -316,21 +485,22 @@ SAW__AppendFromSelf(struct SnappyArrayWriter *this,
 	return CSNAPPY_E_OK;
 }
 
-int
-csnappy_decompress_noheader(
+/*
+ * Decodes all of [src, src + src_remaining) into "writer_", which may
+ * already hold earlier output.
+ */
+static INLINE __attribute__((always_inline)) int
+decompress_ops(
 	const char	*src,
 	uint32_t	src_remaining,
-	char		*dst,
-	uint32_t	*dst_len)
+	struct SnappyArrayWriter *writer_)
 {
-	struct SnappyArrayWriter writer;
+	struct SnappyArrayWriter writer = *writer_;
 	const char *end_minus5 = src + src_remaining - 5;
 	uint32_t length, trailer, opword, extra_bytes;
 	int ret, available;
 	uint8_t opcode;
 	char scratch[5];
-	writer.op = writer.base = dst;
-	writer.op_limit = writer.op + *dst_len;
 	#define LOOP_COND() \
 	if (unlikely(src >= end_minus5)) {		\
 		available = end_minus5 + 5 - src;	\
@@ -351,6 +521,7 @@ csnappy_decompress_noheader(
 			length = opword & 0xff;
 			src += extra_bytes;
 			trailer += opword & 0x700;
+			STATS_COPY(decoded, trailer, length);
 			ret = SAW__AppendFromSelf(&writer, trailer, length);
 			if (ret < 0)
 				return ret;
@@ -359,6 +530,7 @@ csnappy_decompress_noheader(
 			length = (opcode >> 2) + 1;
 			available = end_minus5 + 5 - src;
 			if (length <= 16 && available >= 16) {
+				STATS_LITERAL(decoded, length);
 				if ((ret = SAW__AppendFastPath(&writer, src, length)) < 0)
 					return ret;
 				src += length;
@@ -373,6 +545,7 @@ csnappy_decompress_noheader(
 			}
                         if (unlikely(available < (int32_t)length))
 				return CSNAPPY_E_DATA_MALFORMED;
+			STATS_LITERAL(decoded, length);
 			ret = SAW__Append(&writer, src, length);
 			if (ret < 0)
 				return ret;
@@ -382,13 +555,640 @@ csnappy_decompress_noheader(
 	}
 #undef LOOP_COND
 out:
-	*dst_len = writer.op - writer.base;
+	*writer_ = writer;
 	return CSNAPPY_E_OK;
 }
+
+int
+csnappy_decompress_noheader(
+	const char	*src,
+	uint32_t	src_remaining,
+	char		*dst,
+	uint32_t	*dst_len)
+{
+	struct SnappyArrayWriter writer;
+	int ret;
+	writer.op = writer.base = dst;
+	writer.op_limit = writer.op + *dst_len;
+	ret = decompress_ops(src, src_remaining, &writer);
+	if (ret == CSNAPPY_E_OK)
+		*dst_len = writer.op - writer.base;
+	return ret;
+}
+
+int
+csnappy_decompress_page4k(
+	const char	*src,
+	uint32_t	src_len,
+	char		*dst)
+{
+	struct SnappyArrayWriter writer;
+	int ret;
+	writer.op = writer.base = dst;
+	writer.op_limit = dst + CSNAPPY_PAGE4K_BYTES;
+	ret = decompress_ops(src, src_len, &writer);
+	if (ret == CSNAPPY_E_OK && writer.op != writer.op_limit)
+		ret = CSNAPPY_E_DATA_MALFORMED;
+	return ret;
+}
+
+/*
+ * Executes one opcode. Needs at least 5 bytes of input, so the tag and its
+ * extra bytes can be read without further checks.
+ */
+static INLINE __attribute__((always_inline)) int
+decompress_step(
+	const char	**src_,
+	const char	*src_end,
+	struct SnappyArrayWriter *writer)
+{
+	const char *src = *src_;
+	uint32_t length, trailer, opword, extra_bytes;
+	const uint8_t opcode = *(const uint8_t *)src++;
+	int ret, available;
+	if (opcode & 0x3) {
+		opword = char_table[opcode];
+		extra_bytes = opword >> 11;
+		trailer = get_unaligned_le(src, extra_bytes);
+		length = opword & 0xff;
+		*src_ = src + extra_bytes;
+		trailer += opword & 0x700;
+		STATS_COPY(decoded, trailer, length);
+		return SAW__AppendFromSelf(writer, trailer, length);
+	}
+	length = (opcode >> 2) + 1;
+	available = src_end - src;
+	if (length <= 16 && available >= 16) {
+		STATS_LITERAL(decoded, length);
+		*src_ = src + length;
+		return SAW__AppendFastPath(writer, src, length);
+	}
+	if (unlikely(length > 60)) {
+		extra_bytes = length - 60;
+		length = get_unaligned_le(src, extra_bytes) + 1;
+		src += extra_bytes;
+		available = src_end - src;
+	}
+	if (unlikely(available < (int32_t)length))
+		return CSNAPPY_E_DATA_MALFORMED;
+	STATS_LITERAL(decoded, length);
+	ret = SAW__Append(writer, src, length);
+	*src_ = src + length;
+	return ret;
+}
+
+/*
+ * Items are decoded two at a time, alternating one opcode from each.
+ * Every copy depends on the output of the opcode before it, but the two
+ * streams are independent, so the CPU can overlap the loads and copies of
+ * one with the work on the other. Once either stream gets near its end or
+ * fails, both are finished separately.
+ */
+static void
+decompress_pair(struct csnappy_batch_item *a, struct csnappy_batch_item *b)
+{
+	struct SnappyArrayWriter wa, wb;
+	const char *sa = a->input, *sb = b->input;
+	const char *ea = sa + a->input_length, *eb = sb + b->input_length;
+	int ra = CSNAPPY_E_OK, rb = CSNAPPY_E_OK;
+	wa.op = wa.base = a->output;
+	wa.op_limit = wa.op + a->max_output;
+	wb.op = wb.base = b->output;
+	wb.op_limit = wb.op + b->max_output;
+	while (ea - sa >= 5 && eb - sb >= 5) {
+		ra = decompress_step(&sa, ea, &wa);
+		rb = decompress_step(&sb, eb, &wb);
+		if (unlikely(ra < 0 || rb < 0))
+			break;
+	}
+	if (ra == CSNAPPY_E_OK)
+		ra = decompress_ops(sa, ea - sa, &wa);
+	if (rb == CSNAPPY_E_OK)
+		rb = decompress_ops(sb, eb - sb, &wb);
+	a->status = ra;
+	a->output_length = ra == CSNAPPY_E_OK ? wa.op - wa.base : 0;
+	b->status = rb;
+	b->output_length = rb == CSNAPPY_E_OK ? wb.op - wb.base : 0;
+}
+
+uint32_t
+csnappy_decompress_batch(
+	struct csnappy_batch_item *items,
+	uint32_t nr_items)
+{
+	uint32_t i, nr_ok = 0;
+	for (i = 0; i + 1 < nr_items; i += 2)
+		decompress_pair(&items[i], &items[i + 1]);
+	if (i < nr_items) {
+		items[i].output_length = items[i].max_output;
+		items[i].status = csnappy_decompress_noheader(items[i].input,
+			items[i].input_length, items[i].output,
+			&items[i].output_length);
+		if (items[i].status != CSNAPPY_E_OK)
+			items[i].output_length = 0;
+	}
+	for (i = 0; i < nr_items; i++)
+		nr_ok += items[i].status == CSNAPPY_E_OK;
+	return nr_ok;
+}
 #endif /* optimized for unaligned arch */
 
 #if defined(__KERNEL__) && !defined(STATIC)
 EXPORT_SYMBOL(csnappy_decompress_noheader);
+EXPORT_SYMBOL(csnappy_decompress_batch);
+EXPORT_SYMBOL(csnappy_decompress_page4k);
+#endif
+
+/*
+ * Streaming decompression keeps the output in one flat array, so copies can
+ * reach back as far as they like, but takes the input in arbitrary pieces.
+ * Whatever does not form a whole tag at the end of a piece is kept in
+ * this->tag; a literal cut short is written as far as it goes and
+ * this->literal_left remembers how much of it is still to come.
+ */
+enum {
+	STREAM_OPS = 0,
+	STREAM_HEADER = 1
+};
+
+/* Length of the tag starting with "opcode", extra bytes included. */
+static INLINE uint32_t
+stream_tag_length(uint8_t opcode)
+{
+	const uint32_t length = (opcode >> 2) + 1;
+	const uint32_t type = opcode & 0x3;
+	if (type)
+		return 1 + (type == 3 ? 4 : type);
+	return length > 60 ? 1 + length - 60 : 1;
+}
+
+void
+csnappy_decompress_stream_init(
+	struct csnappy_decompress_stream *this,
+	char *dst,
+	uint32_t dst_len)
+{
+	memset(this, 0, sizeof(*this));
+	this->dst = this->op = dst;
+	this->dst_len = dst_len;
+	this->state = STREAM_HEADER;
+}
+#if defined(__KERNEL__) && !defined(STATIC)
+EXPORT_SYMBOL(csnappy_decompress_stream_init);
+#endif
+
+static int
+stream_read_header(struct csnappy_decompress_stream *this,
+		   const char **src, const char *src_end)
+{
+	uint32_t olen;
+	int n;
+	while (*src < src_end) {
+		const uint8_t c = *(const uint8_t *)(*src)++;
+		this->tag[this->tag_len++] = c;
+		if (c >= 128 && this->tag_len < 5)
+			continue;
+		n = csnappy_get_uncompressed_length(
+			(const char *)this->tag, this->tag_len, &olen);
+		if (n < 0)
+			return n;
+		if (unlikely(olen > this->dst_len))
+			return CSNAPPY_E_OUTPUT_INSUF;
+		this->op_limit = this->dst + olen;
+		this->tag_len = 0;
+		this->state = STREAM_OPS;
+		break;
+	}
+	return CSNAPPY_E_OK;
+}
+
+/*
+ * Executes the tag at "tag"; the input following it starts at *src.
+ * A literal is copied as far as the input goes.
+ */
+static INLINE int
+stream_do_tag(struct csnappy_decompress_stream *this,
+	      struct SnappyArrayWriter *writer, const char *tag,
+	      const char **src, const char *src_end)
+{
+	const uint8_t opcode = *(const uint8_t *)tag;
+	uint32_t length, trailer, opword, n;
+	int ret;
+	if (opcode & 0x3) {
+		opword = char_table[opcode];
+		trailer = get_unaligned_le(tag + 1, opword >> 11);
+		length = opword & 0xff;
+		trailer += opword & 0x700;
+		STATS_COPY(decoded, trailer, length);
+		return SAW__AppendFromSelf(writer, trailer, length);
+	}
+	length = (opcode >> 2) + 1;
+	if (length <= 16 && src_end - *src >= 16) {
+		STATS_LITERAL(decoded, length);
+		ret = SAW__AppendFastPath(writer, *src, length);
+		*src += length;
+		return ret;
+	}
+	if (unlikely(length > 60))
+		length = get_unaligned_le(tag + 1, length - 60) + 1;
+	STATS_LITERAL(decoded, length);
+	n = min(length, (uint32_t)(src_end - *src));
+	ret = SAW__Append(writer, *src, n);
+	*src += n;
+	this->literal_left = length - n;
+	return ret;
+}
+
+int
+csnappy_decompress_stream_update(
+	struct csnappy_decompress_stream *this,
+	const char *src,
+	uint32_t src_len)
+{
+	struct SnappyArrayWriter writer;
+	const char *src_end = src + src_len;
+	const char *tag;
+	uint32_t n;
+	int ret;
+
+	if (unlikely(this->state < 0))
+		return this->state;
+	if (this->state == STREAM_HEADER) {
+		ret = stream_read_header(this, &src, src_end);
+		if (ret < 0)
+			goto err;
+		if (this->state == STREAM_HEADER)
+			return CSNAPPY_E_OK;
+	}
+	writer.base = this->dst;
+	writer.op = this->op;
+	writer.op_limit = this->op_limit;
+	if (this->literal_left) {
+		n = min(this->literal_left, (uint32_t)(src_end - src));
+		if ((ret = SAW__Append(&writer, src, n)) < 0)
+			goto err;
+		src += n;
+		this->literal_left -= n;
+	}
+	/* A literal left unfinished here has used up the input. */
+	while (src < src_end) {
+		if (likely(!this->tag_len && src_end - src >= 5)) {
+			/* The whole tag is here, extra bytes and all. */
+			tag = src;
+			src += stream_tag_length(*(const uint8_t *)tag);
+		} else {
+			if (!this->tag_len)
+				this->tag[this->tag_len++] = *src++;
+			n = stream_tag_length(this->tag[0]);
+			while (this->tag_len < n && src < src_end)
+				this->tag[this->tag_len++] = *src++;
+			if (this->tag_len < n)
+				break;
+			this->tag_len = 0;
+			tag = (const char *)this->tag;
+		}
+		if ((ret = stream_do_tag(this, &writer, tag, &src, src_end)) < 0)
+			goto err;
+	}
+	this->op = writer.op;
+	return CSNAPPY_E_OK;
+err:
+	this->state = ret;
+	return ret;
+}
+#if defined(__KERNEL__) && !defined(STATIC)
+EXPORT_SYMBOL(csnappy_decompress_stream_update);
+#endif
+
+int
+csnappy_decompress_stream_finish(
+	struct csnappy_decompress_stream *this,
+	uint32_t *dst_len)
+{
+	if (unlikely(this->state < 0))
+		return this->state;
+	if (this->state == STREAM_HEADER)
+		return CSNAPPY_E_HEADER_BAD;
+	if (this->tag_len || this->literal_left || this->op != this->op_limit)
+		return CSNAPPY_E_DATA_MALFORMED;
+	*dst_len = this->op - this->dst;
+	return CSNAPPY_E_OK;
+}
+#if defined(__KERNEL__) && !defined(STATIC)
+EXPORT_SYMBOL(csnappy_decompress_stream_finish);
+#endif
+
+/* Reads n (<= 4) little endian bytes, and nothing past them. */
+static INLINE uint32_t
+get_le_bytes(const uint8_t *p, uint32_t n)
+{
+	uint32_t v = 0;
+	while (n--)
+		v |= (uint32_t)p[n] << (8 * n);
+	return v;
+}
+
+/*
+ * Same checks as csnappy_decompress_noheader with the length from the
+ * header as the output size, but only the output length is tracked.
+ * While at least kValidateMargin bytes are left, any opcode with a literal
+ * of up to 60 bytes lies entirely within the input, so the fast loop
+ * needs no bounds checks and computes the next opcode's address from the
+ * opcode alone, without branches: that address is the only dependency
+ * between iterations. Anything unusual (long literals, errors, the end of
+ * input) is left to the careful loop, one opcode at a time.
+ */
+#define kValidateMargin 66
+int
+csnappy_validate(
+	const char *src,
+	uint32_t src_len)
+{
+	const uint8_t *ip, *ip_end;
+	uint32_t olen, produced = 0, length, offset, opword, extra_bytes;
+	uint32_t type, copy_mask;
+	uint8_t opcode;
+	int n;
+	n = csnappy_get_uncompressed_length(src, src_len, &olen);
+	if (unlikely(n < CSNAPPY_E_OK))
+		return n;
+	ip = (const uint8_t *)src + n;
+	ip_end = (const uint8_t *)src + src_len;
+	for (;;) {
+		while (likely(ip_end - ip >= kValidateMargin)) {
+			opcode = *ip;
+			type = opcode & 0x3;
+			copy_mask = 0 - (uint32_t)(type != 0);
+			opword = char_table[opcode];
+			length = opword & 0xff;
+			/* 0, 1, 2 or 4 extra bytes for types 0..3 */
+			extra_bytes = (0x4210 >> (type << 2)) & 0xf;
+			offset = get_unaligned_le(ip + 1, extra_bytes) +
+				 (opword & 0x700);
+			if (unlikely(((offset - 1 >= produced) & (type != 0)) |
+				     ((opcode >= 0xf0) & (type == 0)) |
+				     (olen - produced < length)))
+				break;
+			produced += length;
+			ip += 1 + ((extra_bytes & copy_mask) |
+				   (((uint32_t)(opcode >> 2) + 1) & ~copy_mask));
+		}
+		if (ip >= ip_end)
+			break;
+		opcode = *ip++;
+		if (opcode & 0x3) {
+			opword = char_table[opcode];
+			extra_bytes = opword >> 11;
+			if (unlikely((uint32_t)(ip_end - ip) < extra_bytes))
+				return CSNAPPY_E_DATA_MALFORMED;
+			offset = (likely(ip_end - ip >= 4) ?
+				  get_unaligned_le(ip, extra_bytes) :
+				  get_le_bytes(ip, extra_bytes)) +
+				 (opword & 0x700);
+			ip += extra_bytes;
+			length = opword & 0xff;
+			if (unlikely(!offset || offset > produced))
+				return CSNAPPY_E_DATA_MALFORMED;
+		} else {
+			length = (opcode >> 2) + 1;
+			if (unlikely(length > 60)) {
+				extra_bytes = length - 60;
+				if (unlikely((uint32_t)(ip_end - ip) <
+					     extra_bytes))
+					return CSNAPPY_E_DATA_MALFORMED;
+				length = (likely(ip_end - ip >= 4) ?
+					  get_unaligned_le(ip, extra_bytes) :
+					  get_le_bytes(ip, extra_bytes)) + 1;
+				ip += extra_bytes;
+			}
+			if (unlikely((uint32_t)(ip_end - ip) < length))
+				return CSNAPPY_E_DATA_MALFORMED;
+			ip += length;
+		}
+		if (unlikely(olen - produced < length))
+			return CSNAPPY_E_OUTPUT_OVERRUN;
+		produced += length;
+	}
+	return produced == olen ? CSNAPPY_E_OK : CSNAPPY_E_DATA_MALFORMED;
+}
+#if defined(__KERNEL__) && !defined(STATIC)
+EXPORT_SYMBOL(csnappy_validate);
+#endif
+
+/*
+ * A type that writes to a chain of iovec segments. "seg" is an array
+ * writer over the current segment (cut short where the total output
+ * ends), so anything that fits in it goes through the SAW__ fast paths;
+ * only the rest takes the SIW__ slow paths below. "produced" counts the
+ * bytes in earlier segments, which are all full.
+ */
+struct SnappyIovecWriter {
+	struct SnappyArrayWriter seg;
+	const struct iovec *iov;
+	int cur;
+	uint32_t produced;
+	uint32_t limit;
+};
+
+static void
+SIW__SetSegment(struct SnappyIovecWriter *this, int i)
+{
+	uint32_t room = this->limit - this->produced;
+	this->cur = i;
+	this->seg.base = this->seg.op = (char *)this->iov[i].iov_base;
+	this->seg.op_limit = this->seg.op +
+		(this->iov[i].iov_len < room ? this->iov[i].iov_len : room);
+}
+
+/* Moves on to the next segment with room, once the current one is full. */
+static void
+SIW__NextSegment(struct SnappyIovecWriter *this)
+{
+	while (this->seg.op == this->seg.op_limit) {
+		this->produced += this->seg.op - this->seg.base;
+		SIW__SetSegment(this, this->cur + 1);
+	}
+}
+
+static INLINE uint32_t
+SIW__Produced(const struct SnappyIovecWriter *this)
+{
+	return this->produced + (this->seg.op - this->seg.base);
+}
+
+static int
+SIW__Append(struct SnappyIovecWriter *this, const char *ip, uint32_t len)
+{
+	uint32_t n;
+	if (unlikely(this->limit - SIW__Produced(this) < len))
+		return CSNAPPY_E_OUTPUT_OVERRUN;
+	while (len) {
+		SIW__NextSegment(this);
+		n = min(len, (uint32_t)(this->seg.op_limit - this->seg.op));
+		memcpy(this->seg.op, ip, n);
+		this->seg.op += n;
+		ip += n;
+		len -= n;
+	}
+	return CSNAPPY_E_OK;
+}
+
+/*
+ * For copies that reach back into an earlier segment or run past the end
+ * of the current one. The source is found by walking back over earlier
+ * segments, then both ends advance through their segments a piece at a
+ * time. Only a piece that overlaps itself within one segment needs the
+ * bytewise copy.
+ */
+static int
+SIW__AppendFromSelf(struct SnappyIovecWriter *this,
+		    uint32_t offset, uint32_t len)
+{
+	const struct iovec *src_seg = &this->iov[this->cur];
+	const char *copy_src = this->seg.op, *src_limit;
+	uint32_t back = offset, n;
+	if (unlikely(!offset || offset > SIW__Produced(this)))
+		return CSNAPPY_E_DATA_MALFORMED;
+	if (unlikely(this->limit - SIW__Produced(this) < len))
+		return CSNAPPY_E_OUTPUT_OVERRUN;
+	while (back > (uint32_t)(copy_src - (const char *)src_seg->iov_base)) {
+		back -= copy_src - (const char *)src_seg->iov_base;
+		src_seg--;
+		copy_src = (const char *)src_seg->iov_base + src_seg->iov_len;
+	}
+	src_limit = (const char *)src_seg->iov_base + src_seg->iov_len;
+	copy_src -= back;
+	while (len) {
+		while (copy_src == src_limit) {
+			src_seg++;
+			copy_src = (const char *)src_seg->iov_base;
+			src_limit = copy_src + src_seg->iov_len;
+		}
+		SIW__NextSegment(this);
+		n = min(len, (uint32_t)(src_limit - copy_src));
+		n = min(n, (uint32_t)(this->seg.op_limit - this->seg.op));
+		len -= n;
+		if (src_seg == &this->iov[this->cur] && offset < n) {
+			while (n--)
+				*this->seg.op++ = *copy_src++;
+			continue;
+		}
+		memcpy(this->seg.op, copy_src, n);
+		this->seg.op += n;
+		copy_src += n;
+	}
+	return CSNAPPY_E_OK;
+}
+
+/*
+ * Laid out like csnappy_validate: while at least kValidateMargin bytes of
+ * input are left, literals of up to 60 bytes need no input bounds checks.
+ */
+int
+csnappy_decompress_iov(
+	const char *src,
+	uint32_t src_len,
+	const struct iovec *iov,
+	int iovcnt)
+{
+	struct SnappyIovecWriter writer;
+	const uint8_t *ip, *ip_end;
+	uint32_t olen, length, offset, opword, extra_bytes;
+	size_t capacity = 0;
+	uint8_t opcode;
+	int i, ret;
+	ret = csnappy_get_uncompressed_length(src, src_len, &olen);
+	if (unlikely(ret < CSNAPPY_E_OK))
+		return ret;
+	for (i = 0; i < iovcnt && capacity < olen; i++)
+		capacity += iov[i].iov_len;
+	if (unlikely(capacity < olen))
+		return CSNAPPY_E_OUTPUT_INSUF;
+	ip = (const uint8_t *)src + ret;
+	ip_end = (const uint8_t *)src + src_len;
+	writer.iov = iov;
+	writer.produced = 0;
+	writer.limit = olen;
+	writer.seg.base = writer.seg.op = writer.seg.op_limit = NULL;
+	writer.cur = -1;
+	if (iovcnt > 0)
+		SIW__SetSegment(&writer, 0);
+	for (;;) {
+		while (likely(ip_end - ip >= kValidateMargin)) {
+			opcode = *ip++;
+			opword = char_table[opcode];
+			length = opword & 0xff;
+			if (opcode & 0x3) {
+				extra_bytes = opword >> 11;
+				offset = get_unaligned_le(ip, extra_bytes) +
+					 (opword & 0x700);
+				ip += extra_bytes;
+				if (unlikely(SAW__AppendFromSelf(&writer.seg,
+						offset, length) < 0)) {
+					ret = SIW__AppendFromSelf(&writer,
+						offset, length);
+					if (ret < 0)
+						return ret;
+				}
+			} else if (likely(opcode < 0xf0)) {
+				ret = length <= 16 ?
+					SAW__AppendFastPath(&writer.seg,
+						(const char *)ip, length) :
+					SAW__Append(&writer.seg,
+						(const char *)ip, length);
+				if (unlikely(ret < 0)) {
+					ret = SIW__Append(&writer,
+						(const char *)ip, length);
+					if (ret < 0)
+						return ret;
+				}
+				ip += length;
+			} else {
+				ip--;
+				break;
+			}
+		}
+		if (ip >= ip_end)
+			break;
+		opcode = *ip++;
+		if (opcode & 0x3) {
+			opword = char_table[opcode];
+			extra_bytes = opword >> 11;
+			if (unlikely((uint32_t)(ip_end - ip) < extra_bytes))
+				return CSNAPPY_E_DATA_MALFORMED;
+			offset = (likely(ip_end - ip >= 4) ?
+				  get_unaligned_le(ip, extra_bytes) :
+				  get_le_bytes(ip, extra_bytes)) +
+				 (opword & 0x700);
+			ip += extra_bytes;
+			ret = SIW__AppendFromSelf(&writer, offset,
+						  opword & 0xff);
+		} else {
+			length = (opcode >> 2) + 1;
+			if (unlikely(length > 60)) {
+				extra_bytes = length - 60;
+				if (unlikely((uint32_t)(ip_end - ip) <
+					     extra_bytes))
+					return CSNAPPY_E_DATA_MALFORMED;
+				length = (likely(ip_end - ip >= 4) ?
+					  get_unaligned_le(ip, extra_bytes) :
+					  get_le_bytes(ip, extra_bytes)) + 1;
+				ip += extra_bytes;
+			}
+			if (unlikely((uint32_t)(ip_end - ip) < length))
+				return CSNAPPY_E_DATA_MALFORMED;
+			ret = SIW__Append(&writer, (const char *)ip, length);
+			ip += length;
+		}
+		if (unlikely(ret < 0))
+			return ret;
+	}
+	if (SIW__Produced(&writer) != olen)
+		return CSNAPPY_E_DATA_MALFORMED;
+	return CSNAPPY_E_OK;
+}
+#if defined(__KERNEL__) && !defined(STATIC)
+EXPORT_SYMBOL(csnappy_decompress_iov);
 #endif
 
 int
@@ -0,0 +1,460 @@
+/*
+Analyzer for compressed Snappy streams.
+
+Walks the ops of a stream with the decoding rules of
+csnappy_decompress_noheader and reports:
+  how many ops of each type there are, the stream and output bytes they
+  account for, and the output bytes per op,
+  literal length, copy length and copy offset distributions,
+  which path of the decoder each op takes, and an estimated decode cost.
+Decode speed depends mostly on the number of ops per output byte and on
+how many of them miss the fast paths (short literals, and copies of at
+most 16 bytes from at least 8 bytes back), so those are the numbers to
+look at when one stream decodes slower than another. The cost estimate
+weighs the paths with the rough cycle counts below; it is meant to rank
+encodings against each other, -t measures the real thing.
+
+Given two streams, e.g. of the same input from csnappy and upstream
+snappy, or with two workmem sizes, the reports are printed side by side
+with the difference, after checking that both decode to the same data.
+*/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "csnappy.h"
+
+#define MAX_FILE_SIZE (1 << 30)
+
+/*
+ * Cycles per op, for the calls some paths make, and per block of bytes
+ * moved: 16 for memcpy and pattern stores, 8 for the copy loop.
+ */
+#define COST_OP 5
+#define COST_CALL 10
+#define COST_BLOCK 1
+
+enum { LITERAL, COPY_1, COPY_2, COPY_4, NR_TYPES };
+static const char *const type_names[NR_TYPES] = {
+	"literal", "copy 1 byte offset", "copy 2 byte offset",
+	"copy 4 byte offset"
+};
+
+enum {
+	PATH_LITERAL_FAST,	/* at most 16 bytes, two 8 byte stores */
+	PATH_LITERAL_MEMCPY,
+	PATH_COPY_FAST,		/* at most 16 bytes from at least 8 back */
+	PATH_COPY_PATTERN,	/* more than 16 bytes from less than 8 back */
+	PATH_COPY_LOOP,		/* the rest, 8 bytes at a time */
+	NR_PATHS
+};
+static const char *const path_names[NR_PATHS] = {
+	"literal fast path", "literal memcpy", "copy fast path",
+	"copy short pattern", "copy 8 byte loop"
+};
+
+#define NR_BUCKETS 33	/* [n] counts values in [1 << (n-1), 1 << n) */
+
+struct dump_stats {
+	const char *name;
+	const char *data;
+	uint32_t size;
+	uint32_t length;	/* uncompressed */
+	uint64_t ops[NR_TYPES];
+	uint64_t in_bytes[NR_TYPES];
+	uint64_t out_bytes[NR_TYPES];
+	uint64_t paths[NR_PATHS];
+	uint64_t literal_length[NR_BUCKETS];
+	uint64_t copy_length[NR_BUCKETS];
+	uint64_t copy_offset[NR_BUCKETS];
+	uint64_t cost;
+	double mbps;
+};
+
+static int noheader, verbose, timing;
+
+static int bucket(uint64_t v)
+{
+	int n = 0;
+	while (v) {
+		v >>= 1;
+		n++;
+	}
+	return n;
+}
+
+static uint32_t get_le(const uint8_t *p, int n)
+{
+	uint32_t v = 0;
+	int i;
+	for (i = 0; i < n; i++)
+		v |= (uint32_t)p[i] << (8 * i);
+	return v;
+}
+
+static void count_op(struct dump_stats *st, int type, uint32_t in_bytes,
+		     uint32_t len, uint32_t offset, uint32_t src_left)
+{
+	int path;
+
+	st->ops[type]++;
+	st->in_bytes[type] += in_bytes;
+	st->out_bytes[type] += len;
+	st->cost += COST_OP;
+	if (type == LITERAL) {
+		st->literal_length[bucket(len)]++;
+		/* The fast path also needs 16 bytes of input to read. */
+		path = len <= 16 && src_left >= 16 ?
+			PATH_LITERAL_FAST : PATH_LITERAL_MEMCPY;
+	} else {
+		st->copy_length[bucket(len)]++;
+		st->copy_offset[bucket(offset)]++;
+		if (len <= 16 && offset >= 8)
+			path = PATH_COPY_FAST;
+		else if (len > 16 && offset < 8)
+			path = PATH_COPY_PATTERN;
+		else
+			path = PATH_COPY_LOOP;
+	}
+	st->paths[path]++;
+	if (path == PATH_LITERAL_MEMCPY || path == PATH_COPY_PATTERN)
+		st->cost += COST_CALL;
+	if (path == PATH_LITERAL_MEMCPY || path == PATH_COPY_PATTERN)
+		st->cost += (len + 15) / 16 * COST_BLOCK;
+	if (path == PATH_COPY_LOOP)
+		st->cost += (len + 7) / 8 * COST_BLOCK;
+	/* Growing a pattern shorter than 8 bytes takes a step per period. */
+	if (path == PATH_COPY_LOOP && offset < 8)
+		st->cost += 8 / offset * COST_BLOCK;
+}
+
+/*
+ * Same checks as csnappy_decompress_noheader, in the same order, so a
+ * stream it rejects is reported as bad at the op where it fails.
+ */
+static int parse(struct dump_stats *st)
+{
+	const uint8_t *src = (const uint8_t *)st->data;
+	const uint8_t *end = src + st->size, *tag;
+	uint64_t produced = 0, limit = 0xffffffff, len;
+	uint32_t offset, n;
+	int type, ret;
+
+	if (!noheader) {
+		ret = csnappy_get_uncompressed_length(st->data, st->size,
+						      &st->length);
+		if (ret < 0) {
+			fprintf(stderr, "%s: bad header\n", st->name);
+			return ret;
+		}
+		src += ret;
+		limit = st->length;
+	}
+	while (src < end) {
+		tag = src++;
+		type = *tag & 3;
+		len = (*tag >> 2) + 1;
+		offset = 0;
+		if (type == LITERAL) {
+			if (len > 60) {
+				n = len - 60;
+				if (end - src < n)
+					goto malformed;
+				len = (uint64_t)get_le(src, n) + 1;
+				src += n;
+			}
+			if (end - src < len)
+				goto malformed;
+		} else {
+			n = type == COPY_1 ? 1 : type == COPY_2 ? 2 : 4;
+			if (end - src < n)
+				goto malformed;
+			offset = get_le(src, n);
+			if (type == COPY_1) {
+				len = ((*tag >> 2) & 7) + 4;
+				offset += (*tag >> 5) << 8;
+			}
+			src += n;
+			if (!offset || offset > produced)
+				goto malformed;
+		}
+		if (len > limit - produced) {
+			fprintf(stderr, "%s: output overrun at %u\n", st->name,
+				(unsigned)(tag - (const uint8_t *)st->data));
+			return CSNAPPY_E_OUTPUT_OVERRUN;
+		}
+		if (verbose)
+			printf("%10u %10u  %-20s %10u %10u\n",
+			       (unsigned)(tag - (const uint8_t *)st->data),
+			       (unsigned)produced, type_names[type],
+			       (unsigned)len, offset);
+		count_op(st, type, src - tag + (type == LITERAL ? len : 0),
+			 len, offset, end - src);
+		if (type == LITERAL)
+			src += len;
+		produced += len;
+	}
+	if (noheader)
+		st->length = produced;
+	else if (produced != st->length) {
+		fprintf(stderr, "%s: %u bytes short\n", st->name,
+			(unsigned)(st->length - produced));
+		return CSNAPPY_E_DATA_MALFORMED;
+	}
+	return CSNAPPY_E_OK;
+malformed:
+	fprintf(stderr, "%s: malformed op at %u\n", st->name,
+		(unsigned)(tag - (const uint8_t *)st->data));
+	return CSNAPPY_E_DATA_MALFORMED;
+}
+
+static int decode(const struct dump_stats *st, char *out)
+{
+	uint32_t len = st->length;
+	if (noheader)
+		return csnappy_decompress_noheader(st->data, st->size,
+						   out, &len);
+	return csnappy_decompress(st->data, st->size, out, len);
+}
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Best of "timing" runs of at least 20ms each. */
+static void measure(struct dump_stats *st, char *out)
+{
+	long iterations = 1, i;
+	double t, best = 0;
+	int trial;
+
+	for (trial = 0; trial < timing; ) {
+		t = now();
+		for (i = 0; i < iterations; i++)
+			decode(st, out);
+		t = now() - t;
+		if (t < 0.02 && iterations < (1L << 30)) {
+			iterations *= 2;
+			continue;
+		}
+		t = (double)st->length * iterations / t / 1e6;
+		if (t > best)
+			best = t;
+		trial++;
+	}
+	st->mbps = best;
+}
+
+static int nr_files;
+
+/* One line of the report, with the difference if there are two streams. */
+static void row(const char *label, const char *fmt, double a, double b)
+{
+	char buf[32];
+	printf("%-28s", label);
+	snprintf(buf, sizeof(buf), fmt, a);
+	printf(" %14s", buf);
+	if (nr_files == 2) {
+		snprintf(buf, sizeof(buf), fmt, b);
+		printf(" %14s", buf);
+		snprintf(buf, sizeof(buf), fmt, b - a);
+		printf(" %14s", buf);
+		if (a)
+			printf(" %+8.1f%%", 100 * (b - a) / a);
+	}
+	printf("\n");
+}
+
+static uint64_t total(const uint64_t *v, int n)
+{
+	uint64_t sum = 0;
+	int i;
+	for (i = 0; i < n; i++)
+		sum += v[i];
+	return sum;
+}
+
+static void histogram(const char *title, const struct dump_stats *st,
+		      uint64_t (*field)(const struct dump_stats *, int))
+{
+	char label[64];
+	int i, b = nr_files - 1;
+
+	printf("%s\n", title);
+	for (i = 0; i < NR_BUCKETS; i++) {
+		if (!field(&st[0], i) && !field(&st[b], i))
+			continue;
+		if (i <= 1)
+			sprintf(label, "  %u", i);
+		else
+			sprintf(label, "  %u-%u", 1U << (i - 1),
+				(unsigned)(((uint64_t)1 << i) - 1));
+		row(label, "%.0f", field(&st[0], i), field(&st[b], i));
+	}
+}
+
+static uint64_t literal_length(const struct dump_stats *st, int i)
+{
+	return st->literal_length[i];
+}
+
+static uint64_t copy_length(const struct dump_stats *st, int i)
+{
+	return st->copy_length[i];
+}
+
+static uint64_t copy_offset(const struct dump_stats *st, int i)
+{
+	return st->copy_offset[i];
+}
+
+static void report(const struct dump_stats *st)
+{
+	double ops[2], bytes[2];
+	int i, b = nr_files - 1;
+
+	for (i = 0; i < nr_files; i++) {
+		ops[i] = total(st[i].ops, NR_TYPES);
+		bytes[i] = st[i].length ? st[i].length : 1;
+	}
+	printf("%-28s %14s", "", st[0].name);
+	if (nr_files == 2)
+		printf(" %14s %14s", st[1].name, "difference");
+	printf("\n");
+	row("compressed bytes", "%.0f", st[0].size, st[b].size);
+	row("uncompressed bytes", "%.0f", st[0].length, st[b].length);
+	row("ratio", "%.4f", st[0].size / bytes[0], st[b].size / bytes[b]);
+	row("ops", "%.0f", ops[0], ops[b]);
+	row("output bytes per op", "%.2f",
+	    ops[0] ? st[0].length / ops[0] : 0,
+	    ops[b] ? st[b].length / ops[b] : 0);
+	for (i = 0; i < NR_TYPES; i++) {
+		printf("%s\n", type_names[i]);
+		row("  ops", "%.0f", st[0].ops[i], st[b].ops[i]);
+		row("  stream bytes", "%.0f",
+		    st[0].in_bytes[i], st[b].in_bytes[i]);
+		row("  output bytes", "%.0f",
+		    st[0].out_bytes[i], st[b].out_bytes[i]);
+		row("  output bytes per op", "%.2f",
+		    st[0].ops[i] ? (double)st[0].out_bytes[i] / st[0].ops[i] : 0,
+		    st[b].ops[i] ? (double)st[b].out_bytes[i] / st[b].ops[i] : 0);
+	}
+	histogram("literal length", st, literal_length);
+	histogram("copy length", st, copy_length);
+	histogram("copy offset", st, copy_offset);
+	printf("decoder path\n");
+	for (i = 0; i < NR_PATHS; i++) {
+		char label[64];
+		sprintf(label, "  %s", path_names[i]);
+		row(label, "%.0f", st[0].paths[i], st[b].paths[i]);
+	}
+	row("estimated decode cycles", "%.0f", st[0].cost, st[b].cost);
+	row("estimated cycles per byte", "%.3f",
+	    st[0].cost / bytes[0], st[b].cost / bytes[b]);
+	if (timing)
+		row("measured decode MB/s", "%.1f", st[0].mbps, st[b].mbps);
+}
+
+static int load(struct dump_stats *st, const char *path)
+{
+	struct stat sb;
+	char *data;
+	FILE *f;
+
+	memset(st, 0, sizeof(*st));
+	st->name = strrchr(path, '/') ? strrchr(path, '/') + 1 : path;
+	if (stat(path, &sb) || !S_ISREG(sb.st_mode)) {
+		perror(path);
+		return 1;
+	}
+	if (sb.st_size > MAX_FILE_SIZE) {
+		fprintf(stderr, "%s: larger than %d bytes\n",
+			path, MAX_FILE_SIZE);
+		return 1;
+	}
+	st->size = sb.st_size;
+	if (!(data = malloc(st->size + 1))) {
+		perror("malloc");
+		return 1;
+	}
+	if (!(f = fopen(path, "rb")) ||
+	    fread(data, 1, st->size, f) != st->size) {
+		perror(path);
+		return 1;
+	}
+	fclose(f);
+	st->data = data;
+	return 0;
+}
+
+int main(int argc, char * const argv[])
+{
+	struct dump_stats st[2];
+	char *out[2] = { NULL, NULL };
+	int c, i, ret = 0;
+
+	while ((c = getopt(argc, argv, "nvt:")) != -1) {
+		switch (c) {
+		case 'n':
+			noheader = 1;
+			break;
+		case 'v':
+			verbose = 1;
+			break;
+		case 't':
+			if ((timing = atoi(optarg)) <= 0)
+				goto usage;
+			break;
+		default:
+			goto usage;
+		}
+	}
+	nr_files = argc - optind;
+	if (nr_files < 1 || nr_files > 2)
+		goto usage;
+	for (i = 0; i < nr_files; i++) {
+		if (load(&st[i], argv[optind + i]))
+			return 1;
+		if (verbose)
+			printf("%s\n%10s %10s  %-20s %10s %10s\n", st[i].name,
+			       "at", "output", "op", "length", "offset");
+		if (parse(&st[i]) != CSNAPPY_E_OK)
+			return 1;
+		if (!(out[i] = malloc(st[i].length + 1))) {
+			perror("malloc");
+			return 1;
+		}
+		if (decode(&st[i], out[i]) != CSNAPPY_E_OK) {
+			fprintf(stderr, "%s: parsed, but does not decompress\n",
+				st[i].name);
+			return 1;
+		}
+		if (timing)
+			measure(&st[i], out[i]);
+	}
+	report(st);
+	if (nr_files == 2 && (st[0].length != st[1].length ||
+			      memcmp(out[0], out[1], st[0].length))) {
+		printf("the streams decode to different data\n");
+		ret = 2;
+	}
+	for (i = 0; i < nr_files; i++) {
+		free(out[i]);
+		free((char *)st[i].data);
+	}
+	return ret;
+usage:
+	fprintf(stderr,
+	"usage: csnappy_dump [-n] [-v] [-t trials] file [file2]\n"
+	"Reports the ops of a compressed stream, or compares two streams.\n"
+	"  -n  streams have no uncompressed length header\n"
+	"  -v  list every op\n"
+	"  -t  also measure decompression speed, best of this many trials\n");
+	return 1;
+}
@@ -0,0 +1,478 @@
+/*
+Copyright 2011, Zeev Tarantov <zeev.tarantov@gmail.com>.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are
+met:
+
+  * Redistributions of source code must retain the above copyright
+notice, this list of conditions and the following disclaimer.
+  * Redistributions in binary form must reproduce the above
+copyright notice, this list of conditions and the following disclaimer
+in the documentation and/or other materials provided with the
+distribution.
+  * Neither the name of Zeev Tarantov nor the names of its
+contributors may be used to endorse or promote products derived from
+this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+Snappy framing format, as described in framing_format.txt of Google Snappy:
+a stream identifier followed by chunks, each with a one byte type and a
+three byte little endian length. Data chunks start with the masked CRC32C
+of their uncompressed contents and hold at most 64KiB of it.
+*/
+
+#include "csnappy_internal.h"
+#ifdef __KERNEL__
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/once.h>
+#endif
+#include "csnappy.h"
+
+enum {
+	CHUNK_COMPRESSED = 0x00,
+	CHUNK_UNCOMPRESSED = 0x01,
+	CHUNK_PADDING = 0xfe,
+	CHUNK_STREAM_IDENTIFIER = 0xff
+};
+
+static const char stream_identifier[10] = {
+	(char)CHUNK_STREAM_IDENTIFIER, 6, 0, 0, 's', 'N', 'a', 'P', 'p', 'Y'
+};
+
+#define kChunkSize CSNAPPY_FRAMED_CHUNK_BYTES
+#define kMaxChunkLength CSNAPPY_FRAMED_MAX_CHUNK_LENGTH
+
+
+/* CRC32C (Castagnoli), reflected polynomial. */
+#define kCrc32cPoly 0x82f63b78
+
+static uint32_t crc32c_table[8][256];
+
+static uint32_t
+crc32c_slice8(uint32_t crc, const uint8_t *p, uint32_t len)
+{
+	uint32_t lo, hi;
+	while (len && ((unsigned long)p & 7)) {
+		crc = crc32c_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+		len--;
+	}
+	while (len >= 8) {
+		lo = crc ^ (p[0] | (p[1] << 8) | (p[2] << 16) |
+			    ((uint32_t)p[3] << 24));
+		hi = p[4] | (p[5] << 8) | (p[6] << 16) | ((uint32_t)p[7] << 24);
+		crc = crc32c_table[7][lo & 0xff] ^
+		      crc32c_table[6][(lo >> 8) & 0xff] ^
+		      crc32c_table[5][(lo >> 16) & 0xff] ^
+		      crc32c_table[4][lo >> 24] ^
+		      crc32c_table[3][hi & 0xff] ^
+		      crc32c_table[2][(hi >> 8) & 0xff] ^
+		      crc32c_table[1][(hi >> 16) & 0xff] ^
+		      crc32c_table[0][hi >> 24];
+		p += 8;
+		len -= 8;
+	}
+	while (len--)
+		crc = crc32c_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+	return crc;
+}
+
+static void
+crc32c_init_table(void)
+{
+	uint32_t i, j, crc;
+	for (i = 0; i < 256; i++) {
+		crc = i;
+		for (j = 0; j < 8; j++)
+			crc = (crc >> 1) ^ (kCrc32cPoly & -(crc & 1));
+		crc32c_table[0][i] = crc;
+	}
+	for (i = 0; i < 256; i++)
+		for (j = 1; j < 8; j++)
+			crc32c_table[j][i] = (crc32c_table[j - 1][i] >> 8) ^
+				crc32c_table[0][crc32c_table[j - 1][i] & 0xff];
+}
+
+#ifdef CSNAPPY_X86_64_SIMD
+static __attribute__((target("sse4.2"))) uint32_t
+crc32c_sse42(uint32_t crc, const uint8_t *p, uint32_t len)
+{
+	uint64_t crc64;
+	while (len && ((unsigned long)p & 7)) {
+		crc = _mm_crc32_u8(crc, *p++);
+		len--;
+	}
+	crc64 = crc;
+	while (len >= 8) {
+		crc64 = _mm_crc32_u64(crc64, *(const uint64_t *)p);
+		p += 8;
+		len -= 8;
+	}
+	crc = (uint32_t)crc64;
+	while (len--)
+		crc = _mm_crc32_u8(crc, *p++);
+	return crc;
+}
+#endif
+
+/* Slow, but needs no table: only used until crc32c_init has run. */
+static uint32_t
+crc32c_bitwise(uint32_t crc, const uint8_t *p, uint32_t len)
+{
+	int k;
+	while (len--) {
+		crc ^= *p++;
+		for (k = 0; k < 8; k++)
+			crc = (crc >> 1) ^ (kCrc32cPoly & -(crc & 1));
+	}
+	return crc;
+}
+
+static uint32_t (*crc32c_update)(uint32_t, const uint8_t *, uint32_t) =
+	crc32c_bitwise;
+
+/* Builds the table before publishing the function that reads it. */
+static CSNAPPY_INIT void
+crc32c_init(void)
+{
+#ifdef CSNAPPY_X86_64_SIMD
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse4.2")) {
+		crc32c_update = crc32c_sse42;
+		return;
+	}
+#endif
+	crc32c_init_table();
+	crc32c_update = crc32c_slice8;
+}
+
+uint32_t
+csnappy_crc32c(uint32_t crc, const char *data, uint32_t len)
+{
+#ifdef __KERNEL__
+	DO_ONCE(crc32c_init);
+#endif
+	return ~crc32c_update(~crc, (const uint8_t *)data, len);
+}
+#if defined(__KERNEL__) && !defined(STATIC)
+EXPORT_SYMBOL(csnappy_crc32c);
+#endif
+
+static INLINE uint32_t
+masked_crc32c(const char *data, uint32_t len)
+{
+	const uint32_t crc = csnappy_crc32c(0, data, len);
+	return ((crc >> 15) | (crc << 17)) + 0xa282ead8;
+}
+
+static INLINE void
+put_le32(char *p, uint32_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+	p[2] = v >> 16;
+	p[3] = v >> 24;
+}
+
+static INLINE uint32_t
+get_le32(const char *p)
+{
+	const uint8_t *q = (const uint8_t *)p;
+	return q[0] | (q[1] << 8) | (q[2] << 16) | ((uint32_t)q[3] << 24);
+}
+
+
+/*
+ * The encoder buffer holds the chunk being gathered, followed by room for
+ * the chunk header, the checksum and the compressed chunk.
+ */
+void
+csnappy_framed_compress_init(
+	struct csnappy_framed_compress *stream,
+	char *buffer,
+	void *working_memory,
+	const int workmem_bytes_power_of_two,
+	csnappy_write_fn write,
+	void *opaque)
+{
+	stream->buffer = buffer;
+	stream->buffered = 0;
+	stream->header_written = 0;
+	stream->status = CSNAPPY_E_OK;
+	stream->working_memory = working_memory;
+	stream->workmem_bytes_power_of_two = workmem_bytes_power_of_two;
+	stream->write = write;
+	stream->opaque = opaque;
+}
+#if defined(__KERNEL__) && !defined(STATIC)
+EXPORT_SYMBOL(csnappy_framed_compress_init);
+#endif
+
+/*
+ * A chunk is stored compressed only if that saves at least 1/8 of it,
+ * like the reference implementation does.
+ */
+static int
+framed_emit(struct csnappy_framed_compress *stream,
+	    const char *input, uint32_t input_length)
+{
+	char *out = stream->buffer + kChunkSize;
+	uint32_t compressed_length;
+	int ret;
+	if (!stream->header_written) {
+		ret = stream->write(stream->opaque, stream_identifier,
+				    sizeof(stream_identifier));
+		if (ret < 0)
+			return ret;
+		stream->header_written = 1;
+	}
+	if (!input_length)
+		return CSNAPPY_E_OK;
+	put_le32(out + 4, masked_crc32c(input, input_length));
+	csnappy_compress(input, input_length, out + 8, &compressed_length,
+			 stream->working_memory,
+			 stream->workmem_bytes_power_of_two);
+	if (compressed_length < input_length - input_length / 8) {
+		put_le32(out, (compressed_length + 4) << 8 | CHUNK_COMPRESSED);
+		ret = stream->write(stream->opaque, out, compressed_length + 8);
+	} else {
+		put_le32(out, (input_length + 4) << 8 | CHUNK_UNCOMPRESSED);
+		ret = stream->write(stream->opaque, out, 8);
+		if (ret >= 0)
+			ret = stream->write(stream->opaque, input, input_length);
+	}
+	return ret < 0 ? ret : CSNAPPY_E_OK;
+}
+
+int
+csnappy_framed_compress_update(
+	struct csnappy_framed_compress *stream,
+	const char *input,
+	uint32_t input_length)
+{
+	uint32_t n;
+	if (stream->status < 0)
+		return stream->status;
+	while (input_length > 0) {
+		if (!stream->buffered && input_length >= kChunkSize) {
+			/* Whole chunk available: compress it in place. */
+			n = kChunkSize;
+			stream->status = framed_emit(stream, input, n);
+		} else {
+			n = min(input_length, kChunkSize - stream->buffered);
+			memcpy(stream->buffer + stream->buffered, input, n);
+			stream->buffered += n;
+			if (stream->buffered == kChunkSize) {
+				stream->buffered = 0;
+				stream->status = framed_emit(stream,
+						stream->buffer, kChunkSize);
+			}
+		}
+		if (stream->status < 0)
+			return stream->status;
+		input += n;
+		input_length -= n;
+	}
+	return CSNAPPY_E_OK;
+}
+#if defined(__KERNEL__) && !defined(STATIC)
+EXPORT_SYMBOL(csnappy_framed_compress_update);
+#endif
+
+int
+csnappy_framed_compress_finish(
+	struct csnappy_framed_compress *stream)
+{
+	if (stream->status < 0)
+		return stream->status;
+	if (stream->buffered || !stream->header_written)
+		stream->status = framed_emit(stream,
+				stream->buffer, stream->buffered);
+	stream->buffered = 0;
+	return stream->status;
+}
+#if defined(__KERNEL__) && !defined(STATIC)
+EXPORT_SYMBOL(csnappy_framed_compress_finish);
+#endif
+
+
+/*
+ * Decoder states. A chunk whose body is wholly inside the input passed to
+ * update is decoded from there; otherwise the body is gathered in the
+ * buffer first. Skippable chunks are never buffered.
+ */
+enum {
+	FRAMED_HEADER = 0,
+	FRAMED_BODY,
+	FRAMED_SKIP
+};
+
+void
+csnappy_framed_decompress_init(
+	struct csnappy_framed_decompress *stream,
+	char *buffer,
+	csnappy_write_fn write,
+	void *opaque)
+{
+	stream->buffer = buffer;
+	stream->state = FRAMED_HEADER;
+	stream->have = 0;
+	stream->chunk_length = 0;
+	stream->seen_identifier = 0;
+	stream->status = CSNAPPY_E_OK;
+	stream->write = write;
+	stream->opaque = opaque;
+}
+#if defined(__KERNEL__) && !defined(STATIC)
+EXPORT_SYMBOL(csnappy_framed_decompress_init);
+#endif
+
+static int
+framed_check_header(struct csnappy_framed_decompress *stream)
+{
+	const uint8_t type = stream->header[0];
+	stream->chunk_length = get_le32(stream->header) >> 8;
+	stream->have = 0;
+	if (type == CHUNK_STREAM_IDENTIFIER) {
+		if (stream->chunk_length != sizeof(stream_identifier) - 4)
+			return CSNAPPY_E_DATA_MALFORMED;
+		stream->state = FRAMED_BODY;
+		return CSNAPPY_E_OK;
+	}
+	if (!stream->seen_identifier)
+		return CSNAPPY_E_HEADER_BAD;
+	if (type == CHUNK_COMPRESSED || type == CHUNK_UNCOMPRESSED) {
+		if (stream->chunk_length < 4 ||
+		    stream->chunk_length > (type == CHUNK_COMPRESSED ?
+				kMaxChunkLength : kChunkSize + 4))
+			return CSNAPPY_E_DATA_MALFORMED;
+		stream->state = FRAMED_BODY;
+		return CSNAPPY_E_OK;
+	}
+	/* Reserved unskippable chunk types. */
+	if (type < 0x80)
+		return CSNAPPY_E_DATA_MALFORMED;
+	stream->state = FRAMED_SKIP;
+	return CSNAPPY_E_OK;
+}
+
+static int
+framed_chunk(struct csnappy_framed_decompress *stream, const char *body)
+{
+	char *out = stream->buffer + kMaxChunkLength;
+	const uint32_t body_length = stream->chunk_length;
+	const char *data = body + 4;
+	uint32_t data_length = body_length - 4, uncompressed_length;
+	int n, ret;
+
+	stream->state = FRAMED_HEADER;
+	stream->have = 0;
+	switch ((uint8_t)stream->header[0]) {
+	case CHUNK_STREAM_IDENTIFIER:
+		if (memcmp(body, stream_identifier + 4, body_length))
+			return CSNAPPY_E_HEADER_BAD;
+		stream->seen_identifier = 1;
+		return CSNAPPY_E_OK;
+	case CHUNK_COMPRESSED:
+		n = csnappy_get_uncompressed_length(data, data_length,
+						    &uncompressed_length);
+		if (n < 0)
+			return n;
+		if (uncompressed_length > kChunkSize)
+			return CSNAPPY_E_DATA_MALFORMED;
+		data_length = uncompressed_length;
+		ret = csnappy_decompress_noheader(data + n,
+				body_length - 4 - n, out, &data_length);
+		if (ret < 0)
+			return ret;
+		if (data_length != uncompressed_length)
+			return CSNAPPY_E_DATA_MALFORMED;
+		data = out;
+		break;
+	}
+	if (masked_crc32c(data, data_length) != get_le32(body))
+		return CSNAPPY_E_CHECKSUM_BAD;
+	ret = stream->write(stream->opaque, data, data_length);
+	return ret < 0 ? ret : CSNAPPY_E_OK;
+}
+
+int
+csnappy_framed_decompress_update(
+	struct csnappy_framed_decompress *stream,
+	const char *src,
+	uint32_t src_len)
+{
+	uint32_t n;
+	if (stream->status < 0)
+		return stream->status;
+	while (src_len > 0) {
+		switch (stream->state) {
+		case FRAMED_HEADER:
+			n = min(src_len, 4 - stream->have);
+			memcpy(stream->header + stream->have, src, n);
+			stream->have += n;
+			if (stream->have == 4)
+				stream->status = framed_check_header(stream);
+			break;
+		case FRAMED_SKIP:
+			n = min(src_len, stream->chunk_length - stream->have);
+			stream->have += n;
+			break;
+		default:
+			if (!stream->have && src_len >= stream->chunk_length) {
+				n = stream->chunk_length;
+				stream->status = framed_chunk(stream, src);
+				break;
+			}
+			n = min(src_len, stream->chunk_length - stream->have);
+			memcpy(stream->buffer + stream->have, src, n);
+			stream->have += n;
+			if (stream->have == stream->chunk_length)
+				stream->status = framed_chunk(stream,
+							      stream->buffer);
+		}
+		if (stream->status < 0)
+			return stream->status;
+		if (stream->state == FRAMED_SKIP &&
+		    stream->have == stream->chunk_length) {
+			stream->state = FRAMED_HEADER;
+			stream->have = 0;
+		}
+		src += n;
+		src_len -= n;
+	}
+	return CSNAPPY_E_OK;
+}
+#if defined(__KERNEL__) && !defined(STATIC)
+EXPORT_SYMBOL(csnappy_framed_decompress_update);
+#endif
+
+int
+csnappy_framed_decompress_finish(
+	struct csnappy_framed_decompress *stream)
+{
+	if (stream->status < 0)
+		return stream->status;
+	if (stream->state != FRAMED_HEADER || stream->have)
+		return CSNAPPY_E_DATA_MALFORMED;
+	return CSNAPPY_E_OK;
+}
+#if defined(__KERNEL__) && !defined(STATIC)
+EXPORT_SYMBOL(csnappy_framed_decompress_finish);
+
+MODULE_LICENSE("BSD");
+MODULE_DESCRIPTION("Snappy framing format");
+#endif
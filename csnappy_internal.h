@@ -44,10 +44,12 @@ Steffen Mueller <smueller@cpan.org>
 #ifndef __KERNEL__
 #include "csnappy_internal_userspace.h"
 #include <string.h>
+#include <sys/uio.h>
 #else
 
 #include <linux/types.h>
 #include <linux/string.h>
+#include <linux/uio.h>
 #include <linux/compiler.h>
 #include <asm/byteorder.h>
 #include <asm/unaligned.h>
@@ -91,6 +93,28 @@ Steffen Mueller <smueller@cpan.org>
 #  define ARCH_ARM_HAVE_UNALIGNED
 #endif
 
+/*
+ * x86_64 userspace builds carry SSE2 and newer code paths that are selected
+ * at run time according to what the CPU supports.
+ */
+#if defined(__x86_64__) && defined(__GNUC__) && !defined(__KERNEL__)
+#  define CSNAPPY_X86_64_SIMD
+#  include <immintrin.h>
+#endif
+
+/*
+ * Where code is picked at run time, a function pointer starts out at a
+ * portable implementation and a CSNAPPY_INIT function, run when the
+ * library is loaded and before any caller can reach it, switches it to
+ * the best one for the CPU. Nothing else writes the pointer, so there is
+ * no race with threads calling through it.
+ */
+#ifndef __KERNEL__
+#  define CSNAPPY_INIT __attribute__((constructor))
+#else
+/* No constructors here: the kernel calls them through DO_ONCE instead. */
+#  define CSNAPPY_INIT
+#endif
 
 static INLINE void UnalignedCopy64(const void *src, void *dst) {
 #if defined(__i386__) || defined(__x86_64__) || defined(__powerpc__) || defined(ARCH_ARM_HAVE_UNALIGNED) || defined(__aarch64__)
@@ -148,6 +172,96 @@ static INLINE void UnalignedCopy64(const void *src, void *dst) {
 #define DCHECK_LT(a, b)	DCHECK(((a) <  (b)))
 #define DCHECK_LE(a, b)	DCHECK(((a) <= (b)))
 
+static INLINE char*
+encode_varint32(char *sptr, uint32_t v)
+{
+	uint8_t* ptr = (uint8_t *)sptr;
+	static const int B = 128;
+	if (v < (1<<7)) {
+		*(ptr++) = v;
+	} else if (v < (1<<14)) {
+		*(ptr++) = v | B;
+		*(ptr++) = v>>7;
+	} else if (v < (1<<21)) {
+		*(ptr++) = v | B;
+		*(ptr++) = (v>>7) | B;
+		*(ptr++) = v>>14;
+	} else if (v < (1<<28)) {
+		*(ptr++) = v | B;
+		*(ptr++) = (v>>7) | B;
+		*(ptr++) = (v>>14) | B;
+		*(ptr++) = v>>21;
+	} else {
+		*(ptr++) = v | B;
+		*(ptr++) = (v>>7) | B;
+		*(ptr++) = (v>>14) | B;
+		*(ptr++) = (v>>21) | B;
+		*(ptr++) = v>>28;
+	}
+	return (char *)ptr;
+}
+
+/*
+ * Working memory size used for a fragment of "n" bytes out of at most
+ * "block_size": the full table for full fragments, a smaller one (that is
+ * faster to clear) for the short last fragment.
+ */
+static INLINE int
+fragment_workmem_order(uint32_t n, uint32_t block_size,
+		       int workmem_bytes_power_of_two)
+{
+	int workmem_size = workmem_bytes_power_of_two;
+	if (n < block_size) {
+		for (workmem_size = 9;
+		     workmem_size < workmem_bytes_power_of_two;
+		     ++workmem_size) {
+			if ((1U << (workmem_size-1)) >= n)
+				break;
+		}
+	}
+	return workmem_size;
+}
+
+/*
+ * Statistics counting, see csnappy_stats_attach. Every use expands to
+ * nothing unless CSNAPPY_STATS is defined.
+ */
+#ifdef CSNAPPY_STATS
+#ifdef __KERNEL__
+#error CSNAPPY_STATS is only supported in userspace
+#endif
+#include "csnappy.h"
+extern __thread struct csnappy_stats *csnappy_stats_current;
+
+static INLINE int
+stats_offset_bits(uint32_t offset)
+{
+	return offset ? 32 - __builtin_clz(offset) : 0;
+}
+
+#define STATS_ADD(field, n)	do {					\
+					if (csnappy_stats_current)	\
+						csnappy_stats_current->field \
+							+= (n);		\
+				} while (0)
+#define STATS_LITERAL(ops, len)	do {					\
+					STATS_ADD(ops.literal_runs, 1);	\
+					STATS_ADD(ops.literal_bytes, (len)); \
+				} while (0)
+#define STATS_COPY(ops, offset, len) do {				\
+					STATS_ADD(ops.copies, 1);	\
+					STATS_ADD(ops.copy_bytes, (len)); \
+					STATS_ADD(ops.copy_length[len], 1); \
+					STATS_ADD(ops.copy_offset[	\
+					  stats_offset_bits(offset)], 1); \
+				} while (0)
+#else
+#define STATS_ADD(field, n)		do { } while (0)
+#define STATS_LITERAL(ops, len)		do { } while (0)
+#define STATS_COPY(ops, offset, len)	do { } while (0)
+#endif
+#define STATS_INC(field)		STATS_ADD(field, 1)
+
 enum {
 	LITERAL = 0,
 	COPY_1_BYTE_OFFSET = 1,  /* 3 bit length + 3 bits of offset in opcode */
@@ -0,0 +1,164 @@
+/*
+Copyright 2011, Zeev Tarantov <zeev.tarantov@gmail.com>.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are
+met:
+
+  * Redistributions of source code must retain the above copyright
+notice, this list of conditions and the following disclaimer.
+  * Redistributions in binary form must reproduce the above
+copyright notice, this list of conditions and the following disclaimer
+in the documentation and/or other materials provided with the
+distribution.
+  * Neither the name of Zeev Tarantov nor the names of its
+contributors may be used to endorse or promote products derived from
+this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+Multi-threaded compression. Userspace only.
+*/
+
+#include "csnappy_internal.h"
+#include "csnappy.h"
+#include <stdlib.h>
+#include <pthread.h>
+#include <unistd.h>
+
+/*
+ * Fragments are handed out to workers in jobs of this many, to keep
+ * locking rare while still balancing load between threads.
+ */
+#define kFragmentsPerJob 32
+#define kFragmentSize 32768
+#define kJobSize (kFragmentsPerJob * kFragmentSize)
+
+struct parallel_state {
+	const char *input;
+	uint32_t input_length;
+	int workmem_bytes_power_of_two;
+	char *output;
+	uint32_t written;	/* bytes committed to output */
+	uint32_t nr_jobs;
+	uint32_t next_job;	/* next job to hand out */
+	uint32_t next_commit;	/* next job allowed to commit its output */
+	pthread_mutex_t lock;
+	pthread_cond_t committed;
+};
+
+/*
+ * Each worker compresses a job into its own scratch buffer, then waits for
+ * its turn to reserve the next stretch of output, so jobs land in order.
+ * The copy itself is done outside the lock.
+ * A worker that cannot allocate its buffers takes no jobs; the others
+ * (including the calling thread) pick up the work.
+ */
+static void *
+compress_worker(void *opaque)
+{
+	struct parallel_state *st = (struct parallel_state *)opaque;
+	void *working_memory;
+	char *scratch, *p;
+	const char *input;
+	uint32_t job, job_length, n, offset;
+
+	working_memory = malloc(1 << st->workmem_bytes_power_of_two);
+	scratch = (char *)malloc(csnappy_max_compressed_length(kJobSize));
+	if (!working_memory || !scratch)
+		goto out;
+	for (;;) {
+		pthread_mutex_lock(&st->lock);
+		job = st->next_job++;
+		pthread_mutex_unlock(&st->lock);
+		if (job >= st->nr_jobs)
+			break;
+		input = st->input + (size_t)job * kJobSize;
+		job_length = min(st->input_length - job * kJobSize,
+				 (uint32_t)kJobSize);
+		p = scratch;
+		while (job_length > 0) {
+			n = min(job_length, (uint32_t)kFragmentSize);
+			p = csnappy_compress_fragment(input, n, p,
+				working_memory,
+				fragment_workmem_order(n, kFragmentSize,
+					st->workmem_bytes_power_of_two));
+			input += n;
+			job_length -= n;
+		}
+		pthread_mutex_lock(&st->lock);
+		while (st->next_commit != job)
+			pthread_cond_wait(&st->committed, &st->lock);
+		offset = st->written;
+		st->written += p - scratch;
+		st->next_commit++;
+		pthread_cond_broadcast(&st->committed);
+		pthread_mutex_unlock(&st->lock);
+		memcpy(st->output + offset, scratch, p - scratch);
+	}
+out:
+	free(scratch);
+	free(working_memory);
+	return NULL;
+}
+
+int
+csnappy_compress_parallel(
+	const char *input,
+	uint32_t input_length,
+	char *compressed,
+	uint32_t *out_compressed_length,
+	const int workmem_bytes_power_of_two,
+	int nr_threads)
+{
+	struct parallel_state st;
+	pthread_t *threads;
+	int i, started = 0;
+	char *p;
+
+	if (nr_threads <= 0)
+		nr_threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+	p = encode_varint32(compressed, input_length);
+	st.input = input;
+	st.input_length = input_length;
+	st.workmem_bytes_power_of_two = workmem_bytes_power_of_two;
+	st.output = p;
+	st.written = 0;
+	st.nr_jobs = input_length / kJobSize + (input_length % kJobSize != 0);
+	st.next_job = 0;
+	st.next_commit = 0;
+	if (nr_threads > (int)st.nr_jobs)
+		nr_threads = st.nr_jobs;
+	pthread_mutex_init(&st.lock, NULL);
+	pthread_cond_init(&st.committed, NULL);
+	threads = nr_threads > 1 ?
+		(pthread_t *)malloc((nr_threads - 1) * sizeof(*threads)) : NULL;
+	if (threads) {
+		for (i = 0; i < nr_threads - 1; i++) {
+			if (pthread_create(&threads[started], NULL,
+					   compress_worker, &st) == 0)
+				started++;
+		}
+	}
+	compress_worker(&st);
+	for (i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+	free(threads);
+	pthread_cond_destroy(&st.committed);
+	pthread_mutex_destroy(&st.lock);
+	if (st.next_commit != st.nr_jobs)
+		return CSNAPPY_E_NOMEM;
+	*out_compressed_length = (p - compressed) + st.written;
+	return CSNAPPY_E_OK;
+}
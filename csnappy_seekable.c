@@ -0,0 +1,420 @@
+/*
+Copyright 2011, Zeev Tarantov <zeev.tarantov@gmail.com>.
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are
+met:
+
+  * Redistributions of source code must retain the above copyright
+notice, this list of conditions and the following disclaimer.
+  * Redistributions in binary form must reproduce the above
+copyright notice, this list of conditions and the following disclaimer
+in the documentation and/or other materials provided with the
+distribution.
+  * Neither the name of Zeev Tarantov nor the names of its
+contributors may be used to endorse or promote products derived from
+this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+"AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+Seekable container: independently compressed blocks followed by an index
+of their offsets, so any byte range can be decompressed without touching
+the rest. The layout is described in csnappy.h. Userspace only.
+*/
+
+#include "csnappy_internal.h"
+#include "csnappy.h"
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+static const char header_magic[8] = {
+	's', 'N', 'a', 'P', 's', 'E', 'e', 'K'
+};
+static const char trailer_magic[8] = {
+	's', 'N', 'a', 'P', 'i', 'N', 'd', 'X'
+};
+
+#define kHeaderSize 16
+#define kTrailerSize 16
+
+static INLINE void
+put_le32(char *p, uint32_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+	p[2] = v >> 16;
+	p[3] = v >> 24;
+}
+
+static INLINE uint32_t
+get_le32(const char *p)
+{
+	const uint8_t *q = (const uint8_t *)p;
+	return q[0] | (q[1] << 8) | (q[2] << 16) | ((uint32_t)q[3] << 24);
+}
+
+static INLINE void
+put_le64(char *p, uint64_t v)
+{
+	put_le32(p, (uint32_t)v);
+	put_le32(p + 4, (uint32_t)(v >> 32));
+}
+
+static INLINE uint64_t
+get_le64(const char *p)
+{
+	return get_le32(p) | ((uint64_t)get_le32(p + 4) << 32);
+}
+
+
+/*
+ * The encoder buffer holds the block being gathered, followed by room for
+ * its compressed form. The index is kept in memory until finish, doubling
+ * as needed: 12 bytes per block.
+ */
+int
+csnappy_seekable_compress_init(
+	struct csnappy_seekable_compress *stream,
+	uint32_t block_size,
+	int flags,
+	void *working_memory,
+	const int workmem_bytes_power_of_two,
+	csnappy_write_fn write,
+	void *opaque)
+{
+	char header[kHeaderSize];
+	int ret;
+	stream->block_size = block_size;
+	stream->flags = flags;
+	stream->buffered = 0;
+	stream->nr_blocks = 0;
+	stream->index_room = 64;
+	stream->length = 0;
+	stream->working_memory = working_memory;
+	stream->workmem_bytes_power_of_two = workmem_bytes_power_of_two;
+	stream->write = write;
+	stream->opaque = opaque;
+	stream->buffer = (char *)malloc(block_size +
+				csnappy_max_compressed_length(block_size));
+	stream->offsets = (uint64_t *)malloc(
+				(stream->index_room + 1) * sizeof(uint64_t));
+	stream->checksums = (uint32_t *)malloc(
+				stream->index_room * sizeof(uint32_t));
+	if (!stream->buffer || !stream->offsets || !stream->checksums) {
+		stream->status = CSNAPPY_E_NOMEM;
+		return stream->status;
+	}
+	stream->offsets[0] = kHeaderSize;
+	memcpy(header, header_magic, sizeof(header_magic));
+	put_le32(header + 8, block_size);
+	put_le32(header + 12, flags);
+	ret = write(opaque, header, kHeaderSize);
+	stream->status = ret < 0 ? ret : CSNAPPY_E_OK;
+	return stream->status;
+}
+
+static int
+seekable_emit(struct csnappy_seekable_compress *stream,
+	      const char *input, uint32_t input_length)
+{
+	char *out = stream->buffer + stream->block_size;
+	uint64_t *offsets;
+	uint32_t *checksums;
+	uint32_t compressed_length;
+	int ret;
+	if (stream->nr_blocks == stream->index_room) {
+		offsets = (uint64_t *)realloc(stream->offsets,
+			(2 * stream->index_room + 1) * sizeof(uint64_t));
+		if (!offsets)
+			return CSNAPPY_E_NOMEM;
+		stream->offsets = offsets;
+		checksums = (uint32_t *)realloc(stream->checksums,
+			2 * stream->index_room * sizeof(uint32_t));
+		if (!checksums)
+			return CSNAPPY_E_NOMEM;
+		stream->checksums = checksums;
+		stream->index_room *= 2;
+	}
+	if (stream->flags & CSNAPPY_SEEKABLE_CHECKSUMS)
+		stream->checksums[stream->nr_blocks] =
+			csnappy_crc32c(0, input, input_length);
+	csnappy_compress(input, input_length, out, &compressed_length,
+			 stream->working_memory,
+			 stream->workmem_bytes_power_of_two);
+	ret = stream->write(stream->opaque, out, compressed_length);
+	if (ret < 0)
+		return ret;
+	stream->offsets[stream->nr_blocks + 1] =
+		stream->offsets[stream->nr_blocks] + compressed_length;
+	stream->nr_blocks++;
+	return CSNAPPY_E_OK;
+}
+
+int
+csnappy_seekable_compress_update(
+	struct csnappy_seekable_compress *stream,
+	const char *input,
+	uint32_t input_length)
+{
+	const uint32_t block_size = stream->block_size;
+	uint32_t n;
+	if (stream->status < 0)
+		return stream->status;
+	while (input_length > 0) {
+		if (!stream->buffered && input_length >= block_size) {
+			/* Whole block available: compress it in place. */
+			n = block_size;
+			stream->status = seekable_emit(stream, input, n);
+		} else {
+			n = min(input_length, block_size - stream->buffered);
+			memcpy(stream->buffer + stream->buffered, input, n);
+			stream->buffered += n;
+			if (stream->buffered == block_size) {
+				stream->buffered = 0;
+				stream->status = seekable_emit(stream,
+						stream->buffer, block_size);
+			}
+		}
+		if (stream->status < 0)
+			return stream->status;
+		stream->length += n;
+		input += n;
+		input_length -= n;
+	}
+	return CSNAPPY_E_OK;
+}
+
+/*
+ * Writes the index and trailer through the encoder buffer, which is free
+ * by now, flushing it whenever it fills up. Even for one byte blocks it
+ * has room for an index entry and the trailer.
+ */
+static int
+seekable_write_index(struct csnappy_seekable_compress *stream)
+{
+	char *p = stream->buffer, *end = stream->buffer + stream->block_size;
+	uint32_t i, nr_checksums = 0;
+	int ret;
+	if (stream->flags & CSNAPPY_SEEKABLE_CHECKSUMS)
+		nr_checksums = stream->nr_blocks;
+	end += csnappy_max_compressed_length(stream->block_size) - kTrailerSize;
+	for (i = 0; i <= stream->nr_blocks + nr_checksums; i++) {
+		if (p + 8 > end) {
+			ret = stream->write(stream->opaque,
+					    stream->buffer, p - stream->buffer);
+			if (ret < 0)
+				return ret;
+			p = stream->buffer;
+		}
+		if (i <= stream->nr_blocks) {
+			put_le64(p, stream->offsets[i]);
+			p += 8;
+		} else {
+			put_le32(p, stream->checksums[i - 1 - stream->nr_blocks]);
+			p += 4;
+		}
+	}
+	put_le64(p, stream->length);
+	memcpy(p + 8, trailer_magic, sizeof(trailer_magic));
+	p += kTrailerSize;
+	ret = stream->write(stream->opaque, stream->buffer, p - stream->buffer);
+	return ret < 0 ? ret : CSNAPPY_E_OK;
+}
+
+int
+csnappy_seekable_compress_finish(
+	struct csnappy_seekable_compress *stream)
+{
+	if (stream->status >= 0 && stream->buffered)
+		stream->status = seekable_emit(stream,
+				stream->buffer, stream->buffered);
+	stream->buffered = 0;
+	if (stream->status >= 0)
+		stream->status = seekable_write_index(stream);
+	free(stream->checksums);
+	free(stream->offsets);
+	free(stream->buffer);
+	stream->checksums = NULL;
+	stream->offsets = NULL;
+	stream->buffer = NULL;
+	return stream->status;
+}
+
+
+/*
+ * Everything the index layout promises is checked here; the offsets
+ * themselves only when a block is read, so opening is O(1).
+ */
+int
+csnappy_seekable_open(
+	struct csnappy_seekable *reader,
+	const char *data,
+	uint64_t size)
+{
+	uint64_t length, nr_blocks, index_size;
+	uint32_t block_size;
+	reader->mapped = 0;
+	reader->scratch = NULL;
+	if (size < kHeaderSize + kTrailerSize ||
+	    memcmp(data, header_magic, sizeof(header_magic)) ||
+	    memcmp(data + size - 8, trailer_magic, sizeof(trailer_magic)))
+		return CSNAPPY_E_HEADER_BAD;
+	block_size = get_le32(data + 8);
+	if (block_size < 1 || block_size > CSNAPPY_SEEKABLE_MAX_BLOCK_BYTES)
+		return CSNAPPY_E_HEADER_BAD;
+	length = get_le64(data + size - kTrailerSize);
+	nr_blocks = length / block_size + (length % block_size != 0);
+	if (nr_blocks >= 0xffffffffU)
+		return CSNAPPY_E_HEADER_BAD;
+	reader->flags = get_le32(data + 12);
+	index_size = 8 * (nr_blocks + 1);
+	if (reader->flags & CSNAPPY_SEEKABLE_CHECKSUMS)
+		index_size += 4 * nr_blocks;
+	if (size - kHeaderSize - kTrailerSize < index_size)
+		return CSNAPPY_E_HEADER_BAD;
+	reader->data = data;
+	reader->size = size;
+	reader->length = length;
+	reader->block_size = block_size;
+	reader->nr_blocks = (uint32_t)nr_blocks;
+	reader->index = data + size - kTrailerSize - index_size;
+	reader->checksums = reader->index + 8 * (nr_blocks + 1);
+	reader->cached_block = reader->nr_blocks;
+	if (!(reader->scratch = (char *)malloc(block_size)))
+		return CSNAPPY_E_NOMEM;
+	return CSNAPPY_E_OK;
+}
+
+int
+csnappy_seekable_open_file(
+	struct csnappy_seekable *reader,
+	const char *path)
+{
+	struct stat st;
+	void *map;
+	int fd, ret;
+	reader->mapped = 0;
+	reader->scratch = NULL;
+	if ((fd = open(path, O_RDONLY)) < 0)
+		return CSNAPPY_E_IO;
+	if (fstat(fd, &st)) {
+		close(fd);
+		return CSNAPPY_E_IO;
+	}
+	if (!st.st_size) {
+		close(fd);
+		return CSNAPPY_E_HEADER_BAD;
+	}
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return CSNAPPY_E_IO;
+#ifdef MADV_RANDOM
+	madvise(map, st.st_size, MADV_RANDOM);
+#endif
+	ret = csnappy_seekable_open(reader, (const char *)map, st.st_size);
+	if (ret < 0) {
+		free(reader->scratch);
+		munmap(map, st.st_size);
+		return ret;
+	}
+	reader->mapped = 1;
+	return CSNAPPY_E_OK;
+}
+
+/* Decodes block "i", "block_length" bytes long, into "dst". */
+static int
+seekable_block(struct csnappy_seekable *reader, uint32_t i,
+	       uint32_t block_length, char *dst)
+{
+	const uint64_t start = get_le64(reader->index + 8 * (uint64_t)i);
+	const uint64_t end = get_le64(reader->index + 8 * (uint64_t)i + 8);
+	const uint64_t limit = reader->index - reader->data;
+	uint32_t olen;
+	int ret;
+	if (start < kHeaderSize || start > end || end > limit ||
+	    end - start > csnappy_max_compressed_length(reader->block_size))
+		return CSNAPPY_E_DATA_MALFORMED;
+	ret = csnappy_get_uncompressed_length(reader->data + start,
+					      end - start, &olen);
+	if (ret < 0)
+		return ret;
+	if (olen != block_length)
+		return CSNAPPY_E_DATA_MALFORMED;
+	ret = csnappy_decompress(reader->data + start, end - start,
+				 dst, block_length);
+	if (ret < 0)
+		return ret;
+	if ((reader->flags & CSNAPPY_SEEKABLE_CHECKSUMS) &&
+	    get_le32(reader->checksums + 4 * (uint64_t)i) !=
+	    csnappy_crc32c(0, dst, block_length))
+		return CSNAPPY_E_CHECKSUM_BAD;
+	return CSNAPPY_E_OK;
+}
+
+int
+csnappy_seekable_read(
+	struct csnappy_seekable *reader,
+	uint64_t offset,
+	char *buf,
+	uint32_t len)
+{
+	const uint32_t block_size = reader->block_size;
+	uint32_t i, skip, block_length, n;
+	int ret;
+	if (offset > reader->length || len > reader->length - offset)
+		return CSNAPPY_E_OUTPUT_OVERRUN;
+	i = (uint32_t)(offset / block_size);
+	skip = (uint32_t)(offset % block_size);
+	while (len > 0) {
+		block_length = block_size;
+		if (i == reader->nr_blocks - 1)
+			block_length = reader->length - (uint64_t)i * block_size;
+		n = min(len, block_length - skip);
+		if (n == block_length) {
+			ret = seekable_block(reader, i, block_length, buf);
+			if (ret < 0)
+				return ret;
+		} else {
+			if (reader->cached_block != i) {
+				reader->cached_block = reader->nr_blocks;
+				ret = seekable_block(reader, i, block_length,
+						     reader->scratch);
+				if (ret < 0)
+					return ret;
+				reader->cached_block = i;
+			}
+			memcpy(buf, reader->scratch + skip, n);
+		}
+		buf += n;
+		len -= n;
+		skip = 0;
+		i++;
+	}
+	return CSNAPPY_E_OK;
+}
+
+void
+csnappy_seekable_close(
+	struct csnappy_seekable *reader)
+{
+	free(reader->scratch);
+	reader->scratch = NULL;
+	if (reader->mapped)
+		munmap((void *)reader->data, reader->size);
+	reader->mapped = 0;
+}
@@ -0,0 +1,117 @@
+/*
+Microbenchmark for the FindMatchLength implementations in csnappy_compress.c.
+
+For each bucket of match lengths, times every implementation available on
+this CPU over the same set of (s1, s2) pairs and prints MB/s of compared
+input. The source file is included so the static functions can be reached.
+*/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "csnappy_compress.c"
+
+#define NR_PAIRS 4096
+#define SPAN 8192
+
+typedef int (*fml_fn)(const char *, const char *, const char *);
+
+struct impl {
+	const char *name;
+	fml_fn fn;
+};
+
+static int
+find_match_length_dispatched(const char *s1, const char *s2, const char *s2_limit)
+{
+	return FindMatchLength(s1, s2, s2_limit);
+}
+
+#if defined(__x86_64__) || defined(__aarch64__)
+static int
+find_match_length_64(const char *s1, const char *s2, const char *s2_limit)
+{
+	return FindMatchLength64(s1, s2, s2_limit);
+}
+#endif
+
+static const struct impl impls[] = {
+#if defined(__x86_64__) || defined(__aarch64__)
+	{ "64bit", find_match_length_64 },
+#endif
+#ifdef CSNAPPY_X86_64_SIMD
+	{ "sse2", FindMatchLengthSSE2 },
+	{ "avx2", FindMatchLengthAVX2 },
+#endif
+	{ "dispatched", find_match_length_dispatched },
+};
+
+static const int buckets[][2] = {
+	{ 4, 7 }, { 8, 15 }, { 16, 31 }, { 32, 63 }, { 64, 127 },
+	{ 128, 255 }, { 256, 1023 }, { 1024, 4096 },
+};
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(void)
+{
+	char *buf;
+	int *len;
+	unsigned b, i, j, k;
+	volatile int sink = 0;
+	double t, best;
+	uint64_t bytes;
+
+	if (!(buf = malloc(2 * SPAN)) || !(len = malloc(NR_PAIRS * sizeof(int)))) {
+		perror("malloc");
+		return 1;
+	}
+	for (i = 0; i < SPAN; i++)
+		buf[i] = buf[SPAN + i] = (char)rand();
+	printf("bucket\t");
+	for (j = 0; j < sizeof(impls) / sizeof(impls[0]); j++)
+		printf("\t%s", impls[j].name);
+	printf("\t(MB/s)\n");
+	for (b = 0; b < sizeof(buckets) / sizeof(buckets[0]); b++) {
+		const int lo = buckets[b][0], hi = buckets[b][1];
+		bytes = 0;
+		for (i = 0; i < NR_PAIRS; i++) {
+			len[i] = lo + rand() % (hi - lo + 1);
+			bytes += len[i];
+		}
+		printf("%d-%d\t", lo, hi);
+		for (j = 0; j < sizeof(impls) / sizeof(impls[0]); j++) {
+#ifdef CSNAPPY_X86_64_SIMD
+			if (impls[j].fn == FindMatchLengthAVX2 &&
+			    !__builtin_cpu_supports("avx2")) {
+				printf("\t-");
+				continue;
+			}
+#endif
+			best = 1e9;
+			for (k = 0; k < 20; k++) {
+				t = now();
+				for (i = 0; i < NR_PAIRS; i++) {
+					/* Mismatch right after len[i] bytes. */
+					char *s2 = buf + SPAN;
+					s2[len[i]] ^= 1;
+					sink += impls[j].fn(buf, s2, s2 + SPAN);
+					s2[len[i]] ^= 1;
+				}
+				t = now() - t;
+				if (t < best)
+					best = t;
+			}
+			printf("\t%.0f", bytes / best / 1e6);
+		}
+		printf("\n");
+	}
+	free(len);
+	free(buf);
+	return 0;
+}
@@ -0,0 +1,635 @@
+/*
+Userspace zram simulator, a reproducible stand-in for zramtest2.sh.
+
+Pages come from the files named on the command line (directories are
+walked recursively, in name order), 4KiB at a time with the last page of
+each file zero padded, as the page cache would hold them. By default every
+page is stored once, into consecutive slots, and then all are read back
+and verified, like the untar and md5sum of zramtest2.sh. With -r, the ops
+come from a trace instead, one per line:
+  w SLOT PAGE	store page number PAGE of the file set into SLOT
+  r SLOT	read SLOT back
+  d SLOT	discard SLOT
+(blank lines and lines starting with # are skipped).
+
+Stores follow the zram write path: same filled pages only keep their fill
+word, other pages are compressed with csnappy_compress_fragment and kept
+raw if that does not get them below the smallest huge size class. Objects
+go into a model of zsmalloc with 4KiB pages: size classes every 16 bytes
+from 32 to 4096, zspages of 1 to 4 pages, classes with the same layout
+merged, an 8 byte handle in each non-huge object, no compaction.
+Reported: the zram mm_stat sizes, how mem_used_total exceeds
+compr_data_size (handles, rounding up to class sizes, free objects in
+zspages), the memory compaction could reclaim, and compression, store and
+read latencies. Times cover the codec and allocator work only, not reading
+the input files, and include the cost of reading the clock.
+*/
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include "csnappy.h"
+
+#define PAGE_BYTES CSNAPPY_PAGE4K_BYTES
+#define ZS_MIN_ALLOC 32
+#define ZS_CLASS_DELTA 16
+#define ZS_MAX_PAGES_PER_ZSPAGE 4
+#define ZS_HANDLE_BYTES 8
+#define NR_CLASSES ((PAGE_BYTES - ZS_MIN_ALLOC) / ZS_CLASS_DELTA + 1)
+#define ZRAM_ENTRY_BYTES 16	/* handle and flags per slot */
+
+struct zspage;
+
+struct size_class {
+	uint32_t size;
+	int pages;		/* per zspage */
+	int objs;		/* per zspage */
+	uint64_t zspages;
+	uint64_t objects;
+	struct zspage *partial;	/* zspages with free objects */
+};
+
+/* Free objects hold the index of the next free one in their first bytes. */
+struct zspage {
+	struct size_class *class;
+	char *mem;
+	uint16_t used;
+	uint16_t first_free;
+	struct zspage *prev, *next;
+};
+
+static struct size_class classes[NR_CLASSES];
+static struct size_class *class_of[NR_CLASSES];
+static uint32_t huge_class_size;
+static uint64_t total_pages, max_pages;
+
+enum { SLOT_EMPTY, SLOT_SAME, SLOT_COMPRESSED, SLOT_HUGE };
+
+struct slot {
+	struct zspage *zspage;
+	uint16_t obj;
+	uint16_t length;
+	uint8_t state;
+	uint64_t fill;
+	uint64_t sum;		/* of the original page, to verify reads */
+};
+
+static struct slot *slots;
+static uint64_t nr_slots;
+
+/* Sizes in bytes, kept as zram and zsmalloc would see them. */
+static uint64_t orig_data_size, compr_data_size, handle_bytes, rounding;
+static uint64_t same_pages, huge_pages;
+
+/* Input files and the number of their first page in the set. */
+static char **files;
+static uint64_t *first_page;
+static uint64_t nr_files, nr_pages;
+
+struct latencies {
+	uint32_t *ns;
+	uint64_t n, room;
+	uint64_t total_ns;
+};
+static struct latencies compress_lat, store_lat, read_lat;
+
+static uint64_t verify_failures;
+
+static void *xmalloc(size_t n)
+{
+	void *p = malloc(n);
+	if (!p) {
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+	return p;
+}
+
+static void *xrealloc(void *p, size_t n)
+{
+	if (!(p = realloc(p, n))) {
+		perror("realloc");
+		exit(EXIT_FAILURE);
+	}
+	return p;
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void record(struct latencies *l, uint64_t ns)
+{
+	if (l->n == l->room) {
+		l->room = l->room ? 2 * l->room : 4096;
+		l->ns = xrealloc(l->ns, l->room * sizeof(*l->ns));
+	}
+	l->ns[l->n++] = ns > 0xffffffff ? 0xffffffff : ns;
+	l->total_ns += ns;
+}
+
+/* Pages per zspage that waste the least of it, as zsmalloc picks. */
+static int pages_per_zspage(uint32_t size)
+{
+	int i, best = 1, best_used = 0, used;
+	for (i = 1; i <= ZS_MAX_PAGES_PER_ZSPAGE; i++) {
+		used = (i * PAGE_BYTES - i * PAGE_BYTES % size) * 100 /
+			(i * PAGE_BYTES);
+		if (used > best_used) {
+			best_used = used;
+			best = i;
+		}
+	}
+	return best;
+}
+
+/*
+ * Going from the largest class down, a class laid out like the one above
+ * it is merged into it. Sizes from huge_class_size up end in a class of
+ * one object per page, so zram stores those pages uncompressed.
+ */
+static void init_classes(void)
+{
+	struct size_class *prev = NULL, *c;
+	uint32_t size;
+	int i, pages, objs;
+
+	for (i = NR_CLASSES - 1; i >= 0; i--) {
+		size = ZS_MIN_ALLOC + i * ZS_CLASS_DELTA;
+		pages = pages_per_zspage(size);
+		objs = pages * PAGE_BYTES / size;
+		if (!huge_class_size && pages != 1 && objs != 1)
+			huge_class_size = size - (ZS_HANDLE_BYTES - 1);
+		if (prev && prev->pages == pages && prev->objs == objs) {
+			class_of[i] = prev;
+			continue;
+		}
+		c = &classes[i];
+		c->size = size;
+		c->pages = pages;
+		c->objs = objs;
+		class_of[i] = prev = c;
+	}
+}
+
+static struct size_class *size_class(uint32_t size)
+{
+	int i = 0;
+	if (size > ZS_MIN_ALLOC)
+		i = (size - ZS_MIN_ALLOC + ZS_CLASS_DELTA - 1) / ZS_CLASS_DELTA;
+	return class_of[i < NR_CLASSES ? i : NR_CLASSES - 1];
+}
+
+static char *object(struct zspage *z, uint16_t obj)
+{
+	return z->mem + (size_t)obj * z->class->size;
+}
+
+static void unlink_partial(struct zspage *z)
+{
+	if (z->prev)
+		z->prev->next = z->next;
+	else
+		z->class->partial = z->next;
+	if (z->next)
+		z->next->prev = z->prev;
+}
+
+static void link_partial(struct zspage *z)
+{
+	z->prev = NULL;
+	z->next = z->class->partial;
+	if (z->next)
+		z->next->prev = z;
+	z->class->partial = z;
+}
+
+static struct zspage *zs_malloc(uint32_t size, uint16_t *obj)
+{
+	struct size_class *c = size_class(size);
+	struct zspage *z = c->partial;
+	uint16_t i, next;
+
+	if (!z) {
+		z = xmalloc(sizeof(*z));
+		z->class = c;
+		z->mem = xmalloc((size_t)c->pages * PAGE_BYTES);
+		z->used = 0;
+		z->first_free = 0;
+		for (i = 0; i < c->objs; i++) {
+			next = i + 1;
+			memcpy(object(z, i), &next, sizeof(next));
+		}
+		link_partial(z);
+		c->zspages++;
+		total_pages += c->pages;
+		if (total_pages > max_pages)
+			max_pages = total_pages;
+	}
+	*obj = z->first_free;
+	memcpy(&z->first_free, object(z, *obj), sizeof(uint16_t));
+	if (++z->used == c->objs)
+		unlink_partial(z);
+	c->objects++;
+	rounding += c->size - size;
+	return z;
+}
+
+static void zs_free(struct zspage *z, uint16_t obj, uint32_t size)
+{
+	struct size_class *c = z->class;
+
+	memcpy(object(z, obj), &z->first_free, sizeof(uint16_t));
+	z->first_free = obj;
+	if (z->used-- == c->objs)
+		link_partial(z);
+	c->objects--;
+	rounding -= c->size - size;
+	if (!z->used) {
+		unlink_partial(z);
+		c->zspages--;
+		total_pages -= c->pages;
+		free(z->mem);
+		free(z);
+	}
+}
+
+static uint64_t page_sum(const char *page)
+{
+	uint64_t h = UINT64_C(14695981039346656037);
+	int i;
+	for (i = 0; i < PAGE_BYTES; i++)
+		h = (h ^ (uint8_t)page[i]) * UINT64_C(1099511628211);
+	return h;
+}
+
+static struct slot *get_slot(uint64_t index)
+{
+	uint64_t n;
+	if (index >= nr_slots) {
+		n = nr_slots ? nr_slots : 1024;
+		while (n <= index)
+			n *= 2;
+		slots = xrealloc(slots, n * sizeof(*slots));
+		memset(slots + nr_slots, 0, (n - nr_slots) * sizeof(*slots));
+		nr_slots = n;
+	}
+	return &slots[index];
+}
+
+static uint32_t object_size(const struct slot *s)
+{
+	return s->state == SLOT_HUGE ? PAGE_BYTES : s->length + ZS_HANDLE_BYTES;
+}
+
+static void discard(struct slot *s)
+{
+	if (s->state == SLOT_EMPTY)
+		return;
+	orig_data_size -= PAGE_BYTES;
+	if (s->state == SLOT_SAME) {
+		same_pages--;
+	} else {
+		zs_free(s->zspage, s->obj, object_size(s));
+		compr_data_size -= s->length;
+		if (s->state == SLOT_HUGE)
+			huge_pages--;
+		else
+			handle_bytes -= ZS_HANDLE_BYTES;
+	}
+	s->state = SLOT_EMPTY;
+}
+
+static void store(struct slot *s, const char *page, char *buf,
+		  void *workmem, int workmem_order)
+{
+	uint64_t t0, t1, t2;
+	const char *src = buf;
+	uint32_t length;
+
+	discard(s);
+	s->sum = page_sum(page);
+	orig_data_size += PAGE_BYTES;
+	t0 = now_ns();
+	if (csnappy_is_same_filled(page, PAGE_BYTES, &s->fill)) {
+		t1 = t2 = now_ns();
+		s->state = SLOT_SAME;
+		same_pages++;
+	} else {
+		length = csnappy_compress_fragment(page, PAGE_BYTES, buf,
+				workmem, workmem_order) - buf;
+		t1 = now_ns();
+		s->state = SLOT_COMPRESSED;
+		if (length >= huge_class_size) {
+			src = page;
+			length = PAGE_BYTES;
+			s->state = SLOT_HUGE;
+			huge_pages++;
+		} else {
+			handle_bytes += ZS_HANDLE_BYTES;
+		}
+		s->length = length;
+		s->zspage = zs_malloc(object_size(s), &s->obj);
+		memcpy(object(s->zspage, s->obj), src, length);
+		t2 = now_ns();
+		compr_data_size += length;
+		record(&compress_lat, t1 - t0);
+	}
+	record(&store_lat, t2 - t0);
+}
+
+static void load(const struct slot *s, char *page)
+{
+	uint64_t t0 = now_ns();
+	int i, ret = CSNAPPY_E_OK;
+
+	switch (s->state) {
+	case SLOT_EMPTY:
+		memset(page, 0, PAGE_BYTES);
+		break;
+	case SLOT_SAME:
+		for (i = 0; i < PAGE_BYTES; i += sizeof(s->fill))
+			memcpy(page + i, &s->fill, sizeof(s->fill));
+		break;
+	case SLOT_HUGE:
+		memcpy(page, object(s->zspage, s->obj), PAGE_BYTES);
+		break;
+	default:
+		ret = csnappy_decompress_page4k(object(s->zspage, s->obj),
+						s->length, page);
+	}
+	record(&read_lat, now_ns() - t0);
+	if (s->state != SLOT_EMPTY &&
+	    (ret != CSNAPPY_E_OK || page_sum(page) != s->sum))
+		verify_failures++;
+}
+
+static int cmp_name(const void *a, const void *b)
+{
+	return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+static void add_path(const char *path)
+{
+	struct stat st;
+	struct dirent *e;
+	char **names = NULL;
+	size_t n = 0, i;
+	DIR *d;
+
+	if (lstat(path, &st)) {
+		perror(path);
+		exit(EXIT_FAILURE);
+	}
+	if (S_ISREG(st.st_mode)) {
+		if (!st.st_size)
+			return;
+		files = xrealloc(files, (nr_files + 1) * sizeof(*files));
+		first_page = xrealloc(first_page,
+				      (nr_files + 1) * sizeof(*first_page));
+		files[nr_files] = strdup(path);
+		first_page[nr_files++] = nr_pages;
+		nr_pages += (st.st_size + PAGE_BYTES - 1) / PAGE_BYTES;
+		return;
+	}
+	if (!S_ISDIR(st.st_mode))
+		return;
+	if (!(d = opendir(path))) {
+		perror(path);
+		exit(EXIT_FAILURE);
+	}
+	while ((e = readdir(d))) {
+		if (!strcmp(e->d_name, ".") || !strcmp(e->d_name, ".."))
+			continue;
+		names = xrealloc(names, (n + 1) * sizeof(*names));
+		names[n] = xmalloc(strlen(path) + strlen(e->d_name) + 2);
+		sprintf(names[n++], "%s/%s", path, e->d_name);
+	}
+	closedir(d);
+	qsort(names, n, sizeof(*names), cmp_name);
+	for (i = 0; i < n; i++) {
+		add_path(names[i]);
+		free(names[i]);
+	}
+	free(names);
+}
+
+/* Reads page "index" of the file set, keeping the last file open. */
+static void read_page(uint64_t index, char *page)
+{
+	static int fd = -1;
+	static uint64_t open_file;
+	uint64_t lo = 0, hi = nr_files, mid;
+	ssize_t n;
+
+	while (hi - lo > 1) {
+		mid = (lo + hi) / 2;
+		if (first_page[mid] <= index)
+			lo = mid;
+		else
+			hi = mid;
+	}
+	if (fd < 0 || open_file != lo) {
+		if (fd >= 0)
+			close(fd);
+		if ((fd = open(files[lo], O_RDONLY)) < 0) {
+			perror(files[lo]);
+			exit(EXIT_FAILURE);
+		}
+		open_file = lo;
+	}
+	n = pread(fd, page, PAGE_BYTES,
+		  (off_t)(index - first_page[lo]) * PAGE_BYTES);
+	if (n < 0) {
+		perror(files[lo]);
+		exit(EXIT_FAILURE);
+	}
+	memset(page + n, 0, PAGE_BYTES - n);
+}
+
+static int cmp_u32(const void *a, const void *b)
+{
+	const uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+static void print_latencies(const char *name, struct latencies *l)
+{
+	if (!l->n)
+		return;
+	qsort(l->ns, l->n, sizeof(*l->ns), cmp_u32);
+	printf("%-9s %8.1f MB/s, ns/page: p50 %u p90 %u p99 %u p99.9 %u "
+	       "max %u\n", name,
+	       l->total_ns ? (double)l->n * PAGE_BYTES * 1e3 / l->total_ns : 0,
+	       l->ns[l->n / 2], l->ns[l->n * 9 / 10], l->ns[l->n * 99 / 100],
+	       l->ns[l->n * 999 / 1000], l->ns[l->n - 1]);
+}
+
+static void print_classes(void)
+{
+	int i;
+	printf("class size pages objs  zspages  objects\n");
+	for (i = 0; i < NR_CLASSES; i++)
+		if (classes[i].zspages)
+			printf("%10u %5d %4d %8.0f %8.0f\n", classes[i].size,
+			       classes[i].pages, classes[i].objs,
+			       (double)classes[i].zspages,
+			       (double)classes[i].objects);
+}
+
+static void report(int verbose)
+{
+	uint64_t mem_used = total_pages * PAGE_BYTES, compacted = 0;
+	uint64_t used_objects = 0, objects = 0, stored = 0, i;
+	int c;
+
+	for (c = 0; c < NR_CLASSES; c++) {
+		if (!classes[c].objs)
+			continue;
+		used_objects += classes[c].objects * classes[c].size;
+		compacted += (classes[c].objects + classes[c].objs - 1) /
+			classes[c].objs * classes[c].pages * PAGE_BYTES;
+		objects += classes[c].objects;
+	}
+	for (i = 0; i < nr_slots; i++)
+		stored += slots[i].state != SLOT_EMPTY;
+	if (verbose)
+		print_classes();
+	printf("pages stored         %12.0f (same filled %.0f, huge %.0f)\n",
+	       (double)stored, (double)same_pages,
+	       (double)huge_pages);
+	printf("orig_data_size       %12.0f\n",
+	       (double)orig_data_size);
+	printf("compr_data_size      %12.0f %6.1f%% of orig_data_size\n",
+	       (double)compr_data_size,
+	       orig_data_size ? 100.0 * compr_data_size / orig_data_size : 0);
+	printf("mem_used_total       %12.0f %6.1f%% of orig_data_size\n",
+	       (double)mem_used,
+	       orig_data_size ? 100.0 * mem_used / orig_data_size : 0);
+	printf("mem_used_max         %12.0f\n",
+	       (double)(max_pages * PAGE_BYTES));
+	printf("overhead             %12.0f %6.1f%% of compr_data_size\n",
+	       (double)(mem_used - compr_data_size),
+	       compr_data_size ?
+	       100.0 * (mem_used - compr_data_size) / compr_data_size : 0);
+	printf("  object handles     %12.0f\n",
+	       (double)handle_bytes);
+	printf("  class rounding     %12.0f\n", (double)rounding);
+	printf("  free objects       %12.0f\n",
+	       (double)(mem_used - used_objects));
+	printf("after compaction     %12.0f\n", (double)compacted);
+	printf("slot table, handles  %12.0f (outside mem_used_total)\n",
+	       (double)(nr_slots * ZRAM_ENTRY_BYTES +
+				    objects * sizeof(void *)));
+	print_latencies("compress", &compress_lat);
+	print_latencies("store", &store_lat);
+	print_latencies("read", &read_lat);
+	if (verify_failures)
+		printf("%.0f pages read back wrong\n",
+		       (double)verify_failures);
+}
+
+static void replay(FILE *trace, char *page, char *buf, void *workmem,
+		   int workmem_order)
+{
+	unsigned long slot, index;
+	char line[256], op = 0;
+	unsigned lineno = 0;
+	int n;
+
+	while (fgets(line, sizeof(line), trace)) {
+		lineno++;
+		if (line[0] == '#' || line[0] == '\n')
+			continue;
+		n = sscanf(line, " %c %lu %lu", &op, &slot, &index);
+		if (op == 'w' && n == 3 && index < nr_pages) {
+			read_page(index, page);
+			store(get_slot(slot), page, buf, workmem,
+			      workmem_order);
+		} else if (op == 'r' && n >= 2) {
+			load(get_slot(slot), page);
+		} else if (op == 'd' && n >= 2) {
+			discard(get_slot(slot));
+		} else {
+			fprintf(stderr, "trace line %u: bad op\n", lineno);
+			exit(EXIT_FAILURE);
+		}
+	}
+}
+
+int main(int argc, char * const argv[])
+{
+	const char *trace = NULL;
+	char *page, *buf;
+	void *workmem;
+	int c, i, verbose = 0;
+	int workmem_order = CSNAPPY_PAGE4K_WORKMEM_BYTES_POWER_OF_TWO;
+	uint64_t p;
+	FILE *f;
+
+	while ((c = getopt(argc, argv, "r:W:v")) != -1) {
+		switch (c) {
+		case 'r':
+			trace = optarg;
+			break;
+		case 'W':
+			workmem_order = atoi(optarg);
+			if (workmem_order < 9 || workmem_order > 15)
+				goto usage;
+			break;
+		case 'v':
+			verbose = 1;
+			break;
+		default:
+			goto usage;
+		}
+	}
+	if (optind == argc)
+		goto usage;
+	for (i = optind; i < argc; i++)
+		add_path(argv[i]);
+	if (!nr_pages) {
+		fprintf(stderr, "no pages in the files given\n");
+		return 1;
+	}
+	init_classes();
+	page = xmalloc(PAGE_BYTES);
+	buf = xmalloc(csnappy_max_compressed_length(PAGE_BYTES));
+	workmem = xmalloc(1 << workmem_order);
+	if (trace) {
+		if (!(f = fopen(trace, "r"))) {
+			perror(trace);
+			return 1;
+		}
+		replay(f, page, buf, workmem, workmem_order);
+		fclose(f);
+	} else {
+		for (p = 0; p < nr_pages; p++) {
+			read_page(p, page);
+			store(get_slot(p), page, buf, workmem, workmem_order);
+		}
+		for (p = 0; p < nr_pages; p++)
+			load(get_slot(p), page);
+	}
+	report(verbose);
+	free(workmem);
+	free(buf);
+	free(page);
+	return verify_failures ? 2 : 0;
+usage:
+	fprintf(stderr,
+	"usage: zram_sim [-W workmem_order] [-r trace] [-v] file|dir...\n"
+	"Stores the pages of the files given in a simulated zram device and\n"
+	"reads them back, or replays a trace of ops on those pages.\n"
+	"  -W  working memory is 2^N bytes, 9 to 15 (default 13)\n"
+	"  -v  also list the zsmalloc size classes in use\n");
+	return 1;
+}